@@ -0,0 +1,324 @@
+#include "aggregate.hh"
+#include "compress.hh"
+#include "hash.hh"
+#include "parallel.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <format>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <string>
+
+using namespace std::literals;
+
+
+namespace scql::data {
+
+  namespace {
+
+    const std::map<agg_op,std::string> agg_names {
+      { agg_op::count, "count"s },
+      { agg_op::sum, "sum"s },
+      { agg_op::min, "min"s },
+      { agg_op::max, "max"s },
+      { agg_op::mean, "mean"s },
+    };
+
+
+    using loader = double (*)(const std::byte*);
+
+    loader loader_for(data_type t)
+    {
+      switch (t) {
+      case data_type::u8:
+        return [](const std::byte* p) { return double(std::to_integer<uint8_t>(*p)); };
+      case data_type::u32:
+        return [](const std::byte* p) { uint32_t r; std::memcpy(&r, p, sizeof(r)); return double(r); };
+      case data_type::f32:
+        return [](const std::byte* p) { float r; std::memcpy(&r, p, sizeof(r)); return double(r); };
+      case data_type::f64:
+        return [](const std::byte* p) { double r; std::memcpy(&r, p, sizeof(r)); return r; };
+      case data_type::str:
+        break;
+      }
+      std::unreachable();
+    }
+
+
+    // Float keys are grouped by value: -0.0 becomes +0.0 and every NaN the quiet NaN, as in sort.cc.
+    // The canonical copy of KEY is written to BUF if the type needs one.
+    template<typename T>
+    void canonicalize(const std::byte* key, size_t csize, std::byte* buf)
+    {
+      for (size_t o = 0; o < csize; o += sizeof(T)) {
+        T v;
+        std::memcpy(&v, key + o, sizeof(v));
+        v = std::isnan(v) ? std::numeric_limits<T>::quiet_NaN() : v == T(0) ? T(0) : v;
+        std::memcpy(buf + o, &v, sizeof(v));
+      }
+    }
+
+    const std::byte* canonical_key(data_type t, const std::byte* key, size_t csize, std::byte* buf)
+    {
+      switch (t) {
+      case data_type::f32:
+        canonicalize<float>(key, csize, buf);
+        return buf;
+      case data_type::f64:
+        canonicalize<double>(key, csize, buf);
+        return buf;
+      default:
+        return key;
+      }
+    }
+
+
+    // Per-group state: the number of elements and one value per aggregate.
+    struct accumulators {
+      accumulators(const std::vector<aggregate>& aggs_) : aggs(aggs_) { }
+
+      void add_group()
+      {
+        counts.push_back(0);
+        for (const auto& a : aggs)
+          vals.push_back(a.op == agg_op::min ? HUGE_VAL : a.op == agg_op::max ? -HUGE_VAL : 0.0);
+      }
+
+      void update(size_t g, const std::vector<schema::column_view>& views, const std::vector<loader>& loaders, size_t i)
+      {
+        ++counts[g];
+        auto v = vals.data() + g * aggs.size();
+        for (size_t a = 0; a < aggs.size(); ++a)
+          switch (aggs[a].op) {
+          case agg_op::count:
+            break;
+          case agg_op::sum:
+          case agg_op::mean:
+            v[a] += loaders[a](views[a].addr(i));
+            break;
+          case agg_op::min:
+            v[a] = std::min(v[a], loaders[a](views[a].addr(i)));
+            break;
+          case agg_op::max:
+            v[a] = std::max(v[a], loaders[a](views[a].addr(i)));
+            break;
+          }
+      }
+
+      void merge(size_t g, const accumulators& other, size_t og)
+      {
+        counts[g] += other.counts[og];
+        auto v = vals.data() + g * aggs.size();
+        auto ov = other.vals.data() + og * aggs.size();
+        for (size_t a = 0; a < aggs.size(); ++a)
+          switch (aggs[a].op) {
+          case agg_op::count:
+            break;
+          case agg_op::sum:
+          case agg_op::mean:
+            v[a] += ov[a];
+            break;
+          case agg_op::min:
+            v[a] = std::min(v[a], ov[a]);
+            break;
+          case agg_op::max:
+            v[a] = std::max(v[a], ov[a]);
+            break;
+          }
+      }
+
+      const std::vector<aggregate>& aggs;
+      std::vector<uint64_t> counts { };
+      std::vector<double> vals { };
+    };
+
+
+    // Open-addressing hash table with linear probing.  Groups are numbered in the order of their first
+    // occurrence, the slots contain the group number plus one.
+    struct table {
+      table(size_t csize_, const std::vector<aggregate>& aggs) : csize(csize_), acc(aggs) { }
+
+      size_t find_or_insert(const std::byte* key, uint64_t h)
+      {
+        if (2 * (hashes.size() + 1) > slots.size())
+          grow();
+
+        auto mask = slots.size() - 1;
+        for (auto s = h & mask; ; s = (s + 1) & mask) {
+          if (slots[s] == 0) {
+            slots[s] = hashes.size() + 1;
+            hashes.push_back(h);
+            keys.insert(keys.end(), key, key + csize);
+            acc.add_group();
+            return hashes.size() - 1;
+          }
+          auto g = slots[s] - 1;
+          if (hashes[g] == h && std::memcmp(keys.data() + g * csize, key, csize) == 0)
+            return g;
+        }
+      }
+
+      void grow()
+      {
+        slots.assign(std::max(64zu, 2 * slots.size()), 0);
+        auto mask = slots.size() - 1;
+        for (size_t g = 0; g < hashes.size(); ++g) {
+          auto s = hashes[g] & mask;
+          while (slots[s] != 0)
+            s = (s + 1) & mask;
+          slots[s] = g + 1;
+        }
+      }
+
+      size_t ngroups() const { return hashes.size(); }
+      const std::byte* key(size_t g) const { return keys.data() + g * csize; }
+
+      size_t csize;
+      std::vector<uint32_t> slots { };
+      std::vector<uint64_t> hashes { };
+      std::vector<std::byte> keys { };
+      accumulators acc;
+    };
+
+  } // anonymous namespace
+
+
+  schema group_shape(const schema& s, size_t key, const std::vector<aggregate>& aggs)
+  {
+    schema res { "", { s.columns[key] }, { s.nelems() }, nullptr };
+    res.columns[0].encoding = encoding_type::plain;
+    res.columns[0].enc.reset();
+    for (const auto& a : aggs) {
+      auto label = a.op == agg_op::count ? "count"s : std::format("{}({})", agg_names.at(a.op), s.columns[a.column].label);
+      // Repeated aggregates get a suffix, column labels must be unique.
+      auto used = [&res](const std::string& l) { return std::ranges::any_of(res.columns, [&l](const auto& c) { return c.label == l; }); };
+      if (used(label)) {
+        size_t n = 1;
+        while (used(std::format("{}_{}", label, n)))
+          ++n;
+        label = std::format("{}_{}", label, n);
+      }
+      res.columns.emplace_back(a.op == agg_op::count ? data_type::u32 : data_type::f64, std::vector { 1zu }, std::move(label));
+    }
+    return res;
+  }
+
+
+  schema group(const schema& s, size_t key, const std::vector<aggregate>& aggs)
+  {
+    auto res = group_shape(s, key, aggs);
+    auto n = s.nelems();
+    auto csize = s.columns[key].size();
+
+    // Values are needed in the plain representation.  A dictionary encoded key is used as is, the
+    // codes index the groups directly.
+    const auto& kc = s.columns[key];
+    bool dict = kc.enc && kc.encoding == encoding_type::dictionary;
+    std::vector<size_t> cols;
+    if (! dict)
+      cols.push_back(key);
+    for (const auto& a : aggs)
+      if (a.op != agg_op::count)
+        cols.push_back(a.column);
+    auto ps = plain(s, cols);
+
+    std::vector<schema::column_view> views;
+    std::vector<loader> loaders;
+    for (const auto& a : aggs)
+      if (a.op == agg_op::count) {
+        // Not read, the count is kept separately.
+        views.push_back(schema::column_view { nullptr, 0, 0 });
+        loaders.push_back(nullptr);
+      } else {
+        views.push_back(ps.view(a.column));
+        loaders.push_back(loader_for(ps.columns[a.column].type));
+      }
+
+    auto nt = nthreads(n);
+    table global(csize, aggs);
+
+    if (dict || (kc.type == data_type::u8 && csize == 1)) {
+      // Dense keys: dictionary codes or bytes directly index the accumulators.
+      auto ndense = dict ? kc.enc->values.size() / csize : 256zu;
+      auto kv = dict ? schema::column_view { nullptr, 0, 0 } : ps.view(key);
+
+      std::vector<accumulators> partial(nt, accumulators(aggs));
+      parallel(nt, [&](unsigned t) {
+        auto& acc = partial[t];
+        for (size_t g = 0; g < ndense; ++g)
+          acc.add_group();
+        auto [from, to] = block(n, nt, t);
+        for (auto i = from; i < to; ++i)
+          acc.update(dict ? kc.enc->code(i) : std::to_integer<size_t>(*kv.addr(i)), views, loaders, i);
+      });
+
+      std::vector<std::byte> buf(csize);
+      for (size_t g = 0; g < ndense; ++g) {
+        std::byte b { static_cast<unsigned char>(g) };
+        auto k = dict ? canonical_key(kc.type, kc.enc->value(g), csize, buf.data()) : &b;
+        size_t gg = SIZE_MAX;
+        for (unsigned t = 0; t < nt; ++t)
+          if (partial[t].counts[g] != 0) {
+            if (gg == SIZE_MAX)
+              gg = global.find_or_insert(k, hash_bytes(k, csize));
+            global.acc.merge(gg, partial[t], g);
+          }
+      }
+    } else {
+      // Thread-local tables, merged in thread order.
+      auto kv = ps.view(key);
+      std::vector<table> partial(nt, table(csize, aggs));
+      parallel(nt, [&](unsigned t) {
+        auto& tab = partial[t];
+        std::vector<std::byte> buf(csize);
+        auto [from, to] = block(n, nt, t);
+        for (auto i = from; i < to; ++i) {
+          auto k = canonical_key(kc.type, kv.addr(i), csize, buf.data());
+          tab.acc.update(tab.find_or_insert(k, hash_bytes(k, csize)), views, loaders, i);
+        }
+      });
+
+      for (const auto& tab : partial)
+        for (size_t g = 0; g < tab.ngroups(); ++g)
+          global.acc.merge(global.find_or_insert(tab.key(g), tab.hashes[g]), tab.acc, g);
+    }
+
+    // Deterministic output: sort the groups by key.
+    std::vector<size_t> order(global.ngroups());
+    std::iota(order.begin(), order.end(), 0zu);
+    if (kc.type == data_type::str)
+      std::ranges::sort(order, [&](auto a, auto b) { return std::memcmp(global.key(a), global.key(b), csize) < 0; });
+    else
+      std::ranges::sort(order, [&](auto a, auto b) { return value_less(kc.type, global.key(a), global.key(b)); });
+
+    res.dimens = { order.size() };
+    auto buf = std::make_shared_for_overwrite<std::byte[]>(order.size() * res.row_size());
+    res.data = buf.get();
+    res.owner = std::move(buf);
+
+    std::vector<schema::column_view> outs;
+    for (size_t j = 0; j < res.columns.size(); ++j)
+      outs.push_back(res.view(j));
+    for (size_t i = 0; i < order.size(); ++i) {
+      auto g = order[i];
+      std::memcpy(outs[0].addr(i), global.key(g), csize);
+      auto v = global.acc.vals.data() + g * aggs.size();
+      for (size_t a = 0; a < aggs.size(); ++a) {
+        auto out = outs[1 + a].addr(i);
+        if (aggs[a].op == agg_op::count) {
+          uint32_t c = global.acc.counts[g];
+          std::memcpy(out, &c, sizeof(c));
+        } else {
+          double d = aggs[a].op == agg_op::mean ? v[a] / global.acc.counts[g] : v[a];
+          std::memcpy(out, &d, sizeof(d));
+        }
+      }
+    }
+
+    return res;
+  }
+
+} // namespace scql::data
@@ -0,0 +1,35 @@
+#ifndef _AGGREGATE_HH
+#define _AGGREGATE_HH 1
+
+#include <vector>
+
+#include "data.hh"
+
+
+namespace scql::data {
+
+  enum struct agg_op {
+    count,
+    sum,
+    min,
+    max,
+    mean,
+  };
+
+
+  struct aggregate {
+    agg_op op;
+    size_t column;    // Not used for count.
+  };
+
+
+  // Result of grouping S by column KEY: the key column followed by one column per aggregate.  The
+  // number of groups is only known after grouping, the shape uses the number of elements as the limit.
+  schema group_shape(const schema& s, size_t key, const std::vector<aggregate>& aggs);
+
+  // The groups are sorted by key, NaNs last.  Repeated aggregates are labelled count, count_1, etc.
+  schema group(const schema& s, size_t key, const std::vector<aggregate>& aggs);
+
+} // namespace scql::data
+
+#endif // aggregate.hh
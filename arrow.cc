@@ -0,0 +1,332 @@
+#include "arrow.hh"
+#include "compress.hh"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <format>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <utility>
+
+using namespace std::literals;
+
+
+namespace scql::data {
+
+  namespace {
+
+    const std::string dimens_key = "scql:dimens"s;
+
+
+    // Arrow metadata is a binary encoding of key/value pairs, all lengths are native 32-bit integers.
+    std::string dimens_metadata(const std::vector<size_t>& dimens)
+    {
+      if (dimens.size() <= 1)
+        return ""s;
+
+      std::string v;
+      for (auto d : dimens)
+        v += (v.empty() ? ""s : ","s) + std::to_string(d);
+
+      std::string res;
+      auto put = [&res](size_t n) { auto i = int32_t(n); res.append(reinterpret_cast<const char*>(&i), sizeof(i)); };
+      put(1);
+      put(dimens_key.size());
+      res += dimens_key;
+      put(v.size());
+      res += v;
+      return res;
+    }
+
+    std::optional<std::vector<size_t>> metadata_dimens(const char* md)
+    {
+      if (md == nullptr)
+        return std::nullopt;
+
+      auto get = [&md]() { int32_t i; std::memcpy(&i, md, sizeof(i)); md += sizeof(i); return size_t(i); };
+      auto n = get();
+      for (size_t k = 0; k < n; ++k) {
+        auto klen = get();
+        std::string_view key(md, klen);
+        md += klen;
+        auto vlen = get();
+        std::string_view val(md, vlen);
+        md += vlen;
+        if (key != dimens_key)
+          continue;
+
+        std::vector<size_t> res;
+        for (auto p = val.data(), e = val.data() + val.size(); p < e; ++p) {
+          size_t d;
+          auto [q, ec] = std::from_chars(p, e, d);
+          if (ec != std::errc())
+            return std::nullopt;
+          res.push_back(d);
+          p = q;
+        }
+        return res;
+      }
+      return std::nullopt;
+    }
+
+
+    const char* primitive_format(data_type t)
+    {
+      switch (t) {
+      case data_type::u8:
+        return "C";
+      case data_type::u32:
+        return "I";
+      case data_type::f32:
+        return "f";
+      case data_type::f64:
+        return "g";
+      case data_type::str:
+        break;
+      }
+      std::unreachable();
+    }
+
+    std::optional<data_type> primitive_type(std::string_view f)
+    {
+      if (f == "C")
+        return data_type::u8;
+      if (f == "I")
+        return data_type::u32;
+      if (f == "f")
+        return data_type::f32;
+      if (f == "g")
+        return data_type::f64;
+      return std::nullopt;
+    }
+
+    std::optional<size_t> fixed_size(std::string_view f, std::string_view pfx)
+    {
+      if (! f.starts_with(pfx))
+        return std::nullopt;
+      size_t res;
+      if (auto [p, ec] = std::from_chars(f.data() + pfx.size(), f.data() + f.size(), res); ec != std::errc() || p != f.data() + f.size() || res == 0)
+        return std::nullopt;
+      return res;
+    }
+
+
+    // The exported structures own their private data.  Children are released with the parent unless
+    // the consumer moved them out.
+    struct schema_node {
+      std::string format;
+      std::string name;
+      std::string metadata;
+      std::vector<ArrowSchema> child_structs {};
+      std::vector<ArrowSchema*> children {};
+    };
+
+    void release_schema(ArrowSchema* s)
+    {
+      auto node = static_cast<schema_node*>(s->private_data);
+      for (auto& c : node->child_structs)
+        if (c.release != nullptr)
+          c.release(&c);
+      delete node;
+      s->release = nullptr;
+    }
+
+    schema_node* make_schema(ArrowSchema* out, std::string format, std::string name, std::string metadata, size_t nchildren)
+    {
+      auto node = new schema_node { std::move(format), std::move(name), std::move(metadata) };
+      node->child_structs.resize(nchildren);
+      for (auto& c : node->child_structs)
+        node->children.push_back(&c);
+      *out = ArrowSchema { node->format.c_str(), node->name.c_str(), node->metadata.empty() ? nullptr : node->metadata.data(), 0, int64_t(nchildren), nchildren == 0 ? nullptr : node->children.data(), nullptr, release_schema, node };
+      return node;
+    }
+
+
+    struct array_node {
+      std::shared_ptr<const void> owner;
+      std::vector<const void*> buffers;
+      std::vector<ArrowArray> child_structs {};
+      std::vector<ArrowArray*> children {};
+    };
+
+    void release_array(ArrowArray* a)
+    {
+      auto node = static_cast<array_node*>(a->private_data);
+      for (auto& c : node->child_structs)
+        if (c.release != nullptr)
+          c.release(&c);
+      delete node;
+      a->release = nullptr;
+    }
+
+    array_node* make_array(ArrowArray* out, const std::shared_ptr<const void>& owner, size_t length, std::vector<const void*> buffers, size_t nchildren)
+    {
+      auto node = new array_node { owner, std::move(buffers) };
+      node->child_structs.resize(nchildren);
+      for (auto& c : node->child_structs)
+        node->children.push_back(&c);
+      *out = ArrowArray { int64_t(length), 0, 0, int64_t(node->buffers.size()), int64_t(nchildren), node->buffers.data(), nchildren == 0 ? nullptr : node->children.data(), nullptr, release_array, node };
+      return node;
+    }
+
+
+    void export_column(const schema::column& c, const std::byte* values, size_t n, const std::shared_ptr<const void>& owner, ArrowSchema* os, ArrowArray* oa)
+    {
+      auto md = dimens_metadata(c.dimens);
+      if (c.type == data_type::str) {
+        make_schema(os, "w:"s + std::to_string(c.size()), c.label, std::move(md), 0);
+        make_array(oa, owner, n, { nullptr, values }, 0);
+      } else if (auto k = c.size() / type_size(c.type); k == 1) {
+        make_schema(os, primitive_format(c.type), c.label, std::move(md), 0);
+        make_array(oa, owner, n, { nullptr, values }, 0);
+      } else {
+        auto sn = make_schema(os, "+w:"s + std::to_string(k), c.label, std::move(md), 1);
+        make_schema(sn->children[0], primitive_format(c.type), "item"s, ""s, 0);
+        auto an = make_array(oa, owner, n, { nullptr }, 1);
+        make_array(an->children[0], owner, n * k, { nullptr, values }, 0);
+      }
+    }
+
+
+    // Column description and the address of the values of element OFFSET.  The array must have at
+    // least N elements from there on.
+    std::variant<std::pair<schema::column,const std::byte*>,std::string> import_column(const ArrowSchema* t, const ArrowArray* a, size_t offset, size_t n)
+    {
+      if (a->length < 0 || a->offset < 0 || size_t(a->length) < offset + n)
+        return std::format("column {} is shorter than the array", t->name ? t->name : "");
+      if (a->null_count > 0 || (a->null_count < 0 && a->n_buffers > 0 && a->buffers[0] != nullptr))
+        return std::format("column {} contains nulls", t->name ? t->name : "");
+
+      schema::column c { data_type::u8, { 1zu }, t->name ? t->name : ""s };
+      std::string_view f = t->format;
+      const ArrowArray* values = a;
+      if (auto p = primitive_type(f))
+        c.type = *p;
+      else if (auto w = fixed_size(f, "w:")) {
+        c.type = data_type::str;
+        c.dimens = { *w };
+      } else if (auto l = fixed_size(f, "+w:"); l && t->n_children == 1 && a->n_children == 1) {
+        auto e = primitive_type(t->children[0]->format);
+        values = a->children[0];
+        if (! e || values->null_count > 0)
+          return std::format("unsupported list type in column {}", c.label);
+        if (values->length < 0 || values->offset < 0 || size_t(values->length) < (a->offset + offset + n) * *l)
+          return std::format("values of column {} are shorter than the array", c.label);
+        c.type = *e;
+        c.dimens = { *l };
+      } else
+        return std::format("unsupported format {} of column {}", f, c.label);
+
+      if (auto d = metadata_dimens(t->metadata)) {
+        size_t prod = 1;
+        for (auto e : *d)
+          prod *= e;
+        if (prod * type_size(c.type) == c.size())
+          c.dimens = *d;
+      }
+
+      if (values->n_buffers < 2 || values->buffers[1] == nullptr)
+        return std::format("column {} has no data", c.label);
+      auto p = static_cast<const std::byte*>(values->buffers[1]) + (offset + a->offset) * c.size();
+      if (values != a)
+        p += values->offset * type_size(c.type);
+      return std::make_pair(std::move(c), p);
+    }
+
+  } // anonymous namespace
+
+
+  void export_arrow(const schema& s, ArrowSchema* out_schema, ArrowArray* out_array)
+  {
+    auto ps = plain(s);
+    auto n = ps.nelems();
+
+    // With a single column both layouts are the same and the data is exported in place.
+    if (ps.layout == layout_type::rows && ps.columns.size() > 1) {
+      schema cols { ps.title, ps.columns, ps.dimens, nullptr };
+      cols.layout = layout_type::columns;
+      auto buf = std::make_shared_for_overwrite<std::byte[]>(n * cols.row_size());
+      cols.data = buf.get();
+      cols.owner = std::move(buf);
+      for (size_t j = 0; j < cols.columns.size(); ++j) {
+        auto from = ps.view(j);
+        auto to = cols.view(j);
+        for (size_t i = 0; i < n; ++i)
+          std::memcpy(to.addr(i), from.addr(i), to.stride);
+      }
+      ps = std::move(cols);
+    }
+
+    auto ncols = ps.columns.size();
+    auto sn = make_schema(out_schema, "+s"s, ps.title, dimens_metadata(ps.dimens), ncols);
+    auto an = make_array(out_array, ps.owner, n, { nullptr }, ncols);
+    for (size_t j = 0; j < ncols; ++j)
+      export_column(ps.columns[j], ps.view(j).base, n, ps.owner, sn->children[j], an->children[j]);
+  }
+
+
+  std::variant<schema,std::string> import_arrow(const ArrowSchema* type, ArrowArray* array)
+  {
+    std::shared_ptr<ArrowArray> held(new ArrowArray(*array), [](ArrowArray* a) { if (a->release != nullptr) a->release(a); delete a; });
+    array->release = nullptr;
+
+    if (held->length < 0 || held->offset < 0)
+      return "invalid array length or offset"s;
+    auto n = size_t(held->length);
+    schema res { type->name ? type->name : ""s, { }, { n }, nullptr, false };
+    res.layout = layout_type::columns;
+
+    std::vector<const std::byte*> ptrs;
+    auto add = [&](const ArrowSchema* t, const ArrowArray* a, size_t offset) -> std::optional<std::string> {
+      auto c = import_column(t, a, offset, n);
+      if (std::holds_alternative<std::string>(c))
+        return std::get<std::string>(c);
+      auto& [col, p] = std::get<std::pair<schema::column,const std::byte*>>(c);
+      res.columns.emplace_back(std::move(col));
+      ptrs.push_back(p);
+      return std::nullopt;
+    };
+
+    if (std::string_view(type->format) == "+s") {
+      if (held->null_count > 0)
+        return "struct array contains nulls"s;
+      if (type->n_children != held->n_children)
+        return "type and array do not match"s;
+      for (int64_t j = 0; j < held->n_children; ++j)
+        if (auto err = add(type->children[j], held->children[j], held->offset))
+          return *err;
+      if (auto d = metadata_dimens(type->metadata)) {
+        size_t prod = 1;
+        for (auto e : *d)
+          prod *= e;
+        if (prod == n)
+          res.dimens = *d;
+      }
+    } else if (auto err = add(type, held.get(), 0))
+      return *err;
+
+    if (res.columns.empty())
+      return "no columns"s;
+
+    // The buffers can be used if they are where column layout data would be.
+    bool in_place = true;
+    for (size_t j = 0; j < ptrs.size(); ++j)
+      in_place &= ptrs[j] == ptrs[0] + res.column_offset(j) * n;
+
+    if (in_place) {
+      res.data = const_cast<std::byte*>(ptrs[0]);
+      res.owner = std::move(held);
+    } else {
+      auto buf = std::make_shared_for_overwrite<std::byte[]>(n * res.row_size());
+      res.data = buf.get();
+      res.owner = std::move(buf);
+      for (size_t j = 0; j < ptrs.size(); ++j)
+        std::memcpy(res.view(j).base, ptrs[j], n * res.columns[j].size());
+    }
+
+    return res;
+  }
+
+} // namespace scql::data
@@ -0,0 +1,70 @@
+#ifndef _ARROW_HH
+#define _ARROW_HH 1
+
+#include <cstdint>
+#include <string>
+#include <variant>
+
+#include "data.hh"
+
+
+// The structures of the Arrow C data interface, as defined by the specification.  Other engines
+// include the same definitions, the guard prevents duplicates.
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+extern "C" {
+
+  struct ArrowSchema {
+    const char* format;
+    const char* name;
+    const char* metadata;
+    int64_t flags;
+    int64_t n_children;
+    struct ArrowSchema** children;
+    struct ArrowSchema* dictionary;
+    void (*release)(struct ArrowSchema*);
+    void* private_data;
+  };
+
+  struct ArrowArray {
+    int64_t length;
+    int64_t null_count;
+    int64_t offset;
+    int64_t n_buffers;
+    int64_t n_children;
+    const void** buffers;
+    struct ArrowArray** children;
+    struct ArrowArray* dictionary;
+    void (*release)(struct ArrowArray*);
+    void* private_data;
+  };
+
+} // extern "C"
+
+#endif // ARROW_C_DATA_INTERFACE
+
+
+namespace scql::data {
+
+  // A schema is exported as a struct array with one child per column.  Scalar columns are primitive
+  // arrays, strings fixed-size binary, and columns with multiple values per element fixed-size lists.
+  // Multi-dimensional shapes are recorded in the metadata with the key "scql:dimens".  Column layout
+  // data and data with a single column are exported without copying, the release callbacks keep it
+  // alive.  Other data is converted to column layout first.
+  void export_arrow(const schema& s, ArrowSchema* out_schema, ArrowArray* out_array);
+
+  // Import an array with the given type.  ARRAY is moved, the release callback of the caller's
+  // structure is cleared.  A schema has a single data pointer, the buffers are therefore only used in
+  // place if they are laid out like column layout data, i.e., for a single column or data exported
+  // by export_arrow.  The separate buffers of the columns of other engines' struct arrays are copied.
+  // Arrays with nulls cannot be represented.
+  std::variant<schema,std::string> import_arrow(const ArrowSchema* type, ArrowArray* array);
+
+} // namespace scql::data
+
+#endif // arrow.hh
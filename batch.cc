@@ -0,0 +1,123 @@
+#include "batch.hh"
+#include "compress.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <random>
+
+
+namespace scql::data {
+
+  size_t nrecords(const schema& s)
+  {
+    return s.dimens.empty() ? 0 : s.dimens[0];
+  }
+
+
+  std::vector<uint32_t> permutation(size_t n, uint64_t seed)
+  {
+    std::vector<uint32_t> res(n);
+    std::iota(res.begin(), res.end(), 0u);
+    std::mt19937_64 gen(seed);
+    std::ranges::shuffle(res, gen);
+    return res;
+  }
+
+
+  batch_stream::batch_stream(const std::vector<const schema*>& in_, size_t n_, std::vector<uint32_t> perm_, size_t depth_)
+  : in(), n(std::max(1zu, n_)), perm(std::move(perm_)), depth(std::max(1zu, depth_)), nbatches(0), gathered(! perm.empty())
+  {
+    for (auto p : in_) {
+      in.emplace_back(plain(*p));
+      gathered |= in.back().layout != layout_type::rows;
+    }
+    if (! in.empty())
+      nbatches = (nrecords(in[0]) + n - 1) / n;
+
+    if (gathered && nbatches > 0)
+      worker = std::jthread([this](std::stop_token st) { produce(st); });
+  }
+
+
+  std::vector<schema> batch_stream::next()
+  {
+    if (consumed == nbatches)
+      return { };
+
+    if (! gathered)
+      return make(consumed++);
+
+    std::unique_lock guard(lock);
+    cv.wait(guard, [this]{ return ! ready.empty(); });
+    auto res = std::move(ready.front());
+    ready.pop_front();
+    ++consumed;
+    guard.unlock();
+    cv.notify_all();
+    return res;
+  }
+
+
+  void batch_stream::produce(std::stop_token st)
+  {
+    for (size_t b = 0; b < nbatches; ++b) {
+      {
+        std::unique_lock guard(lock);
+        if (! cv.wait(guard, st, [this]{ return ready.size() < depth; }))
+          return;
+      }
+
+      // The gathering is done without holding the lock.
+      auto batch = make(b);
+
+      {
+        std::lock_guard guard(lock);
+        ready.emplace_back(std::move(batch));
+      }
+      cv.notify_all();
+    }
+  }
+
+
+  std::vector<schema> batch_stream::make(size_t b) const
+  {
+    auto from = b * n;
+    auto cnt = std::min(n, nrecords(in[0]) - from);
+
+    std::vector<schema> res;
+    for (const auto& s : in) {
+      auto& r = res.emplace_back(schema { "", s.columns, s.dimens, nullptr });
+      r.layout = s.layout;
+      r.dimens[0] = cnt;
+      auto per = s.nelems() / std::max(1zu, nrecords(s));
+
+      if (! gathered) {
+        r.data = static_cast<std::byte*>(s.data) + from * per * s.row_size();
+        r.owner = s.owner;
+        continue;
+      }
+
+      auto buf = std::make_shared_for_overwrite<std::byte[]>(r.nelems() * r.row_size());
+      r.data = buf.get();
+      r.owner = std::move(buf);
+
+      auto rec = [&](size_t k) { return perm.empty() ? from + k : perm[from + k]; };
+      if (s.layout == layout_type::rows) {
+        auto rs = per * s.row_size();
+        for (size_t k = 0; k < cnt; ++k)
+          std::memcpy(static_cast<std::byte*>(r.data) + k * rs, static_cast<const std::byte*>(s.data) + rec(k) * rs, rs);
+      } else
+        for (size_t j = 0; j < s.columns.size(); ++j) {
+          auto src = s.view(j);
+          auto dst = r.view(j);
+          auto rs = per * s.columns[j].size();
+          for (size_t k = 0; k < cnt; ++k)
+            std::memcpy(dst.addr(k * per), src.addr(rec(k) * per), rs);
+        }
+    }
+
+    return res;
+  }
+
+} // namespace scql::data
@@ -0,0 +1,58 @@
+#ifndef _BATCH_HH
+#define _BATCH_HH 1
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "data.hh"
+
+
+namespace scql::data {
+
+  // Number of records of S, the elements of the first dimension.
+  size_t nrecords(const schema& s);
+
+  // Random permutation of [0, N).
+  std::vector<uint32_t> permutation(size_t n, uint64_t seed);
+
+
+  // Successive mini-batches of up to N records of all inputs.  The inputs must have the same number of
+  // records, the same records are taken from each.  Without a permutation and for inputs in row layout
+  // the batches are views of the input data.  Otherwise the records are gathered into contiguous
+  // buffers by a background thread which stays up to DEPTH batches ahead of the consumer.
+  class batch_stream {
+  public:
+    batch_stream(const std::vector<const schema*>& in, size_t n, std::vector<uint32_t> perm = {}, size_t depth = 2);
+    batch_stream(const batch_stream&) = delete;
+    batch_stream& operator=(const batch_stream&) = delete;
+
+    size_t size() const { return nbatches; }
+
+    // One schema per input, empty after the last batch.
+    std::vector<schema> next();
+
+  private:
+    std::vector<schema> make(size_t b) const;
+    void produce(std::stop_token st);
+
+    std::vector<schema> in;
+    size_t n;
+    std::vector<uint32_t> perm;
+    size_t depth;
+    size_t nbatches;
+    bool gathered;
+
+    size_t consumed = 0;
+    std::mutex lock {};
+    std::condition_variable_any cv {};
+    std::deque<std::vector<schema>> ready {};
+    std::jthread worker {};    // Last, stopped and joined before the members it uses are destroyed.
+  };
+
+} // namespace scql::data
+
+#endif // batch.hh
@@ -0,0 +1,394 @@
+#include "data.hh"
+#include "compress.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string_view>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+namespace scql::data {
+
+  namespace {
+
+    // Layout of the snapshot file: the header, the tables of cells (sorted by name), versions,
+    // columns, dimensions, and zones, the string pool, and then the page-aligned data of all
+    // versions.  All entries have fixed sizes and refer to each other by index so that nothing has
+    // to be parsed.
+    constexpr char snapshot_magic[8] = { 'S', 'C', 'Q', 'L', 'C', 'A', 'T', '1' };
+
+    struct file_header {
+      char magic[8];
+      uint64_t next_version;
+      uint64_t ncells;
+      uint64_t nversions;
+      uint64_t ncolumns;
+      uint64_t ndimens;
+      uint64_t nzones;
+      uint64_t strings_len;
+      uint64_t len;
+    };
+
+    struct file_cell {
+      uint32_t name_off;
+      uint32_t name_len;
+      uint32_t first_version;
+      uint32_t nversions;
+    };
+
+    struct file_version {
+      uint64_t id;
+      uint64_t data_off;
+      uint64_t data_len;
+      uint64_t first_zone;
+      uint64_t zone_rows;
+      uint32_t title_off;
+      uint32_t title_len;
+      uint32_t first_column;
+      uint32_t ncolumns;
+      uint32_t first_dimen;
+      uint32_t ndimens;
+      uint8_t layout;
+      uint8_t writable;
+      uint8_t pad[6];
+    };
+
+    struct file_column {
+      uint32_t label_off;
+      uint32_t label_len;
+      uint32_t first_dimen;
+      uint32_t ndimens;
+      uint32_t type;
+      uint32_t nzones;    // Zero if the column has no statistics.
+    };
+
+
+    size_t page_align(size_t n)
+    {
+      auto ps = size_t(::sysconf(_SC_PAGESIZE));
+      return (n + ps - 1) & ~(ps - 1);
+    }
+
+  } // anonymous namespace
+
+
+  struct snapshot : std::enable_shared_from_this<snapshot> {
+    snapshot(const std::byte* base_, size_t len_) : base(base_), len(len_) { }
+    snapshot(const snapshot&) = delete;
+    snapshot& operator=(const snapshot&) = delete;
+    ~snapshot() { ::munmap(const_cast<std::byte*>(base), len); }
+
+    const file_header& header() const { return *reinterpret_cast<const file_header*>(base); }
+    const file_cell* cells() const { return reinterpret_cast<const file_cell*>(base + sizeof(file_header)); }
+    const file_version* versions() const { return reinterpret_cast<const file_version*>(cells() + header().ncells); }
+    const file_column* columns() const { return reinterpret_cast<const file_column*>(versions() + header().nversions); }
+    const uint64_t* dimens() const { return reinterpret_cast<const uint64_t*>(columns() + header().ncolumns); }
+    const zone_map::zone* zones() const { return reinterpret_cast<const zone_map::zone*>(dimens() + header().ndimens); }
+    const char* strings() const { return reinterpret_cast<const char*>(zones() + header().nzones); }
+
+    std::string_view string(uint32_t off, uint32_t n) const { return std::string_view(strings() + off, n); }
+    std::string_view name(size_t cell) const { return string(cells()[cell].name_off, cells()[cell].name_len); }
+
+    // Index of the first cell with a name not less than NAME.
+    size_t lower_bound(std::string_view name) const
+    {
+      size_t lo = 0;
+      size_t hi = header().ncells;
+      while (lo < hi) {
+        auto mid = (lo + hi) / 2;
+        if (this->name(mid) < name)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      return lo;
+    }
+
+    // Everything the other functions use must be inside the file, a truncated or damaged file is
+    // rejected before any of it is used.
+    bool valid() const
+    {
+      if (len < sizeof(file_header) || std::memcmp(header().magic, snapshot_magic, sizeof(snapshot_magic)) != 0 || header().len != len)
+        return false;
+
+      auto& h = header();
+      size_t rest = len - sizeof(file_header);
+      auto fits = [&rest](uint64_t n, size_t size) {
+        if (n > rest / size)
+          return false;
+        rest -= n * size;
+        return true;
+      };
+      if (! fits(h.ncells, sizeof(file_cell)) || ! fits(h.nversions, sizeof(file_version)) || ! fits(h.ncolumns, sizeof(file_column))
+          || ! fits(h.ndimens, sizeof(uint64_t)) || ! fits(h.nzones, sizeof(zone_map::zone)) || ! fits(h.strings_len, 1))
+        return false;
+
+      auto in = [](uint64_t first, uint64_t n, uint64_t total) { return first <= total && n <= total - first; };
+      for (size_t ci = 0; ci < h.ncells; ++ci) {
+        auto& c = cells()[ci];
+        if (! in(c.name_off, c.name_len, h.strings_len) || ! in(c.first_version, c.nversions, h.nversions))
+          return false;
+      }
+
+      for (size_t vi = 0; vi < h.nversions; ++vi) {
+        auto& v = versions()[vi];
+        if (! in(v.title_off, v.title_len, h.strings_len) || ! in(v.first_column, v.ncolumns, h.ncolumns) || ! in(v.first_dimen, v.ndimens, h.ndimens)
+            || v.layout > uint8_t(layout_type::columns) || ! in(v.data_off, v.data_len, len))
+          return false;
+
+        // The data must be large enough for the shape.
+        uint64_t nelems = 1;
+        for (auto d = dimens() + v.first_dimen; d < dimens() + v.first_dimen + v.ndimens; ++d)
+          if (__builtin_mul_overflow(nelems, *d, &nelems))
+            return false;
+        uint64_t row = 0;
+        uint64_t nzones = 0;
+        for (auto ci = v.first_column; ci < v.first_column + v.ncolumns; ++ci) {
+          auto& fc = columns()[ci];
+          if (! in(fc.label_off, fc.label_len, h.strings_len) || ! in(fc.first_dimen, fc.ndimens, h.ndimens) || fc.type > uint32_t(data_type::str))
+            return false;
+          uint64_t size = type_size(data_type(fc.type));
+          for (auto d = dimens() + fc.first_dimen; d < dimens() + fc.first_dimen + fc.ndimens; ++d)
+            if (__builtin_mul_overflow(size, *d, &size))
+              return false;
+          if (__builtin_add_overflow(row, size, &row))
+            return false;
+          // A column either has no zones or one for each block of rows, the scans index them by block.
+          if (fc.nzones != 0 && (v.zone_rows == 0 || fc.nzones != nelems / v.zone_rows + (nelems % v.zone_rows != 0)))
+            return false;
+          nzones += fc.nzones;
+        }
+        if (uint64_t total; __builtin_mul_overflow(nelems, row, &total) || total != v.data_len)
+          return false;
+        if (! in(v.first_zone, nzones, h.nzones))
+          return false;
+      }
+
+      return true;
+    }
+
+    std::deque<version> materialize(size_t cell) const
+    {
+      std::deque<version> res;
+      auto& c = cells()[cell];
+      for (auto vi = c.first_version; vi < c.first_version + c.nversions; ++vi) {
+        auto& v = versions()[vi];
+        auto dims = dimens() + v.first_dimen;
+        schema s { std::string(string(v.title_off, v.title_len)), { }, std::vector<size_t>(dims, dims + v.ndimens), const_cast<std::byte*>(base + v.data_off), v.writable != 0 };
+        s.layout = layout_type(v.layout);
+        s.owner = shared_from_this();
+
+        auto zm = std::make_shared<zone_map>();
+        zm->rows = v.zone_rows;
+        auto z = zones() + v.first_zone;
+        for (auto ci = v.first_column; ci < v.first_column + v.ncolumns; ++ci) {
+          auto& fc = columns()[ci];
+          auto cd = dimens() + fc.first_dimen;
+          s.columns.emplace_back(data_type(fc.type), std::vector<size_t>(cd, cd + fc.ndimens), std::string(string(fc.label_off, fc.label_len)));
+          zm->cols.emplace_back(z, z + fc.nzones);
+          z += fc.nzones;
+        }
+        s.zones = std::move(zm);
+
+        res.emplace_back(v.id, std::move(s));
+      }
+      return res;
+    }
+
+    const std::byte* base;
+    size_t len;
+  };
+
+
+  bool data_info::load(const std::string& path)
+  {
+    std::unique_lock guard(lock);
+    auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+      return false;
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(file_header)) {
+      ::close(fd);
+      return false;
+    }
+    auto p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+      return false;
+
+    auto s = std::make_shared<const snapshot>(static_cast<const std::byte*>(p), st.st_size);
+    if (! s->valid())
+      return false;
+
+    snap = std::move(s);
+    quiesce(guard);
+    turn = next_version = std::max(next_version, snap->header().next_version);
+
+    // Cells which already exist, the built-in ones, get the stored versions added right away.  They are
+    // merged by id to keep the newest last, versions which are already there are not added again.
+    for (auto& [n,vs] : known) {
+      auto idx = snap->lower_bound(n);
+      if (idx < snap->header().ncells && snap->name(idx) == n)
+        for (auto& v : snap->materialize(idx)) {
+          auto it = std::ranges::lower_bound(vs, v.id, { }, &version::id);
+          if (it == vs.end() || it->id != v.id)
+            vs.insert(it, std::move(v));
+        }
+      trim(vs);
+    }
+
+    return true;
+  }
+
+
+  std::deque<version>* data_info::materialize(const std::string& name)
+  {
+    if (! snap)
+      return nullptr;
+    auto idx = snap->lower_bound(name);
+    if (idx == snap->header().ncells || snap->name(idx) != name)
+      return nullptr;
+    auto& vs = std::get<std::deque<version>>(known.emplace_back(name, snap->materialize(idx)));
+    trim(vs);
+    return &vs;
+  }
+
+
+  void data_info::snapshot_names(const std::string& pfx, std::vector<std::string>& res) const
+  {
+    if (! snap)
+      return;
+    for (auto idx = snap->lower_bound(pfx); idx < snap->header().ncells && snap->name(idx).starts_with(pfx); ++idx)
+      if (std::ranges::find(res, snap->name(idx)) == res.end())
+        res.emplace_back(snap->name(idx));
+  }
+
+
+  // Built-in versions are not stored, the data is part of the program.  Encoded columns are stored
+  // in the plain representation.
+  bool data_info::save(const std::string& path)
+  {
+    std::lock_guard guard(lock);
+    return write_snapshot(path);
+  }
+
+
+  bool data_info::write_snapshot(const std::string& path)
+  {
+    if (snap)
+      for (size_t idx = 0; idx < snap->header().ncells; ++idx)
+        find(std::string(snap->name(idx)));
+
+    std::vector<std::pair<std::string,std::vector<version>>> cells;
+    for (const auto& [n,vs] : known) {
+      std::vector<version> ss;
+      for (const auto& v : vs)
+        if (v.m || v.s.writable || v.s.owner)
+          ss.emplace_back(v.id, plain(v.s));
+      if (! ss.empty())
+        cells.emplace_back(n, std::move(ss));
+    }
+    std::ranges::sort(cells, {}, &std::pair<std::string,std::vector<version>>::first);
+
+    std::vector<file_cell> fcells;
+    std::vector<file_version> fversions;
+    std::vector<file_column> fcolumns;
+    std::vector<uint64_t> fdimens;
+    std::vector<zone_map::zone> fzones;
+    std::string strings;
+    auto add_string = [&strings](const std::string& s) { auto off = uint32_t(strings.size()); strings += s; return off; };
+    auto add_dimens = [&fdimens](const std::vector<size_t>& d) { auto off = uint32_t(fdimens.size()); fdimens.insert(fdimens.end(), d.begin(), d.end()); return off; };
+
+    for (const auto& [n,vs] : cells) {
+      fcells.emplace_back(add_string(n), uint32_t(n.size()), uint32_t(fversions.size()), uint32_t(vs.size()));
+      for (const auto& v : vs) {
+        const auto& s = v.s;
+        file_version fv { };
+        fv.id = v.id;
+        fv.data_len = s.nelems() * s.row_size();
+        fv.first_zone = fzones.size();
+        fv.zone_rows = s.zones ? s.zones->rows : 0;
+        fv.title_off = add_string(s.title);
+        fv.title_len = s.title.size();
+        fv.first_column = fcolumns.size();
+        fv.ncolumns = s.columns.size();
+        fv.first_dimen = add_dimens(s.dimens);
+        fv.ndimens = s.dimens.size();
+        fv.layout = uint8_t(s.layout);
+        fv.writable = s.writable;
+        for (size_t j = 0; j < s.columns.size(); ++j) {
+          const auto& c = s.columns[j];
+          file_column fc { add_string(c.label), uint32_t(c.label.size()), add_dimens(c.dimens), uint32_t(c.dimens.size()), uint32_t(c.type), 0 };
+          if (s.zones && j < s.zones->cols.size()) {
+            fc.nzones = s.zones->cols[j].size();
+            fzones.insert(fzones.end(), s.zones->cols[j].begin(), s.zones->cols[j].end());
+          }
+          fcolumns.push_back(fc);
+        }
+        fversions.push_back(fv);
+      }
+    }
+
+    file_header h { };
+    std::memcpy(h.magic, snapshot_magic, sizeof(snapshot_magic));
+    h.next_version = next_version;
+    h.ncells = fcells.size();
+    h.nversions = fversions.size();
+    h.ncolumns = fcolumns.size();
+    h.ndimens = fdimens.size();
+    h.nzones = fzones.size();
+    h.strings_len = strings.size();
+
+    auto off = page_align(sizeof(h) + fcells.size() * sizeof(file_cell) + fversions.size() * sizeof(file_version) + fcolumns.size() * sizeof(file_column) + fdimens.size() * sizeof(uint64_t) + fzones.size() * sizeof(zone_map::zone) + strings.size());
+    for (auto& fv : fversions) {
+      fv.data_off = off;
+      off = page_align(off + fv.data_len);
+    }
+    h.len = off;
+
+    // Write a new file and replace the old one atomically.  A mapped old snapshot stays valid.
+    auto tmp = path + ".tmp";
+    auto fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+      return false;
+    size_t pos = 0;
+    auto put = [fd, &pos](const void* p, size_t n) {
+      for (auto b = static_cast<const char*>(p); n > 0; ) {
+        auto r = ::pwrite(fd, b, n, pos);
+        if (r <= 0) {
+          if (r == -1 && errno == EINTR)
+            continue;
+          return false;
+        }
+        b += r;
+        n -= r;
+        pos += r;
+      }
+      return true;
+    };
+
+    bool ok = put(&h, sizeof(h)) && put(fcells.data(), fcells.size() * sizeof(file_cell)) && put(fversions.data(), fversions.size() * sizeof(file_version))
+      && put(fcolumns.data(), fcolumns.size() * sizeof(file_column)) && put(fdimens.data(), fdimens.size() * sizeof(uint64_t))
+      && put(fzones.data(), fzones.size() * sizeof(zone_map::zone)) && put(strings.data(), strings.size());
+    size_t vi = 0;
+    for (const auto& [n,vs] : cells)
+      for (const auto& v : vs) {
+        pos = fversions[vi].data_off;
+        ok = ok && put(v.s.data, fversions[vi].data_len);
+        ++vi;
+      }
+    ok = ok && ::ftruncate(fd, h.len) == 0 && ::fsync(fd) == 0;
+    ::close(fd);
+    if (! ok || ::rename(tmp.c_str(), path.c_str()) != 0) {
+      ::unlink(tmp.c_str());
+      return false;
+    }
+    return true;
+  }
+
+} // namespace scql::data
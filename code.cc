@@ -1,10 +1,23 @@
 #include "code.hh"
+#include "aggregate.hh"
+#include "batch.hh"
+#include "compress.hh"
+#include "join.hh"
 #include "scql.hh"
+#include "sort.hh"
 
 #include <algorithm>
 #include <cerrno>
 #include <cmath>
+#include <cstring>
 #include <format>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <optional>
+#include <type_traits>
 #include <utility>
 
 using namespace std::literals;
@@ -14,7 +27,7 @@ namespace scql::code {
 
   namespace {
 
-    std::variant<std::vector<data::schema>,std::string> reshape_output_shape(const std::vector<data::schema*>& in_schema, std::vector<part::cptr_type>& args)
+    std::variant<std::vector<data::schema>,std::string> reshape_output_shape(const std::vector<const data::schema*>& in_schema, std::vector<part::cptr_type>& args)
     {
       // The parameters are supposed to be positive integers or the glob.
       std::vector<intmax_t> req;
@@ -59,19 +72,22 @@ namespace scql::code {
         if (old_multiple % multiple != 0)
           return std::format("defined sizes have remainder of {}", old_multiple % multiple);
 
-        res.push_back(data::schema { "", is->columns, { }, is->data });
+        // The result is a view of the input data.
+        auto& r = res.emplace_back(data::schema { "", is->columns, { }, is->data });
+        r.layout = is->layout;
+        r.owner = is->owner;
         for (auto m : req)
           if (m == 0) {
-            res.back().dimens.push_back(has_glob ? old_multiple / multiple : 1);
+            r.dimens.push_back(has_glob ? old_multiple / multiple : 1);
             has_glob = false;
           } else
-            res.back().dimens.push_back(m);
+            r.dimens.push_back(m);
       }
 
       return res;
     }
 
-    std::vector<data::schema> reshape(const std::vector<data::schema*>& in_schema, std::vector<part::cptr_type>& args)
+    std::vector<data::schema> reshape(const std::vector<const data::schema*>& in_schema, std::vector<part::cptr_type>& args)
     {
       return std::get<std::vector<data::schema>>(reshape_output_shape(in_schema, args));
     }
@@ -82,7 +98,7 @@ namespace scql::code {
     };
 
 
-    std::variant<std::vector<data::schema>,std::string> zip_output_shape(const std::vector<data::schema*>& in_schema, std::vector<part::cptr_type>& args)
+    std::variant<std::vector<data::schema>,std::string> zip_output_shape(const std::vector<const data::schema*>& in_schema, std::vector<part::cptr_type>& args)
     {
       if (! args.empty())
         return "zip does not expect arguments"s;
@@ -114,24 +130,15 @@ namespace scql::code {
       return std::vector { res };
     }
 
-    std::vector<data::schema> zip(const std::vector<data::schema*>& in_schema, std::vector<part::cptr_type>& args)
-    {
-      // XYZ This is not a real implementation.
-      (void) args;
-      std::vector<data::schema> res;
-      for (const auto p : in_schema)
-        res.emplace_back(*p);
-      return res;
-    }
-
+    // Only the shapes are implemented so far.
     function zip_info {
       zip_output_shape,
-      zip
+      nullptr
     };
 
 
 
-    std::variant<std::vector<data::schema>,std::string> split_output_shape(const std::vector<data::schema*>& in_schema, std::vector<part::cptr_type>& args)
+    std::variant<std::vector<data::schema>,std::string> split_output_shape(const std::vector<const data::schema*>& in_schema, std::vector<part::cptr_type>& args)
     {
       if (args.size() != 1)
         return "split expect one argument"s;
@@ -163,19 +170,884 @@ namespace scql::code {
       return res;
     }
 
-    std::vector<data::schema> split(const std::vector<data::schema*>& in_schema, std::vector<part::cptr_type>& args)
+    // Only the shapes are implemented so far.
+    function split_info {
+      split_output_shape,
+      nullptr
+    };
+
+
+
+    // Column labels are often no valid identifiers (e.g., "Petal.Length") and can therefore also be given as strings.
+    std::optional<std::string> label_arg(part::cptr_type& e)
+    {
+      if (e == nullptr)
+        return std::nullopt;
+      if (e->is(id_type::ident))
+        return as<ident>(e)->val;
+      if (! e->is(id_type::string))
+        return std::nullopt;
+      auto s = as<string>(e);
+      if (s->val.size() < 2 || s->missing_close)
+        return std::nullopt;
+      return s->val.substr(1, s->val.size() - 2);
+    }
+
+
+    std::optional<size_t> find_column(const data::schema& s, const std::string& label)
+    {
+      for (size_t i = 0; i < s.columns.size(); ++i)
+        if (s.columns[i].label == label)
+          return i;
+      return std::nullopt;
+    }
+
+
+    // The columns selected by labels in ARGS, all columns if there are none.
+    std::variant<std::vector<size_t>,std::string> select_columns(const data::schema& s, std::vector<part::cptr_type>& args)
+    {
+      std::vector<size_t> res;
+      if (args.empty())
+        for (size_t i = 0; i < s.columns.size(); ++i)
+          res.push_back(i);
+      else
+        for (auto& e : args)
+          if (auto l = label_arg(e); ! l)
+            return std::format("invalid argument {}\nmust be a column label", e ? e->format() : "<UNKNOWN>"s);
+          else if (auto idx = find_column(s, *l); ! idx)
+            return std::format("unknown column {}", *l);
+          else
+            res.push_back(*idx);
+      return res;
+    }
+
+
+    // Fill OUT with the elements of IS selected by SEL, in this order.
+    void gather(const data::schema& is, const std::vector<uint32_t>& sel, data::schema& out)
+    {
+      auto plain = data::plain(is);
+
+      out.layout = plain.layout;
+      out.dimens = { sel.size() };
+      auto buf = std::make_shared_for_overwrite<std::byte[]>(sel.size() * out.row_size());
+      out.data = buf.get();
+      out.owner = std::move(buf);
+
+      if (out.layout == data::layout_type::rows) {
+        auto rs = out.row_size();
+        auto from = static_cast<const std::byte*>(plain.data);
+        for (size_t k = 0; k < sel.size(); ++k)
+          std::memcpy(static_cast<std::byte*>(out.data) + k * rs, from + sel[k] * rs, rs);
+      } else
+        for (size_t j = 0; j < out.columns.size(); ++j) {
+          auto from = plain.view(j);
+          auto to = out.view(j);
+          for (size_t k = 0; k < sel.size(); ++k)
+            std::memcpy(to.addr(k), from.addr(sel[k]), to.stride);
+        }
+    }
+
+
+    std::variant<std::vector<data::schema>,std::string> transpose_output_shape(const std::vector<const data::schema*>& in_schema, std::vector<part::cptr_type>& args)
     {
-      // XYZ This is not a real implementation.
-      (void) args;
+      if (in_schema.size() != 1 || in_schema[0] == nullptr)
+        return std::format("just one input expected, not {}", in_schema.size());
+
+      auto& is = *in_schema[0];
+      if (is.columns.empty())
+        return "input has no columns";
+
+      auto sel = select_columns(is, args);
+      if (std::holds_alternative<std::string>(sel))
+        return std::get<std::string>(sel);
+
+      data::schema res { "", { }, is.dimens, nullptr };
+      for (auto idx : std::get<std::vector<size_t>>(sel)) {
+        auto& c = res.columns.emplace_back(is.columns[idx]);
+        c.encoding = data::encoding_type::plain;
+        c.enc.reset();
+      }
+      res.layout = is.layout == data::layout_type::rows ? data::layout_type::columns : data::layout_type::rows;
+
+      return std::vector { res };
+    }
+
+    template<size_t N>
+    void copy_column(const data::schema::column_view& from, const data::schema::column_view& to)
+    {
+      for (size_t i = 0; i < from.count; ++i)
+        std::memcpy(to.addr(i), from.addr(i), N);
+    }
+
+    // Convert between the row and column layout.  Only the selected columns are touched.
+    std::vector<data::schema> transpose(const std::vector<const data::schema*>& in_schema, std::vector<part::cptr_type>& args)
+    {
+      auto res = std::get<std::vector<data::schema>>(transpose_output_shape(in_schema, args));
+      auto sel = std::get<std::vector<size_t>>(select_columns(*in_schema[0], args));
+      // Compressed columns are decoded first.
+      auto plain = data::plain(*in_schema[0], sel);
+
+      auto& out = res[0];
+      auto buf = std::make_shared_for_overwrite<std::byte[]>(out.nelems() * out.row_size());
+      out.data = buf.get();
+      out.owner = std::move(buf);
+
+      for (size_t j = 0; j < sel.size(); ++j) {
+        auto from = plain.view(sel[j]);
+        auto to = out.view(j);
+        auto csize = out.columns[j].size();
+        if (from.stride == csize && to.stride == csize)
+          std::memcpy(to.base, from.base, csize * from.count);
+        else
+          switch (csize) {
+          case 1:
+            copy_column<1>(from, to);
+            break;
+          case 4:
+            copy_column<4>(from, to);
+            break;
+          case 8:
+            copy_column<8>(from, to);
+            break;
+          default:
+            for (size_t i = 0; i < from.count; ++i)
+              std::memcpy(to.addr(i), from.addr(i), csize);
+            break;
+          }
+      }
+
+      return res;
+    }
+
+    function transpose_info {
+      transpose_output_shape,
+      transpose
+    };
+
+
+
+    std::optional<data::encoding_type> encoding_arg(part::cptr_type& e)
+    {
+      static const std::map<std::string,data::encoding_type> names {
+        { "dict"s, data::encoding_type::dictionary },
+        { "packed"s, data::encoding_type::bitpack },
+        { "rle"s, data::encoding_type::rle },
+        { "for"s, data::encoding_type::frame_of_reference },
+      };
+      if (e == nullptr || ! e->is(id_type::ident))
+        return std::nullopt;
+      if (auto it = names.find(as<ident>(e)->val); it != names.end())
+        return it->second;
+      return std::nullopt;
+    }
+
+
+    std::variant<std::vector<data::schema>,std::string> compress_output_shape(const std::vector<const data::schema*>& in_schema, std::vector<part::cptr_type>& args)
+    {
+      if (args.size() > 1)
+        return "compress expects at most one argument"s;
+
+      auto enc = data::encoding_type::plain;
+      if (! args.empty()) {
+        auto e = encoding_arg(args[0]);
+        if (! e)
+          return std::format("invalid argument {}\nmust be one of dict, packed, rle, for", args[0] ? args[0]->format() : "<UNKNOWN>"s);
+        enc = *e;
+      }
+
+      if (in_schema.empty())
+        return "compress requires input data";
+
       std::vector<data::schema> res;
-      for (const auto p : in_schema)
-        res.emplace_back(*p);
+      for (auto is : in_schema) {
+        if (is == nullptr)
+          return "input shape unknown";
+        // Without an explicit encoding the best one is only known once the data is seen.
+        auto& n = res.emplace_back(data::schema { is->title, is->columns, is->dimens, nullptr });
+        n.layout = data::layout_type::columns;
+        for (auto& c : n.columns) {
+          c.encoding = data::encodable(c, enc) ? enc : data::encoding_type::plain;
+          c.enc.reset();
+        }
+      }
+
       return res;
     }
 
-    function split_info {
-      split_output_shape,
-      split
+    std::vector<data::schema> compress(const std::vector<const data::schema*>& in_schema, std::vector<part::cptr_type>& args)
+    {
+      auto enc = args.empty() ? data::encoding_type::plain : *encoding_arg(args[0]);
+
+      std::vector<data::schema> res;
+      for (auto is : in_schema) {
+        auto& r = res.emplace_back(data::compress(*is, enc));
+        r.writable = true;
+        r.zones.reset();
+      }
+
+      return res;
+    }
+
+    function compress_info {
+      compress_output_shape,
+      compress
+    };
+
+
+
+    // Equality (or other comparison) with a literal value.
+    std::optional<data::predicate> literal_predicate(data::cmp_op op, part::cptr_type& e, const data::schema::column& c)
+    {
+      if (e == nullptr)
+        return std::nullopt;
+      if (c.type == data::data_type::str) {
+        if (auto s = label_arg(e); s && e->is(id_type::string))
+          return data::predicate { op, 0.0, *s };
+      } else if (c.size() == data::type_size(c.type)) {
+        if (e->is(id_type::integer))
+          return data::predicate { op, double(as<integer>(e)->val) };
+        if (e->is(id_type::floatnum))
+          return data::predicate { op, as<floatnum>(e)->val };
+      }
+      return std::nullopt;
+    }
+
+
+    // Arguments are either empty (count all elements), a value (the input has a single column), or
+    // a column label and a value.
+    std::variant<std::pair<size_t,data::predicate>,std::string> count_args(const data::schema& s, std::vector<part::cptr_type>& args)
+    {
+      size_t idx = 0;
+      if (args.size() == 2) {
+        auto l = label_arg(args[0]);
+        if (! l)
+          return "first argument must be a column label"s;
+        auto i = find_column(s, *l);
+        if (! i)
+          return std::format("unknown column {}", *l);
+        idx = *i;
+      } else if (s.columns.size() != 1)
+        return "column label required"s;
+
+      auto pred = literal_predicate(data::cmp_op::eq, args.back(), s.columns[idx]);
+      if (! pred)
+        return std::format("invalid value for column of type {}", s.columns[idx].type == data::data_type::str ? "string" : "number");
+      return std::make_pair(idx, *pred);
+    }
+
+    std::variant<std::vector<data::schema>,std::string> count_output_shape(const std::vector<const data::schema*>& in_schema, std::vector<part::cptr_type>& args)
+    {
+      if (args.size() > 2)
+        return "count expects at most two arguments"s;
+      if (in_schema.empty())
+        return "count requires input data";
+
+      std::vector<data::schema> res;
+      for (auto is : in_schema) {
+        if (is == nullptr)
+          return "input shape unknown";
+        if (! args.empty())
+          if (auto a = count_args(*is, args); std::holds_alternative<std::string>(a))
+            return std::get<std::string>(a);
+        res.push_back(data::schema { "", { data::schema::column { data::data_type::u32, { 1zu }, "count"s } }, { 1zu }, nullptr });
+      }
+
+      return res;
+    }
+
+    // Compressed columns are counted without decoding them.
+    std::vector<data::schema> count(const std::vector<const data::schema*>& in_schema, std::vector<part::cptr_type>& args)
+    {
+      auto res = std::get<std::vector<data::schema>>(count_output_shape(in_schema, args));
+
+      for (size_t i = 0; i < in_schema.size(); ++i) {
+        auto& is = *in_schema[i];
+        size_t n = 0;
+        if (args.empty())
+          n = is.nelems();
+        else {
+          auto [idx, pred] = std::get<std::pair<size_t,data::predicate>>(count_args(is, args));
+          if (is.columns[idx].enc)
+            n = data::count(is.columns[idx], pred);
+          else {
+            auto v = is.view(idx);
+            for (size_t k = 0; k < v.count; ++k)
+              n += pred(is.columns[idx], v.addr(k));
+          }
+        }
+
+        auto buf = std::make_shared_for_overwrite<std::byte[]>(sizeof(uint32_t));
+        uint32_t n32 = n;
+        std::memcpy(buf.get(), &n32, sizeof(n32));
+        res[i].data = buf.get();
+        res[i].owner = std::move(buf);
+      }
+
+      return res;
+    }
+
+    function count_info {
+      count_output_shape,
+      count
+    };
+
+
+
+    std::optional<data::cmp_op> cmp_arg(part::cptr_type& e)
+    {
+      static const std::map<std::string,data::cmp_op> names {
+        { "eq"s, data::cmp_op::eq },
+        { "ne"s, data::cmp_op::ne },
+        { "lt"s, data::cmp_op::lt },
+        { "le"s, data::cmp_op::le },
+        { "gt"s, data::cmp_op::gt },
+        { "ge"s, data::cmp_op::ge },
+      };
+      if (e == nullptr || ! e->is(id_type::ident))
+        return std::nullopt;
+      if (auto it = names.find(as<ident>(e)->val); it != names.end())
+        return it->second;
+      return std::nullopt;
+    }
+
+
+    // Arguments are the comparison and the value, preceded by a column label unless the input has a single column.
+    std::variant<std::pair<size_t,data::predicate>,std::string> filter_args(const data::schema& s, std::vector<part::cptr_type>& args)
+    {
+      size_t idx = 0;
+      if (args.size() == 3) {
+        auto l = label_arg(args[0]);
+        if (! l)
+          return "first argument must be a column label"s;
+        auto i = find_column(s, *l);
+        if (! i)
+          return std::format("unknown column {}", *l);
+        idx = *i;
+      } else if (args.size() != 2)
+        return "filter expects comparison and value, optionally preceded by a column label"s;
+      else if (s.columns.size() != 1)
+        return "column label required"s;
+
+      auto op = cmp_arg(args[args.size() - 2]);
+      if (! op)
+        return "comparison must be one of eq, ne, lt, le, gt, ge"s;
+
+      auto pred = literal_predicate(*op, args.back(), s.columns[idx]);
+      if (! pred)
+        return std::format("invalid value for column of type {}", s.columns[idx].type == data::data_type::str ? "string" : "number");
+      return std::make_pair(idx, *pred);
+    }
+
+
+    // Can a value in the zone satisfy the predicate?
+    bool zone_may_match(const data::zone_map::zone& z, const data::predicate& pred)
+    {
+      if (z.nans > 0 && pred.op == data::cmp_op::ne)
+        return true;
+      switch (pred.op) {
+      case data::cmp_op::eq:
+        return z.min <= pred.num && pred.num <= z.max;
+      case data::cmp_op::ne:
+        return z.min != pred.num || z.max != pred.num;
+      case data::cmp_op::lt:
+        return z.min < pred.num;
+      case data::cmp_op::le:
+        return z.min <= pred.num;
+      case data::cmp_op::gt:
+        return z.max > pred.num;
+      case data::cmp_op::ge:
+        return z.max >= pred.num;
+      }
+      std::unreachable();
+    }
+
+
+    // Do all values in the zone satisfy the predicate?
+    bool zone_all_match(const data::zone_map::zone& z, const data::predicate& pred)
+    {
+      if (z.nans > 0)
+        return pred.op == data::cmp_op::ne && (pred.num < z.min || pred.num > z.max);
+      switch (pred.op) {
+      case data::cmp_op::eq:
+        return z.min == pred.num && z.max == pred.num;
+      case data::cmp_op::ne:
+        return pred.num < z.min || pred.num > z.max;
+      case data::cmp_op::lt:
+        return z.max < pred.num;
+      case data::cmp_op::le:
+        return z.max <= pred.num;
+      case data::cmp_op::gt:
+        return z.min > pred.num;
+      case data::cmp_op::ge:
+        return z.min >= pred.num;
+      }
+      std::unreachable();
+    }
+
+
+    template<typename T, typename V, typename Cmp>
+    void scan_block(const data::schema::column_view& v, size_t from, size_t to, V val, Cmp cmp, std::vector<uint32_t>& sel)
+    {
+      for (auto i = from; i < to; ++i)
+        if (cmp(V(v.get<T>(i)), val))
+          sel.push_back(i);
+    }
+
+    // Floating-point values are compared as double, just like the zone map.
+    template<typename T>
+    void scan_block(const data::schema::column_view& v, size_t from, size_t to, const data::predicate& pred, std::vector<uint32_t>& sel)
+    {
+      using V = std::conditional_t<std::is_floating_point_v<T>,double,T>;
+      if constexpr (! std::is_floating_point_v<T>)
+        if (! (pred.num >= 0.0 && pred.num <= double(std::numeric_limits<T>::max())) || std::trunc(pred.num) != pred.num) {
+          // Not representable, fall back to the generic comparison.
+          data::schema::column c { std::is_same_v<T,uint8_t> ? data::data_type::u8 : data::data_type::u32, { 1zu }, ""s };
+          for (auto i = from; i < to; ++i)
+            if (pred(c, v.addr(i)))
+              sel.push_back(i);
+          return;
+        }
+
+      auto val = V(pred.num);
+      switch (pred.op) {
+      case data::cmp_op::eq:
+        scan_block<T>(v, from, to, val, std::equal_to<V>(), sel);
+        break;
+      case data::cmp_op::ne:
+        scan_block<T>(v, from, to, val, std::not_equal_to<V>(), sel);
+        break;
+      case data::cmp_op::lt:
+        scan_block<T>(v, from, to, val, std::less<V>(), sel);
+        break;
+      case data::cmp_op::le:
+        scan_block<T>(v, from, to, val, std::less_equal<V>(), sel);
+        break;
+      case data::cmp_op::gt:
+        scan_block<T>(v, from, to, val, std::greater<V>(), sel);
+        break;
+      case data::cmp_op::ge:
+        scan_block<T>(v, from, to, val, std::greater_equal<V>(), sel);
+        break;
+      }
+    }
+
+
+    // Compute the selection vector.  Blocks are skipped or taken completely based on the zone map.
+    std::vector<uint32_t> selection(const data::schema& is, size_t idx, const data::predicate& pred)
+    {
+      std::vector<uint32_t> sel;
+      const auto& c = is.columns[idx];
+      auto n = is.nelems();
+
+      if (c.enc) {
+        data::select(c, pred, 0, n, sel);
+        return sel;
+      }
+
+      auto v = is.view(idx);
+      const std::vector<data::zone_map::zone>* zones = nullptr;
+      size_t rows = n;
+      if (is.zones && ! is.zones->cols[idx].empty()) {
+        zones = &is.zones->cols[idx];
+        rows = is.zones->rows;
+      }
+
+      for (size_t b = 0; b * rows < n; ++b) {
+        auto from = b * rows;
+        auto to = std::min(n, from + rows);
+        if (zones != nullptr) {
+          if (! zone_may_match((*zones)[b], pred))
+            continue;
+          if (zone_all_match((*zones)[b], pred)) {
+            for (auto i = from; i < to; ++i)
+              sel.push_back(i);
+            continue;
+          }
+        }
+
+        switch (c.size() == data::type_size(c.type) ? c.type : data::data_type::str) {
+        case data::data_type::u8:
+          scan_block<uint8_t>(v, from, to, pred, sel);
+          break;
+        case data::data_type::u32:
+          scan_block<uint32_t>(v, from, to, pred, sel);
+          break;
+        case data::data_type::f32:
+          scan_block<float>(v, from, to, pred, sel);
+          break;
+        case data::data_type::f64:
+          scan_block<double>(v, from, to, pred, sel);
+          break;
+        case data::data_type::str:
+          for (auto i = from; i < to; ++i)
+            if (pred(c, v.addr(i)))
+              sel.push_back(i);
+          break;
+        }
+      }
+
+      return sel;
+    }
+
+
+    std::variant<std::vector<data::schema>,std::string> filter_output_shape(const std::vector<const data::schema*>& in_schema, std::vector<part::cptr_type>& args)
+    {
+      if (in_schema.size() != 1 || in_schema[0] == nullptr)
+        return std::format("just one input expected, not {}", in_schema.size());
+
+      auto& is = *in_schema[0];
+      if (is.columns.empty())
+        return "input has no columns";
+      if (auto a = filter_args(is, args); std::holds_alternative<std::string>(a))
+        return std::get<std::string>(a);
+      // The selection holds u32 indices.
+      if (is.nelems() > UINT32_MAX)
+        return std::format("cannot filter more than {} records", UINT32_MAX);
+
+      // The number of selected elements is only known once the data is seen, this is the upper limit.
+      data::schema res { "", is.columns, { is.nelems() }, nullptr };
+      res.layout = is.layout;
+      for (auto& c : res.columns) {
+        c.encoding = data::encoding_type::plain;
+        c.enc.reset();
+      }
+
+      return std::vector { res };
+    }
+
+    std::vector<data::schema> filter(const std::vector<const data::schema*>& in_schema, std::vector<part::cptr_type>& args)
+    {
+      auto res = std::get<std::vector<data::schema>>(filter_output_shape(in_schema, args));
+      auto [idx, pred] = std::get<std::pair<size_t,data::predicate>>(filter_args(*in_schema[0], args));
+
+      auto sel = selection(*in_schema[0], idx, pred);
+
+      gather(*in_schema[0], sel, res[0]);
+
+      return res;
+    }
+
+    function filter_info {
+      filter_output_shape,
+      filter
+    };
+
+
+
+    // The sort key is the only column of the input or the column with the label given as argument.
+    std::variant<size_t,std::string> sort_key(const data::schema& s, std::vector<part::cptr_type>& args)
+    {
+      size_t idx = 0;
+      if (args.size() > 1)
+        return "at most one argument expected"s;
+      if (args.size() == 1) {
+        auto l = label_arg(args[0]);
+        if (! l)
+          return "argument must be a column label"s;
+        auto i = find_column(s, *l);
+        if (! i)
+          return std::format("unknown column {}", *l);
+        idx = *i;
+      } else if (s.columns.size() != 1)
+        return "column label required"s;
+
+      if (! data::sortable(s.columns[idx]))
+        return "sort key must be a scalar number"s;
+      return idx;
+    }
+
+    std::variant<std::vector<data::schema>,std::string> sort_output_shape(const std::vector<const data::schema*>& in_schema, std::vector<part::cptr_type>& args)
+    {
+      if (in_schema.size() != 1 || in_schema[0] == nullptr)
+        return std::format("just one input expected, not {}", in_schema.size());
+
+      auto& is = *in_schema[0];
+      if (auto k = sort_key(is, args); std::holds_alternative<std::string>(k))
+        return std::get<std::string>(k);
+      // Records are reordered through 32-bit indices.
+      if (is.columns.size() > 1 && is.nelems() > UINT32_MAX)
+        return std::format("cannot sort more than {} records", UINT32_MAX);
+
+      data::schema res { "", is.columns, { is.nelems() }, nullptr };
+      res.layout = is.layout;
+      for (auto& c : res.columns) {
+        c.encoding = data::encoding_type::plain;
+        c.enc.reset();
+      }
+
+      return std::vector { res };
+    }
+
+    // A single column is sorted directly, records are reordered according to the key column.
+    std::vector<data::schema> sort(const std::vector<const data::schema*>& in_schema, std::vector<part::cptr_type>& args)
+    {
+      auto res = std::get<std::vector<data::schema>>(sort_output_shape(in_schema, args));
+      auto& is = *in_schema[0];
+      auto idx = std::get<size_t>(sort_key(is, args));
+      auto plain = data::plain(is, { idx });
+
+      if (is.columns.size() == 1) {
+        auto& out = res[0];
+        auto buf = std::make_shared_for_overwrite<std::byte[]>(out.nelems() * out.row_size());
+        data::sort(plain.columns[0], plain.view(0), buf.get());
+        out.data = buf.get();
+        out.owner = std::move(buf);
+      } else
+        gather(plain, data::argsort(plain.columns[idx], plain.view(idx)), res[0]);
+
+      return res;
+    }
+
+    function sort_info {
+      sort_output_shape,
+      sort
+    };
+
+
+    std::variant<std::vector<data::schema>,std::string> argsort_output_shape(const std::vector<const data::schema*>& in_schema, std::vector<part::cptr_type>& args)
+    {
+      if (in_schema.size() != 1 || in_schema[0] == nullptr)
+        return std::format("just one input expected, not {}", in_schema.size());
+
+      if (auto k = sort_key(*in_schema[0], args); std::holds_alternative<std::string>(k))
+        return std::get<std::string>(k);
+      if (in_schema[0]->nelems() > UINT32_MAX)
+        return std::format("indices of more than {} elements do not fit in u32", UINT32_MAX);
+
+      return std::vector { data::schema { "", { data::schema::column { data::data_type::u32, { 1zu }, "index"s } }, { in_schema[0]->nelems() }, nullptr } };
+    }
+
+    std::vector<data::schema> argsort(const std::vector<const data::schema*>& in_schema, std::vector<part::cptr_type>& args)
+    {
+      auto res = std::get<std::vector<data::schema>>(argsort_output_shape(in_schema, args));
+      auto& is = *in_schema[0];
+      auto idx = std::get<size_t>(sort_key(is, args));
+      auto plain = data::plain(is, { idx });
+
+      auto sel = std::make_shared<std::vector<uint32_t>>(data::argsort(plain.columns[idx], plain.view(idx)));
+      res[0].data = sel->data();
+      res[0].owner = std::move(sel);
+
+      return res;
+    }
+
+    function argsort_info {
+      argsort_output_shape,
+      argsort
+    };
+
+
+
+    // The arguments are the key column (or a glob for the only column) followed by aggregates, each
+    // an operation and a column label.  count needs no column, a glob can be used in its place.
+    std::variant<std::pair<size_t,std::vector<data::aggregate>>,std::string> group_args(const data::schema& s, std::vector<part::cptr_type>& args)
+    {
+      static const std::map<std::string,data::agg_op> names {
+        { "count"s, data::agg_op::count },
+        { "sum"s, data::agg_op::sum },
+        { "min"s, data::agg_op::min },
+        { "max"s, data::agg_op::max },
+        { "mean"s, data::agg_op::mean },
+      };
+
+      if (args.size() < 2)
+        return "key column and aggregates required"s;
+
+      size_t key = 0;
+      if (args[0] != nullptr && args[0]->is(id_type::glob)) {
+        if (s.columns.size() != 1)
+          return "column label required"s;
+      } else if (auto l = label_arg(args[0]); ! l)
+        return "first argument must be a column label"s;
+      else if (auto i = find_column(s, *l); ! i)
+        return std::format("unknown column {}", *l);
+      else
+        key = *i;
+
+      std::vector<data::aggregate> aggs;
+      for (size_t a = 1; a < args.size(); ++a) {
+        if (args[a] == nullptr || ! args[a]->is(id_type::ident))
+          return "aggregate must be one of count, sum, min, max, mean"s;
+        auto it = names.find(as<ident>(args[a])->val);
+        if (it == names.end())
+          return "aggregate must be one of count, sum, min, max, mean"s;
+
+        if (it->second == data::agg_op::count) {
+          if (a + 1 < args.size() && args[a + 1] != nullptr && args[a + 1]->is(id_type::glob))
+            ++a;
+          aggs.emplace_back(data::agg_op::count, 0zu);
+          continue;
+        }
+
+        if (++a == args.size())
+          return std::format("column label for {} missing", it->first);
+        auto l = label_arg(args[a]);
+        if (! l)
+          return std::format("invalid argument {}\nmust be a column label", args[a] ? args[a]->format() : "<UNKNOWN>"s);
+        auto i = find_column(s, *l);
+        if (! i)
+          return std::format("unknown column {}", *l);
+        if (! data::sortable(s.columns[*i]))
+          return std::format("column {} is not a scalar number", *l);
+        aggs.emplace_back(it->second, *i);
+      }
+
+      return std::make_pair(key, std::move(aggs));
+    }
+
+    std::variant<std::vector<data::schema>,std::string> group_output_shape(const std::vector<const data::schema*>& in_schema, std::vector<part::cptr_type>& args)
+    {
+      if (in_schema.size() != 1 || in_schema[0] == nullptr)
+        return std::format("just one input expected, not {}", in_schema.size());
+
+      auto a = group_args(*in_schema[0], args);
+      if (std::holds_alternative<std::string>(a))
+        return std::get<std::string>(a);
+
+      auto& [key, aggs] = std::get<std::pair<size_t,std::vector<data::aggregate>>>(a);
+      return std::vector { data::group_shape(*in_schema[0], key, aggs) };
+    }
+
+    std::vector<data::schema> group(const std::vector<const data::schema*>& in_schema, std::vector<part::cptr_type>& args)
+    {
+      auto [key, aggs] = std::get<std::pair<size_t,std::vector<data::aggregate>>>(group_args(*in_schema[0], args));
+      return std::vector { data::group(*in_schema[0], key, aggs) };
+    }
+
+    function group_info {
+      group_output_shape,
+      group
+    };
+
+
+
+    // The key columns of the two inputs, given by one label used for both or by a label for each.
+    std::variant<std::pair<size_t,size_t>,std::string> join_keys(const data::schema& l, const data::schema& r, std::vector<part::cptr_type>& args)
+    {
+      if (args.empty() || args.size() > 2)
+        return "one or two column labels expected"s;
+
+      auto ll = label_arg(args[0]);
+      if (! ll)
+        return "argument must be a column label"s;
+      auto rl = args.size() == 2 ? label_arg(args[1]) : ll;
+      if (! rl)
+        return "argument must be a column label"s;
+
+      auto li = find_column(l, *ll);
+      if (! li)
+        return std::format("unknown column {} in first input", *ll);
+      auto ri = find_column(r, *rl);
+      if (! ri)
+        return std::format("unknown column {} in second input", *rl);
+      if (! data::joinable(l.columns[*li], r.columns[*ri]))
+        return "key columns must have the same type"s;
+
+      return std::make_pair(*li, *ri);
+    }
+
+    std::variant<std::vector<data::schema>,std::string> join_output_shape(const std::vector<const data::schema*>& in_schema, std::vector<part::cptr_type>& args)
+    {
+      if (in_schema.size() != 2 || in_schema[0] == nullptr || in_schema[1] == nullptr)
+        return std::format("two inputs expected, not {}", in_schema.size());
+
+      auto k = join_keys(*in_schema[0], *in_schema[1], args);
+      if (std::holds_alternative<std::string>(k))
+        return std::get<std::string>(k);
+      // Elements are referenced by u32 indices.
+      if (in_schema[0]->nelems() > UINT32_MAX || in_schema[1]->nelems() > UINT32_MAX)
+        return std::format("cannot join more than {} records", UINT32_MAX);
+
+      return std::vector { data::join_shape(*in_schema[0], *in_schema[1], std::get<std::pair<size_t,size_t>>(k).second) };
+    }
+
+    // Inner join.  The second input is the one kept in hash tables, it should be the smaller one.
+    std::vector<data::schema> join(const std::vector<const data::schema*>& in_schema, std::vector<part::cptr_type>& args)
+    {
+      auto [lkey, rkey] = std::get<std::pair<size_t,size_t>>(join_keys(*in_schema[0], *in_schema[1], args));
+      return std::vector { data::join(*in_schema[0], lkey, *in_schema[1], rkey) };
+    }
+
+    function join_info {
+      join_output_shape,
+      join
+    };
+
+
+
+    // The arguments are the batch size and optionally the seed of the permutation of the records.
+    std::variant<std::pair<size_t,std::optional<uint64_t>>,std::string> batch_args(const std::vector<const data::schema*>& in_schema, std::vector<part::cptr_type>& args)
+    {
+      if (args.empty() || args.size() > 2)
+        return "batch size and optional seed expected"s;
+      if (args[0] == nullptr || ! args[0]->is(id_type::integer) || as<integer>(args[0])->val <= 0)
+        return "batch size must be a positive integer"s;
+      size_t n = as<integer>(args[0])->val;
+
+      std::optional<uint64_t> seed;
+      if (args.size() == 2) {
+        if (args[1] == nullptr || ! args[1]->is(id_type::integer))
+          return "seed must be an integer"s;
+        seed = as<integer>(args[1])->val;
+      }
+
+      if (in_schema.empty() || std::ranges::any_of(in_schema, [](auto p) { return p == nullptr; }))
+        return "batch requires input data"s;
+      auto nrec = data::nrecords(*in_schema[0]);
+      if (std::ranges::any_of(in_schema, [nrec](auto p) { return data::nrecords(*p) != nrec; }))
+        return "inputs must have the same number of records"s;
+      if (nrec > std::numeric_limits<uint32_t>::max())
+        return "too many records"s;
+
+      // Every batch is a separate output.
+      constexpr size_t max_batches = 1 << 16;
+      if ((nrec + n - 1) / n > max_batches)
+        return std::format("more than {} batches", max_batches);
+
+      return std::make_pair(n, seed);
+    }
+
+    std::variant<std::vector<data::schema>,std::string> batch_output_shape(const std::vector<const data::schema*>& in_schema, std::vector<part::cptr_type>& args)
+    {
+      auto a = batch_args(in_schema, args);
+      if (std::holds_alternative<std::string>(a))
+        return std::get<std::string>(a);
+      auto n = std::get<std::pair<size_t,std::optional<uint64_t>>>(a).first;
+
+      // The steps after batch see one batch at a time, the shapes of the first batch stand for all of
+      // them.  Shapes for every batch would just crowd out the others in the cache.  The title tells
+      // the number of batches.  Empty inputs have no batches, the shapes then have no records.
+      std::vector<data::schema> res;
+      auto nrec = data::nrecords(*in_schema[0]);
+      auto nbatches = (nrec + n - 1) / n;
+      auto title = nbatches == 0 ? "no batches"s : std::format("1 of {} batches", nbatches);
+      for (auto p : in_schema) {
+        auto& r = res.emplace_back(data::schema { title, p->columns, p->dimens, nullptr });
+        r.layout = p->layout;
+        r.dimens[0] = std::min(n, nrec);
+        for (auto& c : r.columns) {
+          c.encoding = data::encoding_type::plain;
+          c.enc.reset();
+        }
+      }
+
+      return res;
+    }
+
+    // batch only streams: pipelines run through a cursor get the batches one at a time, the stages
+    // after batch are applied to each batch while the next one is gathered.  There is no result with
+    // all batches at once, it would not match the shape.
+    std::unique_ptr<data::batch_stream> batch_open(const std::vector<const data::schema*>& in_schema, std::vector<part::cptr_type>& args)
+    {
+      auto [n, seed] = std::get<std::pair<size_t,std::optional<uint64_t>>>(batch_args(in_schema, args));
+
+      return std::make_unique<data::batch_stream>(in_schema, n, seed ? data::permutation(data::nrecords(*in_schema[0]), *seed) : std::vector<uint32_t> { });
+    }
+
+    function batch_info {
+      batch_output_shape,
+      nullptr,
+      batch_open
     };
 
 
@@ -189,6 +1061,15 @@ namespace scql::code {
     known.emplace_back(std::make_tuple("reshape"s, &reshape_info));
     known.emplace_back(std::make_tuple("zip"s, &zip_info));
     known.emplace_back(std::make_tuple("split"s, &split_info));
+    known.emplace_back(std::make_tuple("transpose"s, &transpose_info));
+    known.emplace_back(std::make_tuple("compress"s, &compress_info));
+    known.emplace_back(std::make_tuple("count"s, &count_info));
+    known.emplace_back(std::make_tuple("filter"s, &filter_info));
+    known.emplace_back(std::make_tuple("sort"s, &sort_info));
+    known.emplace_back(std::make_tuple("argsort"s, &argsort_info));
+    known.emplace_back(std::make_tuple("group"s, &group_info));
+    known.emplace_back(std::make_tuple("join"s, &join_info));
+    known.emplace_back(std::make_tuple("batch"s, &batch_info));
   }
 
 
@@ -222,4 +1103,58 @@ namespace scql::code {
 
   code_info available;
 
+
+  cursor::cursor(std::vector<step> steps_, const std::vector<const data::schema*>& in_)
+  : steps(std::move(steps_)), in()
+  {
+    for (auto p : in_)
+      in.push_back(*p);
+  }
+
+
+  std::optional<std::vector<data::schema>> cursor::next()
+  {
+    if (! started) {
+      started = true;
+      if (auto r = descend(0, std::move(in)))
+        return r;
+    }
+
+    while (! open.empty()) {
+      auto g = open.back().s->next();
+      if (g.empty()) {
+        open.pop_back();
+        continue;
+      }
+      if (auto r = descend(open.back().from, std::move(g)))
+        return r;
+    }
+
+    return std::nullopt;
+  }
+
+
+  // Apply the steps from FROM on to HELD.  The first group of a stream is passed on right away, the
+  // others are picked up by next().  Nothing is returned if a stream has no groups at all.
+  std::optional<std::vector<data::schema>> cursor::descend(size_t from, std::vector<data::schema> held)
+  {
+    for (auto i = from; i < steps.size(); ++i) {
+      std::vector<const data::schema*> cur;
+      for (const auto& s : held)
+        cur.push_back(&s);
+
+      if (steps[i].fct->streams()) {
+        open.emplace_back(i + 1, steps[i].fct->stream(cur, *steps[i].args));
+        held = open.back().s->next();
+        if (held.empty()) {
+          open.pop_back();
+          return std::nullopt;
+        }
+      } else
+        held = (*steps[i].fct)(cur, *steps[i].args);
+    }
+
+    return held;
+  }
+
 } // namespace scql::data
@@ -2,30 +2,78 @@
 #define _CODE_HH 1
 
 #include "scql.hh"
+#include "batch.hh"
 #include "data.hh"
 
+#include <memory>
+#include <optional>
 #include <variant>
 
 
 namespace scql::code {
 
   struct function {
-    using t_output_shape = std::variant<std::vector<data::schema>,std::string> (*)(const std::vector<data::schema*>&, std::vector<part::cptr_type>&);
-    using t_operate = std::vector<data::schema> (*)(const std::vector<data::schema*>&, std::vector<part::cptr_type>&);
+    using t_output_shape = std::variant<std::vector<data::schema>,std::string> (*)(const std::vector<const data::schema*>&, std::vector<part::cptr_type>&);
+    using t_operate = std::vector<data::schema> (*)(const std::vector<const data::schema*>&, std::vector<part::cptr_type>&);
 
-    function(t_output_shape f_output_shape_, t_operate f_operate_)
-    : f_output_shape(f_output_shape_), f_operate(f_operate_)
+    // Functions producing many groups of outputs can hand them out one at a time.
+    using t_stream = std::unique_ptr<data::batch_stream> (*)(const std::vector<const data::schema*>&, std::vector<part::cptr_type>&);
+
+    function(t_output_shape f_output_shape_, t_operate f_operate_, t_stream f_stream_ = nullptr)
+    : f_output_shape(f_output_shape_), f_operate(f_operate_), f_stream(f_stream_)
     { }
     function(const function&) = delete;
     function operator=(const function&) = delete;
 
-    std::variant<std::vector<data::schema>,std::string> output_shape(const std::vector<data::schema*>& in_schema, std::vector<part::cptr_type>& args) const { return f_output_shape(in_schema, args); }
+    std::variant<std::vector<data::schema>,std::string> output_shape(const std::vector<const data::schema*>& in_schema, std::vector<part::cptr_type>& args) const { return f_output_shape(in_schema, args); }
+
+    std::vector<data::schema> operator()(const std::vector<const data::schema*>& in_schema, std::vector<part::cptr_type>& args) const { return f_operate(in_schema, args); }
 
-    std::vector<data::schema> operator()(const std::vector<data::schema*>& in_schema, std::vector<part::cptr_type>& args) const { return f_operate(in_schema, args); }
+    // Functions which only compute shapes have neither F_OPERATE nor F_STREAM, they cannot be run.
+    // Functions with just F_STREAM are only run through a cursor, their output shape is that of one
+    // group.  operator() must not be used for them.
+    bool runs() const { return f_operate != nullptr || f_stream != nullptr; }
+    bool streams() const { return f_stream != nullptr; }
+    std::unique_ptr<data::batch_stream> stream(const std::vector<const data::schema*>& in_schema, std::vector<part::cptr_type>& args) const { return f_stream(in_schema, args); }
 
   private:
     t_output_shape f_output_shape;
     t_operate f_operate;
+    t_stream f_stream;
+  };
+
+
+  // One stage of a pipeline.
+  struct step {
+    const function* fct;
+    std::vector<part::cptr_type>* args;
+  };
+
+
+  // The results of running STEPS on IN, pulled one group at a time.  A function which streams its
+  // outputs is not run to completion: the steps after it are applied to each of its groups in turn,
+  // while the stream prepares the following groups in the background.  Without streaming functions
+  // there is exactly one group.  The shapes of the inputs must have been checked.
+  class cursor {
+  public:
+    cursor(std::vector<step> steps, const std::vector<const data::schema*>& in);
+
+    // The results of the next group, nothing after the last.
+    std::optional<std::vector<data::schema>> next();
+
+  private:
+    std::optional<std::vector<data::schema>> descend(size_t from, std::vector<data::schema> held);
+
+    // A stream whose groups are passed through the steps from FROM on.
+    struct level {
+      size_t from;
+      std::unique_ptr<data::batch_stream> s;
+    };
+
+    std::vector<step> steps;
+    std::vector<data::schema> in;
+    bool started = false;
+    std::vector<level> open {};
   };
 
 
@@ -0,0 +1,531 @@
+#include "compress.hh"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+
+namespace scql::data {
+
+  namespace {
+
+    // Dictionaries with more entries are not worth it.
+    constexpr size_t max_dictionary = 65536;
+
+
+    uint64_t to_uint(data_type t, const std::byte* p)
+    {
+      if (t == data_type::u8)
+        return std::to_integer<uint64_t>(*p);
+      uint32_t r;
+      std::memcpy(&r, p, sizeof(r));
+      return r;
+    }
+
+
+    void store_uint(data_type t, std::byte* p, uint64_t v)
+    {
+      if (t == data_type::u8)
+        *p = std::byte(v);
+      else {
+        uint32_t r = v;
+        std::memcpy(p, &r, sizeof(r));
+      }
+    }
+
+
+    void pack(encoded_column& res, size_t i, uint64_t code)
+    {
+      if (res.bits == 0)
+        return;
+      auto bit = i * res.bits;
+      auto w = bit / 64;
+      auto o = bit % 64;
+      res.codes[w] |= code << o;
+      if (o + res.bits > 64)
+        res.codes[w + 1] |= code >> (64 - o);
+    }
+
+
+    void alloc_codes(encoded_column& res)
+    {
+      res.codes.assign((res.count * res.bits + 63) / 64 + 1, 0);
+    }
+
+
+    std::shared_ptr<encoded_column> encode_bitpack(const schema::column& c, const schema::column_view& v, bool frame)
+    {
+      auto res = std::make_shared<encoded_column>();
+      res->encoding = frame ? encoding_type::frame_of_reference : encoding_type::bitpack;
+      res->count = v.count;
+      res->csize = c.size();
+
+      uint64_t lo = std::numeric_limits<uint64_t>::max();
+      uint64_t hi = 0;
+      for (size_t i = 0; i < v.count; ++i) {
+        auto e = to_uint(c.type, v.addr(i));
+        lo = std::min(lo, e);
+        hi = std::max(hi, e);
+      }
+      if (! frame || v.count == 0)
+        lo = 0;
+
+      res->reference = lo;
+      res->bits = std::bit_width(hi - lo);
+      alloc_codes(*res);
+      for (size_t i = 0; i < v.count; ++i)
+        pack(*res, i, to_uint(c.type, v.addr(i)) - lo);
+
+      return res;
+    }
+
+
+    std::shared_ptr<encoded_column> encode_dictionary(const schema::column& c, const schema::column_view& v)
+    {
+      auto res = std::make_shared<encoded_column>();
+      res->encoding = encoding_type::dictionary;
+      res->count = v.count;
+      res->csize = c.size();
+
+      // Collect the distinct values first.  Single byte values are common enough to warrant a table.
+      std::array<uint32_t,256> small;
+      std::unordered_map<std::string_view,uint32_t> large;
+      std::vector<const std::byte*> distinct;
+      if (res->csize == 1) {
+        small.fill(UINT32_MAX);
+        for (size_t i = 0; i < v.count; ++i)
+          if (auto b = std::to_integer<unsigned>(*v.addr(i)); small[b] == UINT32_MAX) {
+            small[b] = distinct.size();
+            distinct.push_back(v.addr(i));
+          }
+      } else
+        for (size_t i = 0; i < v.count; ++i)
+          if (large.try_emplace(std::string_view(reinterpret_cast<const char*>(v.addr(i)), res->csize), distinct.size()).second) {
+            if (distinct.size() == max_dictionary)
+              return nullptr;
+            distinct.push_back(v.addr(i));
+          }
+
+      // Order-preserving codes allow range predicates and sorting on the codes.
+      auto csize = res->csize;
+      if (c.type == data_type::str)
+        std::ranges::sort(distinct, [csize](auto a, auto b) { return std::memcmp(a, b, csize) < 0; });
+      else
+        std::ranges::sort(distinct, [t = c.type](auto a, auto b) { return value_less(t, a, b); });
+
+      res->values.resize(distinct.size() * csize);
+      for (size_t i = 0; i < distinct.size(); ++i) {
+        std::memcpy(res->values.data() + i * csize, distinct[i], csize);
+        if (csize == 1)
+          small[std::to_integer<unsigned>(*distinct[i])] = i;
+        else
+          large[std::string_view(reinterpret_cast<const char*>(distinct[i]), csize)] = i;
+      }
+
+      res->bits = distinct.empty() ? 0 : std::bit_width(distinct.size() - 1);
+      alloc_codes(*res);
+      for (size_t i = 0; i < v.count; ++i)
+        if (csize == 1)
+          pack(*res, i, small[std::to_integer<unsigned>(*v.addr(i))]);
+        else
+          pack(*res, i, large[std::string_view(reinterpret_cast<const char*>(v.addr(i)), csize)]);
+
+      return res;
+    }
+
+
+    std::shared_ptr<encoded_column> encode_rle(const schema::column& c, const schema::column_view& v)
+    {
+      auto res = std::make_shared<encoded_column>();
+      res->encoding = encoding_type::rle;
+      res->count = v.count;
+      res->csize = c.size();
+
+      auto csize = res->csize;
+      for (size_t i = 0; i < v.count; ++i)
+        if (i == 0 || std::memcmp(v.addr(i), v.addr(i - 1), csize) != 0) {
+          if (i > 0)
+            res->run_ends.push_back(i);
+          res->values.insert(res->values.end(), v.addr(i), v.addr(i) + csize);
+          // Give up if this cannot be smaller than the plain representation.
+          if (res->values.size() + res->run_ends.size() * sizeof(size_t) > v.count * csize)
+            return nullptr;
+        }
+      if (v.count > 0)
+        res->run_ends.push_back(v.count);
+
+      return res;
+    }
+
+
+    // Codes satisfying a predicate.  For dictionaries a table with an entry per code, otherwise the
+    // inclusive interval [LO, HI], possibly NEGATEd.
+    struct code_set {
+      std::vector<uint8_t> table {};
+      uint64_t lo = 1;
+      uint64_t hi = 0;
+      bool negate = false;
+
+      bool operator()(uint64_t code) const
+      {
+        if (! table.empty())
+          return table[code];
+        return (code - lo <= hi - lo && lo <= hi) != negate;
+      }
+    };
+
+
+    code_set matching_codes(const schema::column& c, const predicate& pred)
+    {
+      const auto& enc = *c.enc;
+      code_set res;
+
+      if (enc.encoding == encoding_type::dictionary) {
+        res.table.resize(enc.values.size() / enc.csize);
+        for (size_t i = 0; i < res.table.size(); ++i)
+          res.table[i] = pred(c, enc.value(i));
+        return res;
+      }
+
+      // The remaining encodings are monotone in the integer value.
+      double vlo = -HUGE_VAL;
+      double vhi = HUGE_VAL;
+      switch (pred.op) {
+      case cmp_op::ne:
+        res.negate = true;
+        [[fallthrough]];
+      case cmp_op::eq:
+        vlo = std::ceil(pred.num);
+        vhi = std::floor(pred.num);
+        break;
+      case cmp_op::lt:
+        vhi = std::ceil(pred.num) - 1.0;
+        break;
+      case cmp_op::le:
+        vhi = std::floor(pred.num);
+        break;
+      case cmp_op::gt:
+        vlo = std::floor(pred.num) + 1.0;
+        break;
+      case cmp_op::ge:
+        vlo = std::ceil(pred.num);
+        break;
+      }
+
+      auto ref = double(enc.reference);
+      auto maxcode = enc.bits == 64 ? double(UINT64_MAX) : std::ldexp(1.0, enc.bits) - 1.0;
+      vlo = std::max(vlo - ref, 0.0);
+      vhi = std::min(vhi - ref, maxcode);
+      if (std::isnan(pred.num) || vlo > vhi) {
+        // Empty interval.
+        res.lo = 1;
+        res.hi = 0;
+      } else {
+        res.lo = vlo;
+        res.hi = vhi;
+      }
+      return res;
+    }
+
+  } // anonymous namespace
+
+
+  double to_double(data_type t, const std::byte* p)
+  {
+    switch (t) {
+    case data_type::u8:
+      return std::to_integer<uint8_t>(*p);
+    case data_type::u32:
+      {
+        uint32_t r;
+        std::memcpy(&r, p, sizeof(r));
+        return r;
+      }
+    case data_type::f32:
+      {
+        float r;
+        std::memcpy(&r, p, sizeof(r));
+        return r;
+      }
+    case data_type::f64:
+      {
+        double r;
+        std::memcpy(&r, p, sizeof(r));
+        return r;
+      }
+    case data_type::str:
+      break;
+    }
+    return 0.0;
+  }
+
+
+  bool value_less(data_type t, const std::byte* a, const std::byte* b)
+  {
+    auto da = to_double(t, a);
+    auto db = to_double(t, b);
+    if (std::isnan(da) || std::isnan(db))
+      return ! std::isnan(da) && std::isnan(db);
+    return da < db;
+  }
+
+
+  bool predicate::operator()(const schema::column& c, const std::byte* p) const
+  {
+    int r;
+    if (c.type == data_type::str) {
+      // Strings are padded with NUL bytes.
+      auto n = c.size();
+      auto l = std::min(n, str.size());
+      r = std::memcmp(p, str.data(), l);
+      if (r == 0) {
+        if (str.size() > n)
+          r = -1;
+        else if (std::any_of(p + l, p + n, [](auto b) { return b != std::byte(0); }))
+          r = 1;
+      }
+    } else {
+      auto v = to_double(c.type, p);
+      if (std::isnan(v) || std::isnan(num))
+        return op == cmp_op::ne;
+      r = v < num ? -1 : v > num ? 1 : 0;
+    }
+
+    switch (op) {
+    case cmp_op::eq:
+      return r == 0;
+    case cmp_op::ne:
+      return r != 0;
+    case cmp_op::lt:
+      return r < 0;
+    case cmp_op::le:
+      return r <= 0;
+    case cmp_op::gt:
+      return r > 0;
+    case cmp_op::ge:
+      return r >= 0;
+    }
+    std::unreachable();
+  }
+
+
+  bool encodable(const schema::column& c, encoding_type e)
+  {
+    switch (e) {
+    case encoding_type::plain:
+    case encoding_type::dictionary:
+    case encoding_type::rle:
+      return true;
+    case encoding_type::bitpack:
+    case encoding_type::frame_of_reference:
+      return (c.type == data_type::u8 || c.type == data_type::u32) && c.size() == type_size(c.type);
+    }
+    std::unreachable();
+  }
+
+
+  std::shared_ptr<const encoded_column> encode(const schema::column& c, const schema::column_view& v, encoding_type e)
+  {
+    if (! encodable(c, e))
+      return nullptr;
+
+    switch (e) {
+    case encoding_type::dictionary:
+      return encode_dictionary(c, v);
+    case encoding_type::bitpack:
+      return encode_bitpack(c, v, false);
+    case encoding_type::frame_of_reference:
+      return encode_bitpack(c, v, true);
+    case encoding_type::rle:
+      return encode_rle(c, v);
+    case encoding_type::plain:
+      break;
+    }
+
+    // Pick the smallest of all possible encodings.
+    std::shared_ptr<const encoded_column> res;
+    size_t best = v.count * c.size();
+    for (auto ee : { encoding_type::rle, encoding_type::dictionary, encoding_type::frame_of_reference, encoding_type::bitpack })
+      if (auto r = encode(c, v, ee); r && r->nbytes() < best) {
+        best = r->nbytes();
+        res = std::move(r);
+      }
+    return res;
+  }
+
+
+  void decode(const encoded_column& enc, std::byte* out)
+  {
+    switch (enc.encoding) {
+    case encoding_type::plain:
+      std::ranges::copy(enc.values, out);
+      break;
+    case encoding_type::dictionary:
+      for (size_t i = 0; i < enc.count; ++i)
+        std::memcpy(out + i * enc.csize, enc.value(enc.code(i)), enc.csize);
+      break;
+    case encoding_type::bitpack:
+    case encoding_type::frame_of_reference:
+      {
+        auto t = enc.csize == 1 ? data_type::u8 : data_type::u32;
+        for (size_t i = 0; i < enc.count; ++i)
+          store_uint(t, out + i * enc.csize, enc.code(i) + enc.reference);
+      }
+      break;
+    case encoding_type::rle:
+      {
+        size_t i = 0;
+        for (size_t r = 0; r < enc.run_ends.size(); ++r)
+          for (; i < enc.run_ends[r]; ++i)
+            std::memcpy(out + i * enc.csize, enc.value(r), enc.csize);
+      }
+      break;
+    }
+  }
+
+
+  schema compress(const schema& s, encoding_type e)
+  {
+    auto ps = plain(s);
+
+    schema res { s.title, s.columns, s.dimens, nullptr, s.writable };
+    res.layout = layout_type::columns;
+    res.zones = s.zones;
+    for (size_t j = 0; j < res.columns.size(); ++j) {
+      auto& c = res.columns[j];
+      auto v = ps.view(j);
+      c.enc = encode(c, v, encodable(c, e) ? e : encoding_type::plain);
+      if (! c.enc) {
+        // Columns which do not compress keep the plain values.
+        auto p = std::make_shared<encoded_column>();
+        p->count = v.count;
+        p->csize = c.size();
+        p->values.resize(v.count * p->csize);
+        for (size_t k = 0; k < v.count; ++k)
+          std::memcpy(p->values.data() + k * p->csize, v.addr(k), p->csize);
+        c.enc = std::move(p);
+      }
+      c.encoding = c.enc->encoding;
+    }
+
+    return res;
+  }
+
+
+  schema decompress(const schema& s)
+  {
+    schema res { s.title, s.columns, s.dimens, nullptr, s.writable };
+    res.layout = layout_type::columns;
+    for (auto& c : res.columns) {
+      c.encoding = encoding_type::plain;
+      c.enc.reset();
+    }
+
+    auto buf = std::make_shared_for_overwrite<std::byte[]>(res.nelems() * res.row_size());
+    res.data = buf.get();
+    res.owner = std::move(buf);
+
+    for (size_t j = 0; j < s.columns.size(); ++j) {
+      auto to = res.view(j);
+      if (s.columns[j].enc)
+        decode(*s.columns[j].enc, to.base);
+      else {
+        auto from = s.view(j);
+        for (size_t i = 0; i < from.count; ++i)
+          std::memcpy(to.addr(i), from.addr(i), to.stride);
+      }
+    }
+
+    return res;
+  }
+
+
+  schema plain(const schema& s)
+  {
+    return std::ranges::any_of(s.columns, [](const auto& c) { return bool(c.enc); }) ? decompress(s) : s;
+  }
+
+
+  schema plain(const schema& s, const std::vector<size_t>& cols)
+  {
+    schema res = s;
+    for (auto j : cols)
+      if (auto& c = res.columns[j]; c.enc && c.encoding != encoding_type::plain) {
+        auto p = std::make_shared<encoded_column>();
+        p->count = c.enc->count;
+        p->csize = c.size();
+        p->values.resize(p->count * p->csize);
+        decode(*c.enc, p->values.data());
+        c.enc = std::move(p);
+        c.encoding = encoding_type::plain;
+      }
+    return res;
+  }
+
+
+  size_t count(const schema::column& c, const predicate& pred)
+  {
+    const auto& enc = *c.enc;
+    size_t res = 0;
+
+    switch (enc.encoding) {
+    case encoding_type::plain:
+      for (size_t i = 0; i < enc.count; ++i)
+        res += pred(c, enc.value(i));
+      break;
+    case encoding_type::rle:
+      for (size_t r = 0; r < enc.run_ends.size(); ++r)
+        if (pred(c, enc.value(r)))
+          res += enc.run_ends[r] - (r == 0 ? 0 : enc.run_ends[r - 1]);
+      break;
+    default:
+      {
+        auto cs = matching_codes(c, pred);
+        for (size_t i = 0; i < enc.count; ++i)
+          res += cs(enc.code(i));
+      }
+      break;
+    }
+
+    return res;
+  }
+
+
+  void select(const schema::column& c, const predicate& pred, size_t from, size_t to, std::vector<uint32_t>& sel)
+  {
+    const auto& enc = *c.enc;
+
+    switch (enc.encoding) {
+    case encoding_type::plain:
+      for (size_t i = from; i < to; ++i)
+        if (pred(c, enc.value(i)))
+          sel.push_back(i);
+      break;
+    case encoding_type::rle:
+      for (auto r = size_t(std::ranges::upper_bound(enc.run_ends, from) - enc.run_ends.begin()); r < enc.run_ends.size(); ++r) {
+        auto start = std::max(from, r == 0 ? 0 : enc.run_ends[r - 1]);
+        if (start >= to)
+          break;
+        if (pred(c, enc.value(r)))
+          for (auto i = start; i < std::min(to, enc.run_ends[r]); ++i)
+            sel.push_back(i);
+      }
+      break;
+    default:
+      {
+        auto cs = matching_codes(c, pred);
+        for (size_t i = from; i < to; ++i)
+          if (cs(enc.code(i)))
+            sel.push_back(i);
+      }
+      break;
+    }
+  }
+
+} // namespace scql::data
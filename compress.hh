@@ -0,0 +1,103 @@
+#ifndef _COMPRESS_HH
+#define _COMPRESS_HH 1
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "data.hh"
+
+
+namespace scql::data {
+
+  // Compressed values of one column.  All encodings but rle store one code per value, bit-packed
+  // with BITS bits each:
+  //  - dictionary: the code is the index into VALUES which is sorted so that the code order is the value order
+  //  - bitpack: the code is the (unsigned integer) value itself
+  //  - frame_of_reference: the code is the difference of the value to REFERENCE
+  // For rle VALUES contains one value per run and RUN_ENDS the (exclusive) index of the end of each run.
+  struct encoded_column {
+    encoding_type encoding = encoding_type::plain;
+    size_t count = 0;
+    size_t csize = 0;
+    unsigned bits = 0;
+    uint64_t reference = 0;
+    std::vector<std::byte> values {};
+    std::vector<size_t> run_ends {};
+    std::vector<uint64_t> codes {};
+
+    uint64_t code(size_t i) const
+    {
+      if (bits == 0)
+        return 0;
+      auto bit = i * bits;
+      auto w = bit / 64;
+      auto o = bit % 64;
+      // There is always one padding word at the end.
+      uint64_t r = codes[w] >> o;
+      if (o + bits > 64)
+        r |= codes[w + 1] << (64 - o);
+      return bits == 64 ? r : r & ((uint64_t(1) << bits) - 1);
+    }
+
+    const std::byte* value(size_t idx) const { return values.data() + idx * csize; }
+
+    size_t nbytes() const { return values.size() + run_ends.size() * sizeof(size_t) + codes.size() * sizeof(uint64_t); }
+  };
+
+
+  enum struct cmp_op {
+    eq,
+    ne,
+    lt,
+    le,
+    gt,
+    ge,
+  };
+
+
+  // Comparison of a column value with a constant.  NUM is used for numeric columns, STR for strings.
+  struct predicate {
+    cmp_op op;
+    double num = 0.0;
+    std::string str {};
+
+    bool operator()(const schema::column& c, const std::byte* p) const;
+  };
+
+
+  double to_double(data_type t, const std::byte* p);
+
+  // Total order of numeric values.  Unlike < on the converted values it is a strict weak ordering
+  // also in the presence of NaNs, which are sorted last.
+  bool value_less(data_type t, const std::byte* a, const std::byte* b);
+
+  bool encodable(const schema::column& c, encoding_type e);
+
+  // Encode the values of the column.  With encoding_type::plain the best encoding is chosen, the result
+  // is nullptr if no encoding is smaller than the plain representation or the requested one is not possible.
+  std::shared_ptr<const encoded_column> encode(const schema::column& c, const schema::column_view& v, encoding_type e = encoding_type::plain);
+
+  void decode(const encoded_column& enc, std::byte* out);
+
+  // Encode all columns of S with E, where possible, or the best encoding.  Columns which cannot be
+  // compressed keep their values in a plain encoded_column.
+  schema compress(const schema& s, encoding_type e = encoding_type::plain);
+
+  // Convert all encoded columns back to the plain representation.
+  schema decompress(const schema& s);
+
+  // S itself if no column is encoded, otherwise decompress(S).
+  schema plain(const schema& s);
+  // Decode only the columns COLS.  They keep their values in a plain encoded_column, the other columns
+  // stay encoded.  Either way view() can be used for the columns in COLS.
+  schema plain(const schema& s, const std::vector<size_t>& cols);
+
+  // These functions operate directly on the encoded representation.
+  size_t count(const schema::column& c, const predicate& pred);
+  void select(const schema::column& c, const predicate& pred, size_t from, size_t to, std::vector<uint32_t>& sel);
+
+} // namespace scql::data
+
+#endif // compress.hh
@@ -1,9 +1,18 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
 #include <format>
 #include <iterator>
 #include <map>
+#include <new>
+#include <set>
 #include <utility>
 
 #include "data.hh"
+#include "compress.hh"
+#include "shm.hh"
+#include "store.hh"
+#include "wal.hh"
 
 using namespace std::literals;
 
@@ -20,8 +29,83 @@ namespace scql::data {
       { data_type::str, "str"s },
     };
 
+    std::map<encoding_type, std::string> encoding_names {
+      { encoding_type::plain, ""s },
+      { encoding_type::dictionary, " dict"s },
+      { encoding_type::bitpack, " packed"s },
+      { encoding_type::rle, " rle"s },
+      { encoding_type::frame_of_reference, " for"s },
+    };
+
   } // anonymous namespace
 
+
+  size_t type_size(data_type t)
+  {
+    switch (t) {
+    case data_type::u8:
+    case data_type::str:
+      return 1;
+    case data_type::u32:
+    case data_type::f32:
+      return 4;
+    case data_type::f64:
+      return 8;
+    }
+    std::unreachable();
+  }
+
+
+  size_t schema::column::size() const
+  {
+    size_t res = type_size(type);
+    for (auto n : dimens)
+      res *= n;
+    return res;
+  }
+
+
+  size_t schema::nelems() const
+  {
+    size_t res = 1;
+    for (auto n : dimens)
+      res *= n;
+    return res;
+  }
+
+
+  size_t schema::row_size() const
+  {
+    size_t res = 0;
+    for (const auto& c : columns)
+      res += c.size();
+    return res;
+  }
+
+
+  size_t schema::column_offset(size_t idx) const
+  {
+    size_t res = 0;
+    for (size_t i = 0; i < idx; ++i)
+      res += columns[i].size();
+    return res;
+  }
+
+
+  schema::column_view schema::view(size_t idx) const
+  {
+    // Columns of compressed schemas for which no encoding helps are stored in ENC as well.
+    if (const auto& c = columns[idx]; c.enc && c.encoding == encoding_type::plain)
+      return { const_cast<std::byte*>(c.enc->values.data()), c.size(), c.enc->count };
+
+    auto base = static_cast<std::byte*>(data);
+    auto n = nelems();
+    if (layout == layout_type::rows)
+      return { base + column_offset(idx), row_size(), n };
+    return { base + column_offset(idx) * n, columns[idx].size(), n };
+  }
+
+
   schema::operator std::string() const
   {
     std::string res = title;
@@ -35,23 +119,110 @@ namespace scql::data {
     for (const auto& c : columns)
       if (c.label.empty()) {
         if (c.dimens.size() == 1)
-          std::format_to(std::back_inserter(res), "({} {}) ", c.dimens[0], type_names[c.type]);
+          std::format_to(std::back_inserter(res), "({} {}{}) ", c.dimens[0], type_names[c.type], encoding_names[c.encoding]);
         else {
           res += '(';
           for (auto n : c.dimens)
             std::format_to(std::back_inserter(res), "{} × ", n);
-          std::format_to(std::back_inserter(res), "{}) ", type_names[c.type]);
+          std::format_to(std::back_inserter(res), "{}{}) ", type_names[c.type], encoding_names[c.encoding]);
         }
       } else {
         if (c.dimens.size() == 1)
-          std::format_to(std::back_inserter(res), "({} {} {}) ", c.label, c.dimens[0], type_names[c.type]);
+          std::format_to(std::back_inserter(res), "({} {} {}{}) ", c.label, c.dimens[0], type_names[c.type], encoding_names[c.encoding]);
         else {
           std::format_to(std::back_inserter(res), "({} ", c.label);
           for (auto n : c.dimens)
             std::format_to(std::back_inserter(res), "{} × ", n);
-          std::format_to(std::back_inserter(res), "{}) ", type_names[c.type]);
+          std::format_to(std::back_inserter(res), "{}{}) ", type_names[c.type], encoding_names[c.encoding]);
+        }
+      }
+
+    if (layout == layout_type::columns)
+      res += "columnar";
+
+    return res;
+  }
+
+
+  namespace {
+
+    constexpr unsigned max_distinct = 16;
+
+    template<typename T>
+    zone_map::zone block_zone(const schema::column_view& v, size_t from, size_t to)
+    {
+      zone_map::zone z { HUGE_VAL, -HUGE_VAL, 0, 0 };
+      std::array<T,max_distinct> seen;
+      bool many = false;
+      for (auto i = from; i < to; ++i) {
+        auto e = v.get<T>(i);
+        if (e != e) {
+          ++z.nans;
+          continue;
+        }
+        z.min = std::min(z.min, double(e));
+        z.max = std::max(z.max, double(e));
+        if (! many && std::find(seen.begin(), seen.begin() + z.distinct, e) == seen.begin() + z.distinct) {
+          if (z.distinct == max_distinct)
+            many = true;
+          else
+            seen[z.distinct++] = e;
         }
       }
+      if (many)
+        z.distinct = 0;
+      return z;
+    }
+
+  } // anonymous namespace
+
+
+  std::shared_ptr<const zone_map> compute_zones(const schema& s, const zone_map* prev, size_t from, size_t to)
+  {
+    if (s.data == nullptr || s.columns.empty())
+      return nullptr;
+
+    auto res = std::make_shared<zone_map>();
+    res->rows = std::max(1zu, chunk_size / std::max(1zu, s.row_size()));
+    if (prev != nullptr && prev->rows != res->rows)
+      prev = nullptr;
+
+    auto n = s.nelems();
+    auto nblocks = (n + res->rows - 1) / res->rows;
+    res->cols.resize(s.columns.size());
+    for (size_t j = 0; j < s.columns.size(); ++j) {
+      const auto& c = s.columns[j];
+      if (c.type == data_type::str || c.size() != type_size(c.type) || c.enc)
+        continue;
+
+      auto v = s.view(j);
+      auto& zs = res->cols[j];
+      zs.resize(nblocks);
+      for (size_t b = 0; b < nblocks; ++b) {
+        auto bfrom = b * res->rows;
+        auto bto = std::min(n, bfrom + res->rows);
+        if (prev != nullptr && (bto <= from || bfrom >= to) && b < prev->cols[j].size()) {
+          zs[b] = prev->cols[j][b];
+          continue;
+        }
+        switch (c.type) {
+        case data_type::u8:
+          zs[b] = block_zone<uint8_t>(v, bfrom, bto);
+          break;
+        case data_type::u32:
+          zs[b] = block_zone<uint32_t>(v, bfrom, bto);
+          break;
+        case data_type::f32:
+          zs[b] = block_zone<float>(v, bfrom, bto);
+          break;
+        case data_type::f64:
+          zs[b] = block_zone<double>(v, bfrom, bto);
+          break;
+        case data_type::str:
+          std::unreachable();
+        }
+      }
+    }
 
     return res;
   }
@@ -75,47 +246,432 @@ namespace scql::data {
   }
 
 
+  std::string format(const std::vector<schema_ptr>& vs)
+  {
+    std::string res;
+
+    for (const auto& v : vs) {
+      if (! res.empty())
+        res += '\n';
+
+      if (v && *v)
+        res += std::string(*v);
+      else
+        res += "<UNKNOWN>";
+    }
+
+    return res;
+  }
+
+
 
   data_info::data_info()
   : known { }
   {
-    known.emplace_back(std::make_tuple("mnist_images"s, schema { "MNIST image data"s, { schema::column { data_type::u8, { 1zu }, ""s } }, { 54880000zu }, static_cast<void*>(mnist_images), false }));
-    known.emplace_back(std::make_tuple("mnist_labels"s, schema { "MNIST image label"s, { schema::column { data_type::u8, { 1zu }, ""s } }, { 70000zu }, static_cast<void*>(mnist_labels), false }));
+    add("mnist_images"s, schema { "MNIST image data"s, { schema::column { data_type::u8, { 1zu }, ""s } }, { 54880000zu }, static_cast<void*>(mnist_images), false });
+    add("mnist_labels"s, schema { "MNIST image label"s, { schema::column { data_type::u8, { 1zu }, ""s } }, { 70000zu }, static_cast<void*>(mnist_labels), false });
 
-    known.emplace_back(std::make_tuple("iris_data"s, schema { "Fisher's Iris data set"s, { schema::column { data_type::str, { 4zu }, ""s }, schema::column { data_type::f32, { 1zu }, "Sepal.Width"s }, schema::column { data_type::f32, { 1zu }, "Sepal.Width"s }, schema::column { data_type::f32, { 1zu }, "Petal.Length"s }, schema::column { data_type::f32, { 1zu }, "Petal.Width"s }, schema::column { data_type::str, { 12zu }, "Species"s }, }, { 150zu }, static_cast<void*>(iris_data), false }));
+    add("iris_data"s, schema { "Fisher's Iris data set"s, { schema::column { data_type::str, { 4zu }, ""s }, schema::column { data_type::f32, { 1zu }, "Sepal.Length"s }, schema::column { data_type::f32, { 1zu }, "Sepal.Width"s }, schema::column { data_type::f32, { 1zu }, "Petal.Length"s }, schema::column { data_type::f32, { 1zu }, "Petal.Width"s }, schema::column { data_type::str, { 12zu }, "Species"s }, }, { 150zu }, static_cast<void*>(iris_data), false });
   }
 
 
-  void data_info::add(const std::string& name, schema s)
+  data_info::~data_info() = default;
+
+
+  std::deque<version>* data_info::find(const std::string& name)
   {
-    known.emplace_back(std::make_tuple(name, s));
+    refresh();
+    for (auto& e : known)
+      if (std::get<std::string>(e) == name)
+        return &std::get<std::deque<version>>(e);
+    return materialize(name);
   }
 
-  const schema& data_info::get(const std::string& s) const
+
+  // Write the record REC of change ID to the log, if there is one, and wait until it is durable and all
+  // changes with lower ids are applied.  The lock is not held while waiting for the log, concurrent
+  // changes share one sync.  A change which cannot be logged is dropped.
+  bool data_info::durable(std::unique_lock<std::mutex>& guard, uint64_t id, std::string&& rec)
   {
-    for (const auto& e : known)
-      if (std::get<std::string>(e) == s)
-        return std::get<schema>(e);
-    std::unreachable();
+    bool ok = true;
+    if (log && ! rec.empty()) {
+      uint64_t lsn = 0;
+      try {
+        lsn = log->append(std::move(rec));
+      } catch (const std::bad_alloc&) {
+        ok = false;
+      }
+      if (ok) {
+        guard.unlock();
+        ok = log->commit(lsn);
+        guard.lock();
+      }
+    }
+    turn_cv.wait(guard, [this, id]{ return turn == id; });
+    if (! ok)
+      finish(id);
+    return ok;
   }
 
 
-  schema& data_info::get(const std::string& s)
+  void data_info::finish(uint64_t id)
   {
-    for (auto& e : known)
-      if (std::get<std::string>(e) == s)
-        return std::get<schema>(e);
+    turn = id + 1;
+    turn_cv.notify_all();
+  }
+
+
+  // Change ID is logged but cannot be applied, e.g., because memory or mappings ran out.  Replaying the
+  // log must skip it as well.  The caller still has the turn, the lock is not held while waiting for
+  // the log.
+  void data_info::abandon(std::unique_lock<std::mutex>& guard, uint64_t id)
+  {
+    if (! log)
+      return;
+    uint64_t lsn;
+    try {
+      lsn = log->append(encode_abort(id));
+    } catch (const std::bad_alloc&) {
+      return;
+    }
+    bool locked = guard.owns_lock();
+    if (locked)
+      guard.unlock();
+    log->commit(lsn);
+    if (locked)
+      guard.lock();
+  }
+
+
+  // Wait until no change is in progress.
+  void data_info::quiesce(std::unique_lock<std::mutex>& guard)
+  {
+    turn_cv.wait(guard, [this]{ return turn == next_version; });
+  }
+
+
+  // Data from a snapshot or another tier is moved into chunks before it is updated.  Compressed data is
+  // restored in column layout.  B itself is left alone, readers might still use its schema; the
+  // result has no mapping if the data cannot be chunked.
+  version data_info::chunked(const version& b) const
+  {
+    version res { b.id, b.s, b.m };
+    if (! res.m && res.s.writable && (res.s.data != nullptr || b.packed)) {
+      if (res.s.data == nullptr) {
+        res.s = decompress(b.packed);
+        res.s.zones = b.packed.zones;
+      }
+      res.m = store(res.s.data, res.s.nelems() * res.s.row_size());
+      res.s.data = res.m->addr;
+      res.s.owner = res.m;
+    }
+    return res;
+  }
+
+
+  // Built-in data (read-only) is used in place.  Otherwise the data is copied into chunks, sharing
+  // those which did not change with the previous version.
+  uint64_t data_info::add(const std::string& name, schema s)
+  {
+    std::unique_lock guard(lock);
+    if (shared && s.writable && s.data != nullptr) {
+      // The id from the region is logged as well.  The data is copied and the log synced without the
+      // lock, the change is applied in turn nevertheless.
+      auto slot = next_version;
+      auto id = shared->reserve(next_version);
+      next_version = id + 1;
+      guard.unlock();
+      bool logged = false;
+      bool ok = false;
+      try {
+        logged = ! log || log->commit(log->append(encode_add(id, name, s)));
+        ok = logged && (shared->add(name, s, id) || (shared->reclaim() > 0 && shared->add(name, s, id)));
+      } catch (const std::bad_alloc&) {
+      }
+      if (logged && ! ok)
+        abandon(guard, id);
+      guard.lock();
+      turn_cv.wait(guard, [this, slot]{ return turn == slot; });
+      refresh();
+      finish(id);
+      return ok ? id : 0;
+    }
+
+    // Without the memory for the record the id is used up nevertheless, the turn must pass it.
+    auto id = next_version++;
+    std::string rec;
+    bool encoded = true;
+    try {
+      if (log && s.writable)
+        rec = encode_add(id, name, s);
+    } catch (const std::bad_alloc&) {
+      encoded = false;
+    }
+    if (! durable(guard, id, std::move(rec)))
+      return 0;
+    finisher done { *this, id };
+    if (! encoded)
+      return 0;
+
+    auto vs = find(name);
+    try {
+      if (vs == nullptr)
+        vs = &std::get<std::deque<version>>(known.emplace_back(name, std::deque<version> { }));
+
+      std::shared_ptr<const mapping> m;
+      if (s.writable && s.data != nullptr) {
+        m = store(s.data, s.nelems() * s.row_size(), vs->empty() ? nullptr : vs->back().m.get());
+        s.data = m->addr;
+        s.owner = m;
+      }
+      if (! s.zones)
+        s.zones = compute_zones(s);
+
+      version v { id, std::move(s), std::move(m) };
+      place(name, v);
+      vs->push_back(std::move(v));
+    } catch (const std::bad_alloc&) {
+      abandon(guard, id);
+      return 0;
+    }
+    trim(*vs);
+    return id;
+  }
+
+
+  uint64_t data_info::update(const std::string& name, size_t offset, const void* p, size_t n)
+  {
+    std::unique_lock guard(lock);
+    auto vs = find(name);
+    if (vs == nullptr || vs->empty())
+      return 0;
+    if (shared && vs->back().s.writable) {
+      if (auto& b = vs->back().s; offset + n > b.nelems() * b.row_size())
+        return 0;
+      auto slot = next_version;
+      auto id = shared->reserve(next_version);
+      next_version = id + 1;
+      guard.unlock();
+      bool logged = false;
+      try {
+        logged = ! log || log->commit(log->append(encode_update(id, name, offset, p, n)));
+      } catch (const std::bad_alloc&) {
+      }
+      guard.lock();
+      turn_cv.wait(guard, [this, slot]{ return turn == slot; });
+      finisher done { *this, id };
+      // Earlier changes are applied now.  The copy of the newest version keeps it in use while the
+      // changed chunks are copied without the lock.
+      refresh();
+      auto b = vs->back();
+      bool ok = false;
+      if (logged && offset + n <= b.s.nelems() * b.s.row_size()) {
+        guard.unlock();
+        // Versions in the region share the unchanged chunks, others are copied.
+        auto put = [&] { return (b.entry ? shared->update(name, *b.entry, id, offset, p, n) : shared->add(name, b.s, id, offset, p, n)).has_value(); };
+        try {
+          ok = put() || (shared->reclaim() > 0 && put());
+        } catch (const std::bad_alloc&) {
+        }
+        if (! ok)
+          abandon(guard, id);
+        guard.lock();
+        refresh();
+      } else if (logged)
+        abandon(guard, id);
+      return ok ? id : 0;
+    }
+    if (auto& b = vs->back().s; ! b.writable || offset + n > b.nelems() * b.row_size())
+      return 0;
+
+    auto id = next_version++;
+    std::string rec;
+    bool encoded = true;
+    try {
+      if (log)
+        rec = encode_update(id, name, offset, p, n);
+    } catch (const std::bad_alloc&) {
+      encoded = false;
+    }
+    if (! durable(guard, id, std::move(rec)))
+      return 0;
+    finisher done { *this, id };
+    if (! encoded)
+      return 0;
+
+    // Changes applied in the meantime might have replaced the version.  The same happens when the log
+    // is replayed, the result is the same.
+    try {
+      auto base = chunked(vs->back());
+      if (! base.m || offset + n > base.m->len) {
+        abandon(guard, id);
+        return 0;
+      }
+
+      auto m = store_update(*base.m, offset, p, n);
+      auto s = std::move(base.s);
+      s.data = m->addr;
+      s.owner = m;
+      if (s.layout == layout_type::rows && s.row_size() != 0)
+        s.zones = compute_zones(s, s.zones.get(), offset / s.row_size(), (offset + n + s.row_size() - 1) / s.row_size());
+      else
+        s.zones = compute_zones(s);
+      version v { id, std::move(s), std::move(m) };
+      place(name, v);
+      vs->push_back(std::move(v));
+    } catch (const std::bad_alloc&) {
+      abandon(guard, id);
+      return 0;
+    }
+    trim(*vs);
+    return id;
+  }
+
+
+  bool data_info::open_log(const std::string& path)
+  {
+    // Changes in the shared region are logged without the lock, their records can be out of order.
+    auto rs = read_log(path);
+    std::ranges::stable_sort(rs, { }, &wal_record::id);
+    std::set<uint64_t> aborted;
+    for (const auto& r : rs)
+      if (r.kind == wal_record::kind_type::abort)
+        aborted.insert(r.id);
+    for (auto& r : rs) {
+      if (aborted.contains(r.id))
+        continue;
+      {
+        // Older changes are already part of the snapshot.
+        std::unique_lock guard(lock);
+        if (r.id < next_version)
+          continue;
+        quiesce(guard);
+        turn = next_version = r.id;
+      }
+      if (r.kind == wal_record::kind_type::add) {
+        r.s.data = r.bytes.data();
+        add(r.name, std::move(r.s));
+      } else
+        update(r.name, r.offset, r.bytes.data(), r.bytes.size());
+    }
+
+    std::lock_guard guard(lock);
+    log = std::make_unique<wal>(path);
+    return log->ok();
+  }
+
+
+  bool data_info::checkpoint(const std::string& path)
+  {
+    // Changes which are logged but not applied yet would be lost.
+    std::unique_lock guard(lock);
+    quiesce(guard);
+    return write_snapshot(path) && (! log || log->reset());
+  }
+
+
+  bool data_info::attach_shared(const std::string& name, size_t size, unsigned mode, int group)
+  {
+    std::lock_guard guard(lock);
+    shared = shared_region::open(name, size, mode, group);
+    shared_seen = 0;
+    return bool(shared);
+  }
+
+
+  // Pick up the versions other processes added to the shared region.  Version numbers are assigned
+  // by the region then.
+  void data_info::refresh()
+  {
+    if (! shared)
+      return;
+    for (auto& [name, v] : shared->since(shared_seen)) {
+      auto it = std::ranges::find_if(known, [&name](const auto& e) { return std::get<std::string>(e) == name; });
+      if (it == known.end())
+        it = known.emplace(known.end(), name, std::deque<version> { });
+      std::get<std::deque<version>>(*it).emplace_back(std::move(v));
+      trim(std::get<std::deque<version>>(*it));
+    }
+  }
+
+
+  size_t data_info::gc(size_t keep)
+  {
+    std::lock_guard guard(lock);
+    // The newest version is what get() returns, it is never dropped.
+    keep = std::max(keep, 1zu);
+    size_t res = 0;
+    for (auto& [_,vs] : known)
+      if (vs.size() > keep) {
+        res += vs.size() - keep;
+        vs.erase(vs.begin(), vs.end() - keep);
+      }
+    // Versions no other process uses either can go away right now.
+    if (shared)
+      shared->reclaim();
+    return res;
+  }
+
+
+  void data_info::retain(size_t keep)
+  {
+    {
+      std::lock_guard guard(lock);
+      keep_versions = std::max(keep, 1zu);
+    }
+    gc(keep);
+  }
+
+
+  // Drop the versions of one cell beyond the retention limit.  The lock must be held.
+  void data_info::trim(std::deque<version>& vs) const
+  {
+    if (vs.size() > keep_versions)
+      vs.erase(vs.begin(), vs.end() - keep_versions);
+  }
+
+
+  schema data_info::get(const std::string& s)
+  {
+    std::lock_guard guard(lock);
+    if (auto vs = find(s))
+      return vs->back().s;
     std::unreachable();
   }
 
 
+  std::optional<schema> data_info::get(const std::string& s, uint64_t version)
+  {
+    std::lock_guard guard(lock);
+    if (auto vs = find(s))
+      for (const auto& v : *vs)
+        if (v.id == version)
+          return v.s;
+    return std::nullopt;
+  }
+
+
+  std::vector<uint64_t> data_info::versions(const std::string& s)
+  {
+    std::lock_guard guard(lock);
+    std::vector<uint64_t> res;
+    if (auto vs = find(s))
+      for (const auto& v : *vs)
+        res.push_back(v.id);
+    return res;
+  }
+
+
 
   std::vector<std::string> data_info::match(const std::string& pfx)
   {
+    std::lock_guard guard(lock);
+    refresh();
     std::vector<std::string> res;
-    for (auto[n,_] : known)
+    for (const auto& [n,_] : known)
       if (n.starts_with(pfx))
         res.emplace_back(n);
+    snapshot_names(pfx, res);
     return res;
   }
 
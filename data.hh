@@ -1,8 +1,16 @@
 #ifndef _DATA_HH
 #define _DATA_HH 1
 
+#include <cstddef>
 #include <cstdint>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
 #include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
 #include <tuple>
 #include <vector>
@@ -19,12 +27,66 @@ namespace scql::data {
   };
 
 
+  size_t type_size(data_type t);
+
+
+  // Memory organization of record-structured data.  With rows all columns of one element are stored
+  // together (array of structures), with columns the values of each column are contiguous for all
+  // elements (structure of arrays).
+  enum struct layout_type {
+    rows,
+    columns,
+  };
+
+
+  // Lightweight compression of individual columns.  See compress.hh.
+  enum struct encoding_type {
+    plain,
+    dictionary,
+    bitpack,
+    rle,
+    frame_of_reference,
+  };
+
+  struct encoded_column;
+
+
+  // Statistics of the scalar numeric columns for blocks of ROWS elements, about the size of a chunk.
+  // DISTINCT is the exact number of distinct values if it is small, zero otherwise.
+  struct zone_map {
+    struct zone {
+      double min;
+      double max;
+      size_t nans;
+      unsigned distinct;
+    };
+
+    size_t rows = 0;
+    std::vector<std::vector<zone>> cols { };    // Empty for columns without statistics.
+  };
+
+
   // Scheme representation.
   struct schema {
     struct column {
       data_type type;
       std::vector<size_t> dimens;
       std::string label;
+      encoding_type encoding = encoding_type::plain;
+      std::shared_ptr<const encoded_column> enc {};    // The values if ENCODING is not plain.
+
+      size_t size() const;
+    };
+
+    // Location of the values of one column: the first value and the distance between values.
+    struct column_view {
+      std::byte* base;
+      size_t stride;
+      size_t count;
+
+      template<typename T>
+      T get(size_t i) const { T r; std::memcpy(&r, base + i * stride, sizeof(T)); return r; }
+      std::byte* addr(size_t i) const { return base + i * stride; }
     };
 
     std::string title {};
@@ -32,28 +94,159 @@ namespace scql::data {
     std::vector<size_t> dimens {};
     void* data = nullptr;
     bool writable = true;    // In a real implementation this would be a ACL or RBAC system.
+    layout_type layout = layout_type::rows;
+    std::shared_ptr<const void> owner {};    // Keeps the memory DATA points to alive, if needed.
+    std::shared_ptr<const zone_map> zones {};
 
     operator bool() const { return ! columns.empty() || ! dimens.empty(); }
     operator std::string() const;
+
+    size_t nelems() const;
+    size_t row_size() const;
+    size_t column_offset(size_t idx) const;
+    column_view view(size_t idx) const;
   };
 
 
+  // Schemas shared by several owners.  They are not changed anymore.
+  using schema_ptr = std::shared_ptr<const schema>;
+
+
   std::string format(const std::vector<schema>& vs);
+  std::string format(const std::vector<schema_ptr>& vs);
+
+
+  // Compute the zone map for S.  Only the blocks overlapping rows [FROM, TO) are computed, the others
+  // are taken from PREV, if available.
+  std::shared_ptr<const zone_map> compute_zones(const schema& s, const zone_map* prev = nullptr, size_t from = 0, size_t to = SIZE_MAX);
 
 
-  // Available data cells.
+  struct mapping;
+  struct snapshot;
+  class wal;
+  class shared_region;
+
+
+  // Where the data of writable cells is kept.
+  enum struct tier : uint8_t {
+    resident,    // In chunks in memory.
+    mapped,      // In an unnamed file, the kernel pages the data in and out.
+    cold,        // Compressed.  The plain data is kept in memory while the cell is used often.
+  };
+
+
+  // One version of a data cell.  The data of stored versions is kept in M which is shared with
+  // the schema.  Built-in data cells have no mapping.  For cold versions PACKED is the compressed
+  // data, S is either the same or the plain data.
+  struct version {
+    uint64_t id;
+    schema s;
+    std::shared_ptr<const mapping> m {};
+    schema packed {};
+    std::optional<size_t> entry {};    // Index in the shared region, if the version is kept there.
+  };
+
+
+  // Available data cells.  For each cell the retained versions are kept, the newest last.  All
+  // functions can be used concurrently.  The schemas are returned as copies which keep the data
+  // alive, also after the version is dropped.
   struct data_info {
     data_info();
+    ~data_info();
 
     std::vector<std::string> match(const std::string& pfx);
 
-    const schema& get(const std::string& s) const;
-    schema& get(const std::string& s);
+    // Cells from a snapshot are materialized on first use, even by lookups.
+    schema get(const std::string& s);
+    // Like get() but for executing a query, this counts as an access of the cell.  See tier.cc.
+    schema use(const std::string& s);
+    // A retained older version, in queries $name@VERSION.
+    std::optional<schema> get(const std::string& s, uint64_t version);
+    std::vector<uint64_t> versions(const std::string& s);
+
+    uint64_t add(const std::string& name, schema s);
+    uint64_t update(const std::string& name, size_t offset, const void* p, size_t n);
+
+    // Drop all but the newest KEEP versions of each data cell.  The newest version is always kept.
+    size_t gc(size_t keep = 1);
+    // From now on keep at most KEEP versions of each cell, older ones are dropped as new ones are added.
+    void retain(size_t keep);
+
+    // The catalog can be saved in a snapshot file.  Loading maps the file, the cells are available
+    // right away but their descriptions are only read on first use.  See catalog.cc.
+    bool save(const std::string& path);
+    bool load(const std::string& path);
 
-    void add(const std::string& name, schema s);
+    // Once the write-ahead log at PATH is opened all changes are durable before they are applied.
+    // Changes made concurrently by several threads share one sync of the log, they are applied in the
+    // order of the log.  The records already in the log, the changes since the last checkpoint, are
+    // replayed first.
+    bool open_log(const std::string& path);
+    // Save the snapshot at PATH and empty the log.
+    bool checkpoint(const std::string& path);
+
+    // Keep new versions in the shared-memory object NAME, together with all other processes using it.
+    // The version ids then come from the region.  A new object gets the permissions MODE and, unless
+    // it is -1, the group GROUP.  Versions this process no longer retains are given up.  gc() and a
+    // full region reclaim those no process uses.
+    bool attach_shared(const std::string& name, size_t size, unsigned mode = 0600, int group = -1);
+
+    // New versions of cells in namespace NS, or a namespace below it, are kept in tier T.  The policy
+    // of the longest matching namespace applies, the empty one matches all cells.  Mapped cells use
+    // files in DIR.  See tier.cc.
+    void set_placement(const std::string& ns, tier t, const std::string& dir = ".");
+
+    // Halve the access counts.  Cold cells which are no longer used often drop the plain data of
+    // their newest version, readers still using it keep it alive.
+    size_t age();
+
+    // Versions retained unless retain() says otherwise.
+    static constexpr size_t default_keep = 16;
 
   private:
-    std::list<std::tuple<std::string,schema>> known;
+    std::deque<version>* find(const std::string& name);
+    std::deque<version>* materialize(const std::string& name);
+    void snapshot_names(const std::string& pfx, std::vector<std::string>& res) const;
+    void refresh();
+    bool write_snapshot(const std::string& path);
+
+    bool durable(std::unique_lock<std::mutex>& guard, uint64_t id, std::string&& rec);
+    void finish(uint64_t id);
+    void abandon(std::unique_lock<std::mutex>& guard, uint64_t id);
+    void quiesce(std::unique_lock<std::mutex>& guard);
+    version chunked(const version& b) const;
+
+    // Ends the turn of change ID when it goes out of scope, also if applying the change failed.
+    struct finisher {
+      data_info& info;
+      uint64_t id;
+      ~finisher() { info.finish(id); }
+    };
+
+    struct placement {
+      tier where;
+      std::string dir;
+    };
+    void place(const std::string& name, version& v) const;
+    void republish(version& v, schema s, schema packed);
+    void trim(std::deque<version>& vs) const;
+
+    // Cells from the snapshot are added when first used.
+    std::list<std::tuple<std::string,std::deque<version>>> known;
+    std::shared_ptr<const snapshot> snap {};
+    std::unique_ptr<wal> log {};
+    std::shared_ptr<shared_region> shared {};
+    uint64_t shared_seen = 0;
+    std::map<std::string,placement> policies {};
+    std::map<std::string,unsigned> accesses {};
+    uint64_t next_version = 1;
+    size_t keep_versions = default_keep;
+
+    // Protects everything above.  Changes are applied in the order of their version ids, TURN is the id
+    // of the next one.
+    std::mutex lock {};
+    std::condition_variable turn_cv {};
+    uint64_t turn = 1;
   };
 
   extern data_info available;
@@ -0,0 +1,37 @@
+#ifndef _HASH_HH
+#define _HASH_HH 1
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+
+namespace scql {
+
+  // Hash of the N bytes at P.  Keys are fixed-size values of a column, not strings, so this only needs
+  // to mix eight bytes at a time.
+  inline uint64_t hash_bytes(const std::byte* p, size_t n)
+  {
+    constexpr uint64_t mul = 0x9e3779b97f4a7c15ull;
+    uint64_t h = n * mul;
+    while (n >= 8) {
+      uint64_t w;
+      std::memcpy(&w, p, 8);
+      h = std::rotl((h ^ w) * mul, 29);
+      p += 8;
+      n -= 8;
+    }
+    if (n > 0) {
+      uint64_t w = 0;
+      std::memcpy(&w, p, n);
+      h = std::rotl((h ^ w) * mul, 29);
+    }
+    h ^= h >> 32;
+    h *= mul;
+    return h ^ (h >> 29);
+  }
+
+} // namespace scql
+
+#endif // hash.hh
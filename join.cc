@@ -0,0 +1,271 @@
+#include "join.hh"
+#include "compress.hh"
+#include "hash.hh"
+#include "parallel.hh"
+#include "sort.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstring>
+#include <format>
+#include <stdexcept>
+#include <tuple>
+
+
+namespace scql::data {
+
+  namespace {
+
+    // Blocked Bloom filter: all bits of one key are in the same word.  With 16 bits per key and three
+    // bits set the false positive rate is below 1%.
+    struct bloom {
+      explicit bloom(size_t n) : words(std::bit_ceil(std::max(1zu, n / 4)), 0) { }
+
+      static uint64_t bits(uint64_t h) { return (1ull << ((h >> 32) & 63)) | (1ull << ((h >> 38) & 63)) | (1ull << ((h >> 44) & 63)); }
+
+      void insert(uint64_t h) { std::atomic_ref(words[h & (words.size() - 1)]).fetch_or(bits(h), std::memory_order_relaxed); }
+
+      bool may_contain(uint64_t h) const
+      {
+        auto b = bits(h);
+        return (words[h & (words.size() - 1)] & b) == b;
+      }
+
+      std::vector<uint64_t> words;
+    };
+
+
+    // Hashed keys of the elements of one input, one list per thread.
+    struct hashed {
+      hashed(unsigned nt) : idx(nt), hashes(nt) { }
+
+      std::vector<std::vector<uint32_t>> idx;
+      std::vector<std::vector<uint64_t>> hashes;
+    };
+
+
+    // The elements grouped by the top bits of the hash.  Partition P is [BOUNDS[P], BOUNDS[P+1]).
+    // Within a partition the elements keep the order of the input lists.
+    struct partitioned {
+      std::vector<size_t> bounds {};
+      std::vector<uint32_t> idx {};
+      std::vector<uint64_t> hashes {};
+    };
+
+
+    partitioned partition(const hashed& in, unsigned bits)
+    {
+      auto nt = unsigned(in.idx.size());
+      auto np = 1zu << bits;
+      auto part = [bits](uint64_t h) { return bits == 0 ? 0zu : h >> (64 - bits); };
+
+      std::vector<std::vector<size_t>> pos(nt, std::vector<size_t>(np));
+      parallel(nt, [&](unsigned t) {
+        for (auto h : in.hashes[t])
+          ++pos[t][part(h)];
+      });
+
+      partitioned res;
+      res.bounds.resize(np + 1);
+      size_t sum = 0;
+      for (size_t p = 0; p < np; ++p) {
+        res.bounds[p] = sum;
+        for (unsigned t = 0; t < nt; ++t)
+          sum += std::exchange(pos[t][p], sum);
+      }
+      res.bounds[np] = sum;
+
+      res.idx.resize(sum);
+      res.hashes.resize(sum);
+      parallel(nt, [&](unsigned t) {
+        for (size_t k = 0; k < in.idx[t].size(); ++k) {
+          auto d = pos[t][part(in.hashes[t][k])]++;
+          res.idx[d] = in.idx[t][k];
+          res.hashes[d] = in.hashes[t][k];
+        }
+      });
+
+      return res;
+    }
+
+  } // anonymous namespace
+
+
+  bool joinable(const schema::column& a, const schema::column& b)
+  {
+    return a.type == b.type && a.size() == b.size();
+  }
+
+
+  join_pairs hash_join(const schema& l, size_t lkey, const schema& r, size_t rkey)
+  {
+    auto lv = l.view(lkey);
+    auto rv = r.view(rkey);
+    auto csize = r.columns[rkey].size();
+
+    // Hash the build side and fill the Bloom filter.
+    auto nr = r.nelems();
+    auto ntr = nthreads(nr);
+    hashed rh(ntr);
+    bloom filter(nr);
+    parallel(ntr, [&](unsigned t) {
+      auto [from, to] = block(nr, ntr, t);
+      rh.idx[t].reserve(to - from);
+      rh.hashes[t].reserve(to - from);
+      for (auto i = from; i < to; ++i) {
+        auto h = hash_bytes(rv.addr(i), csize);
+        filter.insert(h);
+        rh.idx[t].push_back(i);
+        rh.hashes[t].push_back(h);
+      }
+    });
+
+    // Only the elements of the probe side which pass the filter are partitioned.
+    auto nl = l.nelems();
+    auto ntl = nthreads(nl);
+    hashed lh(ntl);
+    parallel(ntl, [&](unsigned t) {
+      auto [from, to] = block(nl, ntl, t);
+      for (auto i = from; i < to; ++i)
+        if (auto h = hash_bytes(lv.addr(i), csize); filter.may_contain(h)) {
+          lh.idx[t].push_back(i);
+          lh.hashes[t].push_back(h);
+        }
+    });
+
+    // The hash table of a partition should fit into the cache.
+    constexpr size_t per_partition = 1 << 15;
+    auto bits = std::min(12u, unsigned(std::bit_width(nr / per_partition)));
+    auto rp = partition(rh, bits);
+    auto lp = partition(lh, bits);
+
+    auto np = 1zu << bits;
+    auto nt = std::min<unsigned>(np, nthreads(nl + nr));
+    std::vector<join_pairs> partial(nt);
+    parallel(nt, [&](unsigned t) {
+      auto& res = partial[t];
+      std::vector<uint32_t> slots;
+      auto [pfrom, pto] = block(np, nt, t);
+      for (auto p = pfrom; p < pto; ++p) {
+        auto rfrom = rp.bounds[p];
+        auto rto = rp.bounds[p + 1];
+        if (rfrom == rto || lp.bounds[p] == lp.bounds[p + 1])
+          continue;
+
+        // Open addressing with linear probing, the slots contain the position in the partition plus one.
+        // Equal keys are found in the order they were inserted.
+        slots.assign(std::bit_ceil(2 * (rto - rfrom)), 0);
+        auto mask = slots.size() - 1;
+        for (auto k = rfrom; k < rto; ++k) {
+          auto s = rp.hashes[k] & mask;
+          while (slots[s] != 0)
+            s = (s + 1) & mask;
+          slots[s] = k - rfrom + 1;
+        }
+
+        for (auto k = lp.bounds[p]; k < lp.bounds[p + 1]; ++k) {
+          auto h = lp.hashes[k];
+          auto key = lv.addr(lp.idx[k]);
+          for (auto s = h & mask; slots[s] != 0; s = (s + 1) & mask) {
+            auto b = rfrom + slots[s] - 1;
+            if (rp.hashes[b] == h && std::memcmp(rv.addr(rp.idx[b]), key, csize) == 0) {
+              res.probe.push_back(lp.idx[k]);
+              res.build.push_back(rp.idx[b]);
+            }
+          }
+        }
+      }
+    });
+
+    // The pairs are reordered through 32-bit indices.
+    size_t npairs = 0;
+    for (const auto& p : partial)
+      npairs += p.probe.size();
+    if (npairs > UINT32_MAX)
+      throw std::length_error(std::format("join has more than {} matches", UINT32_MAX));
+
+    join_pairs res;
+    res.probe.reserve(npairs);
+    res.build.reserve(npairs);
+    for (auto& p : partial) {
+      res.probe.insert(res.probe.end(), p.probe.begin(), p.probe.end());
+      res.build.insert(res.build.end(), p.build.begin(), p.build.end());
+    }
+    return res;
+  }
+
+
+  schema join_shape(const schema& l, const schema& r, size_t rkey)
+  {
+    schema res { "", l.columns, { l.nelems() }, nullptr };
+    // Labels of R which are already used get a suffix, column labels must be unique.  Unlabelled
+    // columns stay unlabelled.
+    auto used = [&res](const std::string& label) { return std::ranges::any_of(res.columns, [&label](const auto& c) { return c.label == label; }); };
+    for (size_t j = 0; j < r.columns.size(); ++j) {
+      if (j == rkey)
+        continue;
+      auto label = r.columns[j].label;
+      if (! label.empty() && used(label)) {
+        size_t n = 1;
+        while (used(std::format("{}_{}", label, n)))
+          ++n;
+        label = std::format("{}_{}", label, n);
+      }
+      res.columns.emplace_back(r.columns[j]).label = std::move(label);
+    }
+    for (auto& c : res.columns) {
+      c.encoding = encoding_type::plain;
+      c.enc.reset();
+    }
+    return res;
+  }
+
+
+  schema join(const schema& l, size_t lkey, const schema& r, size_t rkey)
+  {
+    auto res = join_shape(l, r, rkey);
+    auto lplain = plain(l);
+    auto rplain = plain(r);
+
+    auto pairs = hash_join(lplain, lkey, rplain, rkey);
+
+    // Partitioning mixed up the order.  The pairs for one element of L are in the order of R already
+    // and the sort is stable.
+    schema::column idx { data_type::u32, { 1zu }, "" };
+    auto order = argsort(idx, schema::column_view { reinterpret_cast<std::byte*>(pairs.probe.data()), sizeof(uint32_t), pairs.probe.size() });
+
+    auto n = order.size();
+    res.dimens = { n };
+    auto buf = std::make_shared_for_overwrite<std::byte[]>(n * res.row_size());
+    res.data = buf.get();
+    res.owner = std::move(buf);
+
+    std::vector<std::tuple<schema::column_view,schema::column_view,size_t>> cols;
+    size_t j = 0;
+    for (size_t k = 0; k < lplain.columns.size(); ++k, ++j)
+      cols.emplace_back(lplain.view(k), res.view(j), res.columns[j].size());
+    for (size_t k = 0; k < rplain.columns.size(); ++k)
+      if (k != rkey) {
+        cols.emplace_back(rplain.view(k), res.view(j), res.columns[j].size());
+        ++j;
+      }
+    auto nl = lplain.columns.size();
+
+    auto nt = nthreads(n);
+    parallel(nt, [&](unsigned t) {
+      auto [from, to] = block(n, nt, t);
+      for (auto i = from; i < to; ++i) {
+        auto li = pairs.probe[order[i]];
+        auto ri = pairs.build[order[i]];
+        for (size_t c = 0; c < cols.size(); ++c) {
+          auto& [in, out, size] = cols[c];
+          std::memcpy(out.addr(i), in.addr(c < nl ? li : ri), size);
+        }
+      }
+    });
+
+    return res;
+  }
+
+} // namespace scql::data
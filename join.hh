@@ -0,0 +1,36 @@
+#ifndef _JOIN_HH
+#define _JOIN_HH 1
+
+#include <cstdint>
+#include <vector>
+
+#include "data.hh"
+
+
+namespace scql::data {
+
+  // Element PROBE[i] of the first input matches element BUILD[i] of the second input.
+  struct join_pairs {
+    std::vector<uint32_t> probe {};
+    std::vector<uint32_t> build {};
+  };
+
+
+  bool joinable(const schema::column& a, const schema::column& b);
+
+  // Radix-partitioned hash join of the plain data in L and R on the columns LKEY and RKEY.  The hash
+  // tables are built for R.  The order of the pairs is not defined.  std::length_error is thrown if
+  // there are more than UINT32_MAX pairs.
+  join_pairs hash_join(const schema& l, size_t lkey, const schema& r, size_t rkey);
+
+  // Result of the inner join: all columns of L followed by the columns of R but RKEY.  The number of
+  // matches is only known after the join, the shape uses the number of elements of L which is the limit
+  // if the keys in R are unique.  Labels of R which are also used in L get a suffix: x, x_1, etc.
+  schema join_shape(const schema& l, const schema& r, size_t rkey);
+
+  // The result is in the order of the elements of L, matches of the same element in the order of R.
+  schema join(const schema& l, size_t lkey, const schema& r, size_t rkey);
+
+} // namespace scql::data
+
+#endif // join.hh
@@ -0,0 +1,203 @@
+// Check that the hand-written scanner in parse.cc returns the same tokens as the one generated by
+// flex, with the same locations and values, and time both over a generated script.  The script only
+// depends on its size.  The hand-written scanner is linked under other names, see lexhand.cc.
+//
+//   lexbench [BYTES [RUNS]]
+#include "scql.hh"
+#include "scql-tab.hh"
+#include "scql-scan.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <format>
+#include <iterator>
+#include <random>
+#include <string>
+
+using namespace std::literals;
+
+
+// The hand-written scanner, see lexhand.cc.
+struct hand_buffer_state;
+int hand_scqllex_init(yyscan_t* scanner);
+int hand_scqllex_destroy(yyscan_t scanner);
+void hand_scqlset_extra(scql::arena* a, yyscan_t scanner);
+hand_buffer_state* hand_scql_scan_bytes(const char* bytes, int len, yyscan_t scanner);
+void hand_scql_delete_buffer(hand_buffer_state* b, yyscan_t scanner);
+int hand_scqllex(YYSTYPE* lval, YYLTYPE* lloc, void* yyscanner);
+
+
+namespace {
+
+  // Tokens and separators in about the mix of typed queries.
+  const std::string pieces[] {
+    "$mnist_images"s, "$iris_data"s, "$iris_data@3"s, "$lab::iris:g"s, "$@compute"s, "@fn"s, "sort"s, "group"s, "Sepal_Length"s,
+    "42"s, "7"s, "3.25"s, "1e-3"s, ".5"s, "\"Species\""s, "\"a label\""s, "?"s, "*"s,
+    "["s, "]"s, "("s, ")"s, ","s, ";"s, "|"s,
+    " "s, " "s, "  "s, "\t"s, "\n"s, "\xe2\x80\xaf"s,
+  };
+
+
+  // std::mt19937 produces the same sequence everywhere, the distributions of the library do not.
+  std::string script(size_t n)
+  {
+    std::mt19937 rng(1);
+    std::string res;
+    while (res.size() < n) {
+      res += pieces[rng() % std::size(pieces)];
+      // Words need a separator, otherwise they run together.
+      if (rng() % 2 == 0)
+        res += ' ';
+    }
+    res.resize(n);
+    return res;
+  }
+
+
+  // The value of a token as it is kept in its node.
+  std::string value(const scql::part* p)
+  {
+    if (p == nullptr)
+      return "-"s;
+    auto res = std::format("{}", int(p->id));
+    switch (p->id) {
+    case scql::id_type::integer:
+      std::format_to(std::back_inserter(res), " {}", static_cast<const scql::integer*>(p)->val);
+      break;
+    case scql::id_type::floatnum:
+      std::format_to(std::back_inserter(res), " {}", static_cast<const scql::floatnum*>(p)->val);
+      break;
+    case scql::id_type::string:
+      std::format_to(std::back_inserter(res), " {} {}", static_cast<const scql::string*>(p)->val, static_cast<const scql::string*>(p)->missing_close);
+      break;
+    case scql::id_type::datacell:
+      std::format_to(std::back_inserter(res), " {}@{}", static_cast<const scql::datacell*>(p)->val, static_cast<const scql::datacell*>(p)->version);
+      break;
+    case scql::id_type::codecell:
+    case scql::id_type::computecell:
+    case scql::id_type::ident:
+      std::format_to(std::back_inserter(res), " {}", static_cast<const scql::ident*>(p)->val);
+      break;
+    default:
+      break;
+    }
+    std::format_to(std::back_inserter(res), " {}", p->lloc.format());
+    return res;
+  }
+
+
+  // One of the scanners over TEXT.  The nodes of earlier tokens are not needed, they would just use
+  // up the memory.
+  template<auto init, auto destroy, auto set_extra, auto scan_bytes, auto delete_buffer, auto lex>
+  class tokens {
+  public:
+    explicit tokens(const std::string& text)
+    {
+      init(&scanner);
+      set_extra(&nodes, scanner);
+      buffer = scan_bytes(text.data(), int(text.size()), scanner);
+    }
+    tokens(const tokens&) = delete;
+    tokens& operator=(const tokens&) = delete;
+    ~tokens()
+    {
+      delete_buffer(buffer, scanner);
+      destroy(scanner);
+    }
+
+    int next()
+    {
+      if (nodes.size() >= 65536)
+        nodes.clear();
+      val = nullptr;
+      return lex(&val, &lloc, scanner);
+    }
+
+    // The type, location, and value of the last token.
+    std::string describe(int type) const
+    {
+      return std::format("{} {}.{}-{}.{} {}", type, lloc.first_line, lloc.first_column, lloc.last_line, lloc.last_column, value(val));
+    }
+
+    scql::location lloc { 0, 0, 0, 0 };
+    scql::part::cptr_type val = nullptr;
+
+  private:
+    scql::arena nodes {};
+    yyscan_t scanner = nullptr;
+    decltype(scan_bytes(nullptr, 0, nullptr)) buffer = nullptr;
+  };
+
+  using flex_tokens = tokens<scqllex_init, scqllex_destroy, scqlset_extra, scql_scan_bytes, scql_delete_buffer, scqllex>;
+  using hand_tokens = tokens<hand_scqllex_init, hand_scqllex_destroy, hand_scqlset_extra, hand_scql_scan_bytes, hand_scql_delete_buffer, hand_scqllex>;
+
+
+  // Returns the number of tokens, END included.
+  template<typename T>
+  size_t scan(const std::string& text)
+  {
+    T t(text);
+    size_t res = 1;
+    while (t.next() != scqlEND)
+      ++res;
+    return res;
+  }
+
+
+  // The scanners run side by side, the first difference is reported.
+  bool same_tokens(const std::string& text)
+  {
+    flex_tokens f(text);
+    hand_tokens h(text);
+    for (size_t n = 0; ; ++n) {
+      auto tf = f.next();
+      auto th = h.next();
+      auto df = f.describe(tf);
+      auto dh = h.describe(th);
+      if (df != dh) {
+        std::fprintf(stderr, "token %zu differs\n  flex:         %s\n  hand-written: %s\n", n, df.c_str(), dh.c_str());
+        return false;
+      }
+      if (tf == scqlEND)
+        return true;
+    }
+  }
+
+
+  template<typename T>
+  void time(const char* kind, const std::string& text, unsigned runs)
+  {
+    size_t ntokens = 0;
+    auto best = std::chrono::steady_clock::duration::max();
+    for (unsigned i = 0; i < runs; ++i) {
+      auto start = std::chrono::steady_clock::now();
+      ntokens = scan<T>(text);
+      best = std::min(best, std::chrono::steady_clock::now() - start);
+    }
+
+    auto secs = std::chrono::duration<double>(best).count();
+    std::printf("%s scanner: %zu bytes, %zu tokens, best of %u runs %.3f ms, %.1f MB/s, %.1f ns/token\n", kind, text.size(), ntokens, runs, secs * 1e3, double(text.size()) / secs / 1e6, secs * 1e9 / double(ntokens));
+  }
+
+} // anonymous namespace
+
+
+int main(int argc, char* argv[])
+{
+  size_t bytes = argc > 1 ? std::strtoull(argv[1], nullptr, 0) : 4zu << 20;
+  unsigned runs = argc > 2 ? unsigned(std::strtoul(argv[2], nullptr, 0)) : 5;
+  if (bytes == 0 || bytes > INT_MAX || runs == 0) {
+    std::fprintf(stderr, "usage: %s [BYTES [RUNS]]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  auto text = script(bytes);
+  if (! same_tokens(text))
+    return EXIT_FAILURE;
+
+  time<flex_tokens>("flex", text, runs);
+  time<hand_tokens>("hand-written", text, runs);
+}
@@ -0,0 +1,11 @@
+// The hand-written scanner of parse.cc under other names, for lexbench which links it together with
+// the scanner generated by flex.  See lexbench.cc for the declarations.
+#define yy_buffer_state hand_buffer_state
+#define scqllex hand_scqllex
+#define scqllex_init hand_scqllex_init
+#define scqllex_destroy hand_scqllex_destroy
+#define scqlset_extra hand_scqlset_extra
+#define scql_scan_bytes hand_scql_scan_bytes
+#define scql_delete_buffer hand_scql_delete_buffer
+
+#include "parse.cc"
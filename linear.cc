@@ -1,24 +1,78 @@
 #include "scql.hh"
 
+#include <algorithm>
+#include <bit>
+#include <limits>
+#include <numeric>
+
 
 namespace scql {
 
-  linear::linear(part::cptr_type& root)
+  linear::linear(part::cptr_type root)
   {
-    root->prefix_map([this](part::cptr_type p) { items.emplace_back(p->lloc, p); });
+    walk(root, [this](part& p) { items.emplace_back(p.lloc, &p); return true; });
+
+    order.resize(items.size());
+    std::iota(order.begin(), order.end(), 0u);
+    // Parents start before their children and the statements are in order, usually nothing is moved.
+    if (! std::ranges::is_sorted(order, {}, [this](auto i) { return start(items[i]); }))
+      std::ranges::stable_sort(order, {}, [this](auto i) { return start(items[i]); });
+    starts.reserve(order.size());
+    for (auto i : order)
+      starts.push_back(start(items[i]));
+
+    auto m = std::bit_ceil(std::max(order.size(), 1zu));
+    max_end.assign(2 * m, std::numeric_limits<int64_t>::min());
+    for (size_t i = 0; i < order.size(); ++i)
+      max_end[m + i] = end(items[order[i]]);
+    for (size_t i = m - 1; i > 0; --i)
+      max_end[i] = std::max(max_end[2 * i], max_end[2 * i + 1]);
+  }
+
+
+  void linear::collect(size_t node, size_t lo, size_t hi, size_t n, int64_t pos, std::vector<uint32_t>& res) const
+  {
+    if (lo >= n || max_end[node] <= pos)
+      return;
+    if (hi - lo == 1)
+      res.push_back(order[lo]);
+    else {
+      auto mid = lo + (hi - lo) / 2;
+      collect(2 * node, lo, mid, n, pos, res);
+      collect(2 * node + 1, mid, hi, n, pos, res);
+    }
   }
 
 
   std::vector<linear::item*> linear::at(int x, int y)
   {
     std::vector<item*> res;
+    if (items.empty())
+      return res;
 
-    for (size_t i = 0; i < items.size(); ++i)
-      if (((items[i].p->lloc.first_line == y && items[i].p->lloc.first_column <= x) || items[i].p->lloc.first_line < y)
-          && ((items[i].p->lloc.last_line == y && items[i].p->lloc.last_column > x) || items[i].p->lloc.last_line > y))
-        res.emplace_back(&items[i]);
+    // Only items starting at or before the position are candidates, the tree finds those ending after.
+    auto pos = key(x, y);
+    auto n = size_t(std::ranges::upper_bound(starts, pos) - starts.begin());
+    std::vector<uint32_t> idx;
+    collect(1, 0, max_end.size() / 2, n, pos, idx);
+    std::ranges::sort(idx);
 
+    res.reserve(idx.size());
+    for (auto i : idx)
+      res.emplace_back(&items[i]);
     return res;
   }
 
+
+  linear::item* linear::sweep::at(int x, int y)
+  {
+    auto pos = key(x, y);
+    while (next < lin.order.size() && lin.starts[next] <= pos)
+      active.push(lin.order[next++]);
+    // Items which ended earlier are dropped once they are the innermost.
+    while (! active.empty() && end(lin.items[active.top()]) <= pos)
+      active.pop();
+    return active.empty() ? nullptr : &lin.items[active.top()];
+  }
+
 } // namespace scql
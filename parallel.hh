@@ -0,0 +1,137 @@
+#ifndef _PARALLEL_HH
+#define _PARALLEL_HH 1
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+namespace scql {
+
+  // Number of threads to use for data-parallel work on N elements.  Small inputs are not worth the
+  // overhead of starting threads.
+  inline unsigned nthreads(size_t n)
+  {
+    constexpr size_t min_per_thread = 1 << 16;
+    auto hw = std::max(1u, std::thread::hardware_concurrency());
+    return std::clamp<size_t>(n / min_per_thread, 1, hw);
+  }
+
+
+  // Range of elements of N handled by thread T of NT.
+  inline std::pair<size_t,size_t> block(size_t n, unsigned nt, unsigned t)
+  {
+    return std::make_pair(n * t / nt, n * (t + 1) / nt);
+  }
+
+
+  // Threads kept for parallel().  Starting threads for each parallel section costs more than many of
+  // the sections themselves, e.g., the passes of the radix sort.  Threads are added as needed and run
+  // until the program ends.
+  class thread_pool {
+  public:
+    using job_type = void (*)(const void*, unsigned);
+
+    thread_pool() = default;
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    // Run FN(ARG, T) for all T in [1, NT) on the pool threads and FN(ARG, 0) in the calling thread.
+    // Only one section runs at a time, false is returned without running anything if the pool is busy.
+    // This includes sections started by FN itself.
+    bool run(unsigned nt, job_type fn, const void* arg)
+    {
+      if (busy.exchange(true))
+        return false;
+      {
+        std::lock_guard guard(lock);
+        while (ts.size() + 1 < nt)
+          ts.emplace_back([this, t = unsigned(ts.size() + 1), seen = generation] { work(t, seen); });
+        job = fn;
+        job_arg = arg;
+        job_nt = nt;
+        pending = nt - 1;
+        ++generation;
+      }
+      start_cv.notify_all();
+
+      fn(arg, 0);
+
+      std::unique_lock guard(lock);
+      done_cv.wait(guard, [this] { return pending == 0; });
+      busy = false;
+      return true;
+    }
+
+  private:
+    void work(unsigned t, uint64_t seen)
+    {
+      std::unique_lock guard(lock);
+      while (true) {
+        start_cv.wait(guard, [this, seen] { return generation != seen; });
+        seen = generation;
+        if (t >= job_nt)
+          continue;
+        auto fn = job;
+        auto arg = job_arg;
+        guard.unlock();
+        fn(arg, t);
+        guard.lock();
+        if (--pending == 0)
+          done_cv.notify_one();
+      }
+    }
+
+    std::atomic<bool> busy = false;
+    std::mutex lock {};
+    std::condition_variable start_cv {};
+    std::condition_variable done_cv {};
+    std::vector<std::jthread> ts {};
+    job_type job = nullptr;
+    const void* job_arg = nullptr;
+    unsigned job_nt = 0;
+    unsigned pending = 0;
+    uint64_t generation = 0;
+  };
+
+
+  // Never destroyed, the threads wait for work until the program ends.
+  inline thread_pool& pool()
+  {
+    static auto p = new thread_pool;
+    return *p;
+  }
+
+
+  // Run FCT(t) for all T in [0, NT).  The calling thread handles T == 0.  The threads of the pool are
+  // used unless another section is running, then threads are started just for this one.
+  template<typename F>
+  void parallel(unsigned nt, F&& fct)
+  {
+    if (nt <= 1) {
+      fct(0u);
+      return;
+    }
+
+    auto call = [](const void* p, unsigned t) { (*static_cast<const std::remove_reference_t<F>*>(p))(t); };
+    if (pool().run(nt, call, std::addressof(fct)))
+      return;
+
+    std::vector<std::jthread> ts;
+    ts.reserve(nt);
+    for (unsigned t = 1; t < nt; ++t)
+      ts.emplace_back([&fct, t]() { fct(t); });
+    fct(0u);
+  }
+
+} // namespace scql
+
+#endif // parallel.hh
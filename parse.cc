@@ -1,232 +1,337 @@
-#include <cstdlib>
-#include <list>
-#include <map>
-#include <memory>
-#include <string>
-#include <string_view>
-#include <variant>
-
-using namespace std::literals;
-
-
-
-struct parts_type {
-  enum struct id_type {
-    eot,
-    single,
-    error,
-    number,
-    variable,
-    string,
-    function,
-    reference,
-  };
-
-  parts_type(id_type id_, bool complete_) : id(id_), complete(complete_) { }
-
-  virtual std::string format(const std::string_view& s) const = 0;
+#include "parse.hh"
+#include "scql-tab.hh"
 
-  auto complete_p() const { return complete; }
-
-  id_type id;
-  bool complete;
-};
-
-
-struct eot_type : parts_type {
-  eot_type(bool complete_) : parts_type(parts_type::id_type::eot, complete_) { }
-
-  static std::unique_ptr<parts_type> alloc(const std::string_view& sv, bool complete_ = false) { return std::make_unique<error_type>(complete_); }
-  virtual std::string format(const std::string_view& s) const override { return s; }
-};
-
-
-struct single_type : parts_type {
-  single_type(bool complete_) : parts_type(parts_type::id_type::single, complete_) { }
+#include <array>
+#include <bit>
+#include <charconv>
+#include <cstdint>
+#include <string_view>
 
-  static std::unique_ptr<parts_type> alloc(const std::string_view& sv, bool complete_ = false) { return std::make_unique<error_type>(complete_); }
-  virtual std::string format(const std::string_view& s) const override { return s; }
-};
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
+using namespace std::literals;
 
-struct error_type : parts_type {
-  error_type(bool complete_) : parts_type(parts_type::id_type::error, complete_) { }
 
-  static std::unique_ptr<parts_type> alloc(const std::string_view& sv, bool complete_ = false) { return std::make_unique<error_type>(complete_); }
-  virtual std::string format(const std::string_view& s) const override { return "\e[30;41m"s + s + "\e[0m"; }
+// The input of one call of scql_scan_bytes.  The bytes are not copied.
+struct yy_buffer_state {
+  const char* cur;
+  const char* end;
 };
 
 
-struct number_type : parts_type {
-  number_type(bool complete_) : parts_type(parts_type::id_type::number, complete_) { }
+namespace {
 
-  static std::unique_ptr<parts_type> alloc(const std::string_view& sv, bool complete_ = false) { return std::make_unique<number_type>(complete_); }
-  virtual std::string format(const std::string_view& s) const override { return "\e[33m"s + s + "\e[0m"; }
-};
+  struct scanner {
+    yy_buffer_state* buffer = nullptr;
+    scql::arena* extra = nullptr;
+  };
 
 
-struct variable_type : parts_type {
-  variable_type(bool complete_) : parts_type(parts_type::id_type::variable, complete_) { }
+  // What a byte can start.  Bytes of the class other are skipped like the default rule of flex does,
+  // they are not echoed, though.
+  enum struct char_class : uint8_t {
+    other,
+    blank,
+    newline,
+    digit,
+    dot,
+    alpha,
+    dollar,
+    at,
+    quote,
+    param,
+    single,    // Token of its own, the byte is the token type.
+    nnbsp,     // Maybe the first byte of U+202F, a narrow no-break space.
+  };
 
-  static std::unique_ptr<parts_type> alloc(const std::string_view& sv, bool complete_ = false) { return std::make_unique<variable_type>(complete_); }
-  virtual std::string format(const std::string_view& s) const override { return "\e[32m"s + s + "\e[0m"; }
-};
+  constexpr auto classes = [] {
+    std::array<char_class,256> res {};
+    res[' '] = res['\t'] = char_class::blank;
+    res['\n'] = char_class::newline;
+    for (size_t c = '0'; c <= '9'; ++c)
+      res[c] = char_class::digit;
+    res['.'] = char_class::dot;
+    for (size_t c = 'a'; c <= 'z'; ++c)
+      res[c] = res[c - 'a' + 'A'] = char_class::alpha;
+    res['$'] = char_class::dollar;
+    res['@'] = char_class::at;
+    res['"'] = char_class::quote;
+    res['?'] = char_class::param;
+    for (auto c : "|,;[]()*"sv)
+      res[uint8_t(c)] = char_class::single;
+    res[0xe2] = char_class::nnbsp;
+    return res;
+  }();
+
+  constexpr auto word_chars = [] {
+    std::array<bool,256> res {};
+    for (size_t c = 0; c < res.size(); ++c)
+      res[c] = classes[c] == char_class::alpha || classes[c] == char_class::digit || c == '_';
+    return res;
+  }();
+
+
+  // Predicates for runs of bytes.  With SSE2 sixteen bytes are tested at once.
+  struct blank_run {
+    static bool test(uint8_t c) { return c == ' ' || c == '\t'; }
+#ifdef __SSE2__
+    static __m128i test(__m128i v) { return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))); }
+#endif
+  };
 
+  struct word_run {
+    static bool test(uint8_t c) { return word_chars[c]; }
+#ifdef __SSE2__
+    // Bytes with the high bit set are negative and never in range.
+    static __m128i in(__m128i v, char lo, char hi) { return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(char(lo - 1))), _mm_cmplt_epi8(v, _mm_set1_epi8(char(hi + 1)))); }
+    static __m128i test(__m128i v) { return _mm_or_si128(_mm_or_si128(in(v, '0', '9'), in(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z')), _mm_cmpeq_epi8(v, _mm_set1_epi8('_'))); }
+#endif
+  };
 
-struct string_type : parts_type {
-  string_type(bool complete_) : parts_type(parts_type::id_type::string, complete_) { }
+  struct digit_run {
+    static bool test(uint8_t c) { return c >= '0' && c <= '9'; }
+#ifdef __SSE2__
+    static __m128i test(__m128i v) { return word_run::in(v, '0', '9'); }
+#endif
+  };
 
-  static std::unique_ptr<parts_type> alloc(const std::string_view& sv, bool complete_ = false) { return std::make_unique<string_type>(complete_); }
-  virtual std::string format(const std::string_view& s) const override { return "\e[35m"s + s + "\e[0m"; }
-};
+  struct string_run {
+    static bool test(uint8_t c) { return c != '"' && c != '\n'; }
+#ifdef __SSE2__
+    static __m128i test(__m128i v) { return _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))), _mm_set1_epi8(-1)); }
+#endif
+  };
 
 
-struct function_type : parts_type {
-  function_type(bool complete_) : parts_type(parts_type::id_type::function, complete_) { }
+  // The end of the run of bytes starting at P which satisfy R.
+  template<typename R>
+  const char* skip(const char* p, const char* end)
+  {
+#ifdef __SSE2__
+    for (; end - p >= 16; p += 16)
+      if (auto m = unsigned(_mm_movemask_epi8(R::test(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))))); m != 0xffff)
+        return p + std::countr_one(m);
+#endif
+    while (p < end && R::test(uint8_t(*p)))
+      ++p;
+    return p;
+  }
 
-  static std::unique_ptr<parts_type> alloc(const std::string_view& sv, bool complete_ = false) { return std::make_unique<function_type>(complete_); }
-  virtual std::string format(const std::string_view& s) const override { return "\e[36m"s + s + "\e[0m"; }
-};
 
+  bool is_nnbsp(const char* p, const char* end)
+  {
+    return end - p >= 3 && p[0] == '\xe2' && p[1] == '\x80' && p[2] == '\xaf';
+  }
 
-struct reference_type : parts_type {
-  reference_type(bool complete_) : parts_type(parts_type::id_type::reference, complete_) { }
 
-  static std::unique_ptr<parts_type> alloc(const std::string_view& sv, bool complete_ = false) { return std::make_unique<function_type>(complete_); }
-  virtual std::string format(const std::string_view& s) const override { return "\e[32m"s + s + "\e[0m"; }
-};
+  // The location of the next N bytes, which contain no newline.  The same as YY_USER_ACTION in scql.l.
+  void advance(YYLTYPE* lloc, ptrdiff_t n)
+  {
+    lloc->first_line = lloc->last_line;
+    lloc->first_column = lloc->last_column;
+    lloc->last_column += n;
+  }
 
 
-std::map<parts_type::id_type,std::unique_ptr<parts_type>(*)(const std::string_view&,bool)> id_map {
-  { parts_type::id_type::eot, eot_type::alloc },
-  { parts_type::id_type::number, number_type::alloc },
-  { parts_type::id_type::variable, variable_type::alloc },
-  { parts_type::id_type::string, string_type::alloc },
-  { parts_type::id_type::function, function_type::alloc },
-  { parts_type::id_type::reference, reference_type::alloc },
-};
+  // The end of a number starting at P, and whether it is a floating-point number.  Like flex the
+  // longest match of the int and float patterns in scql.l is used.  NULLPTR if there is none.
+  std::pair<const char*,bool> number(const char* p, const char* end)
+  {
+    auto ip = skip<digit_run>(p, end);
+    const char* res = ip == p ? nullptr : ip;
+    bool is_float = false;
 
+    if (ip < end && *ip == '.') {
+      auto fp = skip<digit_run>(ip + 1, end);
+      if (ip != p || fp != ip + 1) {
+        res = fp;
+        is_float = true;
+      }
+    }
 
-struct token_type {
-  token_type(const std::string_view& s, size_t from_, size_t to_, parts_type::id_type id, bool complete_)
-  : from(from_), to(to_), part(id_map[id](std::string_view(s.data() + from_, to_), complete_)) { }
-  token_type(const token_type&) = delete;
-  token_type& operator=(const token_type&) = delete;
+    if (res != nullptr && res < end && (*res == 'e' || *res == 'E')) {
+      auto ep = res + 1;
+      if (ep < end && (*ep == '+' || *ep == '-'))
+        ++ep;
+      if (auto dp = skip<digit_run>(ep, end); dp != ep) {
+        res = dp;
+        is_float = true;
+      }
+    }
 
-  static std::unique_ptr<token_type> alloc(const std::string_view& s, size_t from_, size_t to_, parts_type::id_type i, bool complete_) { return std::make_unique<token_type>(s, from_, to_, i, complete_); }
+    return { res, is_float };
+  }
 
-  size_t from;
-  size_t to;
 
-  std::unique_ptr<parts_type> part;
-};
+  // An identifier is optional after the sigils of cells.
+  const char* opt_ident(const char* p, const char* end)
+  {
+    return p < end && classes[uint8_t(*p)] == char_class::alpha ? skip<word_run>(p + 1, end) : p;
+  }
 
 
-std::pair<std::unique_ptr<token_type>,size_t> scan(const std::string_view& s, size_t off)
-{
-  while (off < s.size() && ! isspace(s[off]))
-    ++off;
-
-  if (off == s.size())
-    return std::make_pair(token_type::alloc(s, off, off, parts_type::id_type::eot, false), off);
-
-  if (s[off] == '$') {
-    if (off + 1 == s.size())
-      return std::make_pair(token_type::alloc(s, off, off + 1, parts_type::id_type::reference, false), off + 1);
-    if (s[off + 1] == '[') {
-      auto last = s.find_first_of(']', off + 2);
-      if (last == std::string_view::npos)
-        return std::make_pair(token_type::alloc(s, off, s.size(), parts_type::id_type::reference, false), last);
-
-      return std::make_pair(token_type::alloc(s, off, last + 1, parts_type::id_type::reference, true), last + 1);
-    } else {
-      auto last = s.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ:"sv, off + 1);
-      if (last == std::string_view::npos)
-        last = s.size();
-      return std::make_pair(token_type::alloc(s, off, last, parts_type::id_type::reference, last > 0), last);
+  // Data cell names can have a namespace, the parts are separated by one or two colons.
+  const char* opt_cell_name(const char* p, const char* end)
+  {
+    auto cur = opt_ident(p, end);
+    while (cur > p && cur < end && *cur == ':') {
+      auto q = cur + 1 < end && cur[1] == ':' ? cur + 2 : cur + 1;
+      auto e = opt_ident(q, end);
+      if (e == q)
+        break;
+      cur = e;
     }
+    return cur;
   }
 
-  if (isdigit(s[off])) {
-    auto last = s.find_first_not_of("0123456789"sv, off);
-    if (last != std::string_view::npos && s[last] == '.')
-      last = s.find_first_not_of("0123456789"sv, off);
-    if (last == std::string_view::npos)
-      last = s.size();
-    return std::make_pair(token_type::alloc(s, off, last, parts_type::id_type::number, true), last);
-  }
+} // anonymous namespace
 
-  if (s[off] == '"' || s[off] == '\'') {
-    char q = s[off];
-    bool triple = false;
-
-    auto last = off;
-    if (off + 2 < s.size() && s[off + 1] == q && s[off + 2] == q) {
-      triple = true;
-      last += 3;
-    } else
-      last += 1;
-
-    bool complete = false;
-    while (last < s.size()) {
-      if (s[last] == q) {
-        if (! triple) {
-          last += 1;
-          break;
-        }
-        if (last + 2 < s.size() && s[last + 1] == q && s[last + 2] == q) {
-          last += 3;
-          break;
-        }
-      }
-      ++last;
-    }
 
-    return std::make_pair(token_type::alloc(s, off, last, parts_type::id_type::string, true), last);
-  }
+int scqllex_init(yyscan_t* p)
+{
+  *p = new scanner;
+  return 0;
+}
+
 
-  return std::make_pair(token_type::alloc(s, off, off + 1, parts_type::id_type::single, false), off + 1);
+int scqllex_destroy(yyscan_t p)
+{
+  delete static_cast<scanner*>(p);
+  return 0;
 }
 
 
-struct tree_type {
-  using atom_type = std::unique_ptr<token_type>;
-  using seq_type = std::list<std::unique_ptr<tree_type>>;
+void scqlset_extra(scql::arena* a, yyscan_t p)
+{
+  static_cast<scanner*>(p)->extra = a;
+}
 
-  enum struct node_type {
-    atom,
-    fcall,
-    seq,
-  };
 
-  tree_type(node_type t_) : t(t_) { }
+YY_BUFFER_STATE scql_scan_bytes(const char* bytes, int len, yyscan_t p)
+{
+  return static_cast<scanner*>(p)->buffer = new yy_buffer_state { bytes, bytes + len };
+}
 
-  static std::unique_ptr<tree_type> alloc_atom(atom_type& v) { auto res = std::make_unique<tree_type>(node_type::atom); res->val = std::move(v); return res; }
-  static std::unique_ptr<tree_type> alloc_fcall(atom_type& v) { auto res = std::make_unique<tree_type>(node_type::fcall); res->val = std::move(v); return res; }
-  static std::unique_ptr<tree_type> alloc_seq() { return std::make_unique<tree_type>(node_type::seq); }
 
-  void add(std::unique_ptr<tree_type>& n) { std::get<seq_type>(val).emplace_back(std::move(n)); }
+void scql_delete_buffer(YY_BUFFER_STATE b, yyscan_t p)
+{
+  if (static_cast<scanner*>(p)->buffer == b)
+    static_cast<scanner*>(p)->buffer = nullptr;
+  delete b;
+}
 
-  node_type t;
-  std::variant<atom_type,seq_type> val;
-};
 
+int scqllex(YYSTYPE* lval, YYLTYPE* lloc, void* yyscanner)
+{
+  auto& a = *static_cast<scanner*>(yyscanner)->extra;
+  auto& cur = static_cast<scanner*>(yyscanner)->buffer->cur;
+  auto end = static_cast<scanner*>(yyscanner)->buffer->end;
+
+  while (cur < end) {
+    auto p = cur;
+    switch (classes[uint8_t(*p)]) {
+    case char_class::nnbsp:
+      if (! is_nnbsp(p, end))
+        break;
+      [[fallthrough]];
+    case char_class::blank:
+      // One match for the whole run, as with flex.
+      do
+        cur = skip<blank_run>(is_nnbsp(cur, end) ? cur + 3 : cur, end);
+      while (is_nnbsp(cur, end));
+      advance(lloc, cur - p);
+      continue;
+
+    case char_class::newline:
+      lloc->first_line = lloc->last_line;
+      lloc->first_column = lloc->last_column;
+      ++lloc->last_line;
+      lloc->last_column = 0;
+      ++cur;
+      continue;
+
+    case char_class::digit:
+    case char_class::dot:
+      if (auto [e,is_float] = number(p, end); e != nullptr) {
+        advance(lloc, e - p);
+        cur = e;
+        if (is_float) {
+          double f = 0.0;
+          std::from_chars(p, e, f);
+          *lval = scql::floatnum::alloc(a, f, *lloc);
+        } else {
+          intmax_t i = 0;
+          std::from_chars(p, e, i);
+          *lval = scql::integer::alloc(a, i, *lloc);
+        }
+        return scqlATOM;
+      }
+      break;
 
-enum struct state_type {
-  top,
-};
+    case char_class::alpha:
+      cur = skip<word_run>(p + 1, end);
+      advance(lloc, cur - p);
+      *lval = scql::ident::alloc(a, p, cur - p, *lloc);
+      return scqlIDENT;
+
+    case char_class::dollar:
+      if (p + 1 < end && p[1] == '@') {
+        cur = opt_ident(p + 2, end);
+        advance(lloc, cur - p);
+        *lval = scql::computecell::alloc(a, p + 2, cur - p - 2, *lloc);
+      } else {
+        cur = opt_cell_name(p + 1, end);
+        // A version id can follow the name.
+        if (cur > p + 1 && cur + 1 < end && *cur == '@' && classes[uint8_t(cur[1])] == char_class::digit)
+          cur = skip<digit_run>(cur + 1, end);
+        advance(lloc, cur - p);
+        *lval = scql::datacell::alloc(a, p + 1, cur - p - 1, *lloc);
+      }
+      return scqlATOM;
+
+    case char_class::at:
+      cur = opt_ident(p + 1, end);
+      advance(lloc, cur - p);
+      *lval = scql::codecell::alloc(a, p + 1, cur - p - 1, *lloc);
+      return scqlCODECELL;
+
+    case char_class::quote:
+      if (auto e = skip<string_run>(p + 1, end); e < end && *e == '"') {
+        cur = e + 1;
+        advance(lloc, cur - p);
+        *lval = scql::string::alloc(a, p, cur - p, *lloc);
+      } else {
+        cur = e;
+        advance(lloc, cur - p);
+        auto s = scql::string::alloc(a, p, cur - p, *lloc);
+        s->missing_close = true;
+        *lval = s;
+      }
+      return scqlATOM;
 
+    case char_class::param:
+      ++cur;
+      advance(lloc, 1);
+      *lval = scql::param::alloc(a, *lloc);
+      return scqlPARAM;
 
-std::pair<std::unique_ptr<tree_type>,size_t> parse(const std::string_view& s, size_t off)
-{
-  state_type state = state_type::top;
-  auto res = tree_type::alloc_seq();
+    case char_class::single:
+      ++cur;
+      advance(lloc, 1);
+      *lval = scql::syntax::alloc(a, *lloc);
+      return uint8_t(*p);
 
-  while (true) {
-    auto[tok,newoff] = scan(s, off);
-    if (tok->part->id == parts_type::id_type::eot)
+    case char_class::other:
       break;
+    }
+
+    // No token starts here, the byte is skipped.
+    ++cur;
+    advance(lloc, 1);
   }
 
-  return std::make_pair(std::move(res), off);
+  *lval = scql::syntax::alloc(a, *lloc);
+  return scqlEND;
 }
@@ -0,0 +1,20 @@
+#ifndef _PARSE_HH
+#define _PARSE_HH 1
+
+#include "scql.hh"
+
+
+// The hand-written scanner in parse.cc has the interface of the flex scanner generated from scql.l
+// and returns the same tokens.  It is used instead if SCQL_HANDWRITTEN_LEXER is defined.  Unlike with
+// flex the bytes given to scql_scan_bytes are not copied, they must not change until the buffer is
+// deleted.  scqllex itself is declared in scql-tab.hh.
+typedef struct yy_buffer_state* YY_BUFFER_STATE;
+typedef void* yyscan_t;
+
+int scqllex_init(yyscan_t* scanner);
+int scqllex_destroy(yyscan_t scanner);
+void scqlset_extra(scql::arena* a, yyscan_t scanner);
+YY_BUFFER_STATE scql_scan_bytes(const char* bytes, int len, yyscan_t scanner);
+void scql_delete_buffer(YY_BUFFER_STATE b, yyscan_t scanner);
+
+#endif // parse.hh
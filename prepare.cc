@@ -0,0 +1,310 @@
+#include "prepare.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <format>
+#include <iterator>
+#include <stdexcept>
+
+using namespace std::literals;
+
+
+namespace scql {
+
+  namespace {
+
+    const auto form_msg = "prepared pipeline must be data cells followed by operations"s;
+
+
+    // Argument P as it is written in a query, nothing for what cannot be written back.
+    std::optional<std::string> unparse(const part* p)
+    {
+      if (p == nullptr)
+        return std::nullopt;
+      switch (p->id) {
+      case id_type::integer:
+        if (auto v = static_cast<const integer*>(p)->val; v >= 0)
+          return std::format("{}", v);
+        break;
+      case id_type::floatnum:
+        if (auto v = static_cast<const floatnum*>(p)->val; std::isfinite(v) && v >= 0) {
+          // Without a fraction or exponent it would be read as an integer.
+          auto res = std::format("{}", v);
+          if (res.find_first_of(".e") == std::string::npos)
+            res += ".0";
+          return res;
+        }
+        break;
+      case id_type::string:
+        if (! static_cast<const string*>(p)->missing_close)
+          return static_cast<const string*>(p)->val;
+        break;
+      case id_type::ident:
+        return static_cast<const ident*>(p)->val;
+      default:
+        break;
+      }
+      return std::nullopt;
+    }
+
+  } // anonymous namespace
+
+
+  prepared::prepared(const std::string& text)
+  {
+    if (ctx.parse(text) != 0 || ! ctx.result || ! ctx.result->is(id_type::pipeline)) {
+      errmsg = std::format("invalid pipeline \"{}\"", text);
+      return;
+    }
+
+    auto& l = as<pipeline>(ctx.result)->l;
+    std::vector<data::schema_ptr> inputs;
+    if (l.empty() || l[0] == nullptr || ! l[0]->is(id_type::statements)) {
+      errmsg = form_msg;
+      return;
+    }
+    for (auto e : as<statements>(l[0])->l) {
+      if (e == nullptr || ! e->is(id_type::datacell)) {
+        errmsg = form_msg;
+        return;
+      }
+      auto d = as<datacell>(e);
+      if (auto av = data::available.match(d->val); std::ranges::find(av, d->val) == av.end()) {
+        errmsg = std::format("unknown data cell {}", d->val);
+        return;
+      }
+      auto s = d->version != 0 ? data::available.get(d->val, d->version) : data::available.get(d->val);
+      if (! s) {
+        errmsg = std::format("no version {} of data cell {}", d->version, d->val);
+        return;
+      }
+      sources.emplace_back(d->val, d->version);
+      inputs.push_back(ctx.shapes.intern(*s));
+    }
+
+    fixed = SIZE_MAX;
+    for (size_t i = 1; i < l.size(); ++i) {
+      if (l[i] == nullptr || ! l[i]->is(id_type::statements) || as<statements>(l[i])->l.size() != 1 || as<statements>(l[i])->l[0] == nullptr) {
+        errmsg = form_msg;
+        return;
+      }
+      auto e = as<statements>(l[i])->l[0];
+
+      if (e->is(id_type::datacell) && i + 1 == l.size()) {
+        target = as<datacell>(e)->val;
+        if (as<datacell>(e)->version != 0) {
+          errmsg = std::format("cannot store in version {} of {}", as<datacell>(e)->version, target);
+          return;
+        }
+        if (auto av = data::available.match(target); std::ranges::find(av, target) != av.end() && ! data::available.get(target).writable) {
+          errmsg = std::format("no permission to write {}", target);
+          return;
+        }
+        break;
+      }
+
+      if (! e->is(id_type::fcall) || as<fcall>(e)->fname == nullptr || ! as<fcall>(e)->fname->is(id_type::ident)) {
+        errmsg = form_msg;
+        return;
+      }
+      auto f = as<fcall>(e);
+      auto& fname = as<ident>(f->fname)->val;
+      if (auto av = code::available.match(fname); std::ranges::find(av, fname) == av.end()) {
+        errmsg = std::format("unknown operation {}", fname);
+        return;
+      }
+      if (! code::available.get(fname).runs() && shape_only.empty())
+        shape_only = std::format("operation {} cannot be run yet", fname);
+
+      for (size_t a = 0; a < f->args.size(); ++a)
+        if (f->args[a] != nullptr && f->args[a]->is(id_type::param)) {
+          auto& lloc = f->args[a]->lloc;
+          slots.push_back({ f, a, integer::alloc(ctx.nodes, 0, lloc), floatnum::alloc(ctx.nodes, 0.0, lloc), string::alloc(ctx.nodes, ""s, lloc) });
+          fixed = std::min(fixed, stages.size());
+        }
+
+      stages.push_back({ fname, &code::available.get(fname), f });
+    }
+    fixed = std::min(fixed, stages.size());
+
+    // The shapes before the first placeholder are computed now.  Errors there are errors of the text.
+    planned.resize(stages.size() + 1);
+    planned[0] = std::move(inputs);
+    for (size_t i = 0; i < fixed; ++i) {
+      auto& oshape = ctx.shapes.output_shape(stages[i].fname, planned[i], stages[i].call->args);
+      if (std::holds_alternative<std::string>(oshape)) {
+        errmsg = std::format("{}: {}", stages[i].fname, std::get<std::string>(oshape));
+        return;
+      }
+      planned[i + 1] = std::get<std::vector<data::schema_ptr>>(oshape);
+    }
+  }
+
+
+  std::variant<std::vector<data::schema_ptr>,std::string> prepared::shape(const std::vector<value>& values)
+  {
+    if (auto r = plan(values, false); std::holds_alternative<std::string>(r))
+      return std::get<std::string>(r);
+    return planned.back();
+  }
+
+
+  // Fetch the sources and compute the shapes for VALUES from them.  With USE this counts as an access
+  // for a run.  The result are the sources, a run must work on the very versions the shapes are for.
+  std::variant<std::vector<data::schema>,std::string> prepared::plan(const std::vector<value>& values, bool use)
+  {
+    if (! ok())
+      return errmsg;
+    if (values.size() != slots.size())
+      return std::format("{} values for {} placeholders", values.size(), slots.size());
+
+    for (size_t j = 0; j < slots.size(); ++j) {
+      auto& sl = slots[j];
+      if (auto i = std::get_if<intmax_t>(&values[j])) {
+        sl.i->val = *i;
+        sl.call->args[sl.arg] = sl.i;
+      } else if (auto f = std::get_if<double>(&values[j])) {
+        sl.f->val = *f;
+        sl.call->args[sl.arg] = sl.f;
+      } else {
+        sl.s->val = std::format("\"{}\"", std::get<std::string>(values[j]));
+        sl.call->args[sl.arg] = sl.s;
+      }
+    }
+
+    std::vector<data::schema> in;
+    for (const auto& src : sources)
+      if (src.version == 0)
+        in.push_back(use ? data::available.use(src.name) : data::available.get(src.name));
+      else if (auto s = data::available.get(src.name, src.version))
+        in.push_back(std::move(*s));
+      else
+        return std::format("version {} of data cell {} was dropped", src.version, src.name);
+
+    // A new version of a data cell invalidates all shapes.  Older versions do not change.
+    auto from = fixed;
+    for (size_t j = 0; j < sources.size(); ++j)
+      if (sources[j].version != 0)
+        continue;
+      else if (auto s = ctx.shapes.intern(in[j]); s != planned[0][j]) {
+        planned[0][j] = std::move(s);
+        from = 0;
+      }
+
+    for (auto i = from; i < stages.size(); ++i) {
+      auto& oshape = ctx.shapes.output_shape(stages[i].fname, planned[i], stages[i].call->args);
+      if (std::holds_alternative<std::string>(oshape)) {
+        // The shapes before the first placeholder must be computed again next time.
+        if (i < fixed)
+          std::ranges::fill(planned[0], nullptr);
+        auto& s = std::get<std::string>(oshape);
+        return std::format("{}: {}", stages[i].fname, s.empty() ? "invalid arguments"s : s);
+      }
+      planned[i + 1] = std::get<std::vector<data::schema_ptr>>(oshape);
+    }
+
+    if (! target.empty() && planned.back().size() != 1)
+      return std::format("cannot store {} results in {}", planned.back().size(), target);
+
+    return in;
+  }
+
+
+  std::variant<std::vector<data::schema>,std::string> prepared::operator()(const std::vector<value>& values, data::worker_pool* workers)
+  {
+    auto in = plan(values, true);
+    if (std::holds_alternative<std::string>(in))
+      return std::get<std::string>(in);
+    auto& srcs = std::get<std::vector<data::schema>>(in);
+
+    std::vector<data::schema> held;
+    auto frag = workers != nullptr ? fragment() : std::nullopt;
+    if (frag && (srcs[0].dimens.empty() || srcs[0].dimens[0] < data::worker_pool::min_records))
+      frag.reset();
+    if (frag) {
+      auto r = workers->run(srcs[0], data::partitioning::block, 0, *frag);
+      if (std::holds_alternative<std::string>(r))
+        return std::get<std::string>(r);
+      held = std::move(std::get<std::vector<data::schema>>(r));
+    } else {
+      auto c = launch(srcs);
+      if (std::holds_alternative<std::string>(c))
+        return std::get<std::string>(c);
+      try {
+        while (auto g = std::get<code::cursor>(c).next())
+          std::ranges::move(*g, std::back_inserter(held));
+      } catch (const std::length_error& e) {
+        // Operators whose result does not fit their index type fail the query.
+        return std::string(e.what());
+      }
+    }
+
+    if (! target.empty()) {
+      // The stored copy belongs to the target, also if the result is a read-only source.
+      auto s = held.size() == 1 ? held[0] : data::schema { };
+      s.writable = true;
+      if (! s || (written = data::available.add(target, std::move(s))) == 0)
+        return std::format("cannot store result in {}", target);
+    }
+
+    return held;
+  }
+
+
+  std::variant<code::cursor,std::string> prepared::start(const std::vector<value>& values)
+  {
+    auto in = plan(values, true);
+    if (std::holds_alternative<std::string>(in))
+      return std::get<std::string>(in);
+    return launch(std::get<std::vector<data::schema>>(in));
+  }
+
+
+  // The cursor running the stages on IN, the sources the shapes were computed for.
+  std::variant<code::cursor,std::string> prepared::launch(const std::vector<data::schema>& in)
+  {
+    if (! shape_only.empty())
+      return shape_only;
+
+    std::vector<const data::schema*> cur;
+    for (const auto& s : in)
+      cur.push_back(&s);
+    std::vector<code::step> steps;
+    for (auto& st : stages)
+      steps.push_back({ st.fct, &st.call->args });
+
+    return code::cursor(std::move(steps), cur);
+  }
+
+
+  // The stages as the text of a plan fragment for a worker_pool, if they can be distributed.  The
+  // placeholders would need their values.
+  std::optional<std::string> prepared::fragment() const
+  {
+    std::vector<std::string> fnames;
+    for (const auto& st : stages)
+      fnames.push_back(st.fname);
+    if (sources.size() != 1 || stages.empty() || ! slots.empty() || ! data::distributable(fnames))
+      return std::nullopt;
+
+    std::string res;
+    for (const auto& st : stages) {
+      if (! res.empty())
+        res += " | ";
+      res += st.fname;
+      res += '[';
+      for (size_t a = 0; a < st.call->args.size(); ++a) {
+        auto arg = unparse(st.call->args[a]);
+        if (! arg)
+          return std::nullopt;
+        if (a > 0)
+          res += ", ";
+        res += *arg;
+      }
+      res += ']';
+    }
+    return res;
+  }
+
+} // namespace scql
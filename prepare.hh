@@ -0,0 +1,100 @@
+#ifndef _PREPARE_HH
+#define _PREPARE_HH 1
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <variant>
+#include <vector>
+
+#include "scql.hh"
+#include "code.hh"
+#include "data.hh"
+#include "workers.hh"
+
+
+namespace scql {
+
+  // A pipeline which is parsed and checked once and then run many times.  Arguments of function calls
+  // can be placeholders "?" which get values for each run, in the order they appear in the text.  The
+  // pipeline starts with data cells, followed by stages with one function call each, and possibly a
+  // data cell which stores the result.  The shapes are only computed again from the first stage with
+  // a placeholder on, or from the start if one of the data cells changed.  Pipelines with operations
+  // which cannot be run yet only provide the shapes.
+  class prepared {
+  public:
+    using value = std::variant<intmax_t,double,std::string>;
+
+    explicit prepared(const std::string& text);
+    prepared(const prepared&) = delete;
+    prepared& operator=(const prepared&) = delete;
+
+    bool ok() const { return errmsg.empty(); }
+    // Why the text cannot be prepared.
+    const std::string& error() const { return errmsg; }
+
+    size_t nparams() const { return slots.size(); }
+    // Why the pipeline cannot be run, empty if all operations can.
+    const std::string& unrunnable() const { return shape_only; }
+    // The data cell the result is stored in, empty if there is none.
+    const std::string& destination() const { return target; }
+    // The version of the destination stored by the last run.
+    uint64_t stored() const { return written; }
+
+    // The shapes of the results with VALUES for the placeholders.
+    std::variant<std::vector<data::schema_ptr>,std::string> shape(const std::vector<value>& values);
+
+    // Run the pipeline with VALUES for the placeholders.  With WORKERS a pipeline of distributable
+    // operations on one large data cell is run by the workers, each on a block of the records.  The
+    // result is the same.
+    std::variant<std::vector<data::schema>,std::string> operator()(const std::vector<value>& values, data::worker_pool* workers = nullptr);
+
+    // Start the pipeline with VALUES for the placeholders.  The consumer pulls the results one group
+    // at a time, see code::cursor.  A target data cell is not written.
+    std::variant<code::cursor,std::string> start(const std::vector<value>& values);
+
+  private:
+    std::variant<std::vector<data::schema>,std::string> plan(const std::vector<value>& values, bool use);
+    std::variant<code::cursor,std::string> launch(const std::vector<data::schema>& in);
+    std::optional<std::string> fragment() const;
+
+    struct stage {
+      std::string fname;
+      const code::function* fct;
+      fcall* call;
+    };
+
+    // A placeholder in argument ARG of CALL.  The nodes for the values are reused for every run.
+    struct slot {
+      fcall* call;
+      size_t arg;
+      integer* i;
+      floatnum* f;
+      string* s;
+    };
+
+    // A data cell the pipeline starts with, VERSION is zero for the newest one.
+    struct source {
+      std::string name;
+      uint64_t version;
+    };
+
+    context ctx {};
+    std::string errmsg {};
+    std::string shape_only {};
+
+    std::vector<source> sources {};
+    std::vector<stage> stages {};
+    std::string target {};
+    uint64_t written = 0;
+    std::vector<slot> slots {};
+
+    // PLANNED[I] are the input shapes of stage I, the last entry the shapes of the results.  The
+    // entries up to FIXED do not depend on the values.
+    std::vector<std::vector<data::schema_ptr>> planned {};
+    size_t fixed = 0;
+  };
+
+} // namespace scql
+
+#endif // prepare.hh
@@ -4,16 +4,21 @@
 #include <array>
 #include <cassert>
 #include <charconv>
+#include <cerrno>
 #include <csignal>
+#include <cstdlib>
 #include <cstring>
 #include <format>
 #include <locale>
 #include <map>
+#include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include <error.h>
+#include <grp.h>
 #include <langinfo.h>
 #include <termios.h>
 #include <unistd.h>
@@ -22,10 +27,10 @@
 #include <sys/signalfd.h>
 
 #include "scql.hh"
-#include "scql-tab.hh"
-#include "scql-scan.hh"
 #include "data.hh"
 #include "code.hh"
+#include "compress.hh"
+#include "server.hh"
 
 using namespace std::literals;
 
@@ -36,10 +41,6 @@ namespace repl {
 
     // Terminal escape sequences.
     const char dsr[] { '\e', '[', '6', 'n' };
-    const char el0[] { '\e', '[', '0', 'K' };
-    const char el0nl[] { '\e', '[', '0', 'K', '\n' };
-    const char ed0[] { '\e', '[', '0', 'J' };
-    const char su[] { '\e', '[', '1', 'S' };
 
     const char quit_cmd[] = "quit";
 
@@ -57,6 +58,223 @@ namespace repl {
     termios old_tios;
     termios edit_tios;
 
+
+    // What the line editor shows on the terminal.  Drawing only changes the cells of the next frame,
+    // flush sends the cells which differ from the screen in one write, together with all other output
+    // queued since the last one.  Cells which were never drawn are unknown and are left alone.
+    class screen {
+    public:
+      void reset(int w, int h)
+      {
+        width = std::max(w, 0);
+        height = std::max(h, 0);
+        cur.assign(size_t(width) * size_t(height), unknown_cell);
+        next = cur;
+        attr_idx = 0;
+        px = py = -1;
+        tx = ty = -1;
+      }
+
+      void go(int x, int y) { px = x; py = y; }
+
+      // The attributes of the following text, an SGR sequence.
+      void attr(const std::string& sgr);
+
+      // Text at the pen position, which advances.  Long lines wrap, a newline starts the next row.
+      void text(std::string_view s);
+
+      void clreol();
+      void clear_below();
+
+      // The terminal scrolls up by N rows.
+      void scroll(int n);
+
+      // Output which is not part of a frame.
+      void raw(std::string_view s)
+      {
+        out.append(s);
+        tx = ty = -1;
+      }
+
+      void flush();
+
+    private:
+      struct cell {
+        std::array<char,4> ch;
+        uint8_t len;
+        uint8_t attr;
+        bool operator==(const cell&) const = default;
+      };
+      static constexpr uint8_t unknown = UINT8_MAX;
+      static constexpr cell unknown_cell { { }, 0, unknown };
+      static constexpr cell blank { { ' ' }, 1, 0 };
+
+      size_t idx(int x, int y) const { return size_t(y) * size_t(width) + size_t(x); }
+
+      int width = 0;
+      int height = 0;
+      std::vector<cell> cur {};
+      std::vector<cell> next {};
+      // Index 0 are the default attributes.
+      std::vector<std::string> sgrs { ""s };
+      uint8_t attr_idx = 0;
+      // The pen and, if known, the cursor of the terminal.
+      int px = -1;
+      int py = -1;
+      int tx = -1;
+      int ty = -1;
+      std::string out {};
+    };
+
+
+    void screen::attr(const std::string& sgr)
+    {
+      if (sgr == "\e[0m"sv) {
+        attr_idx = 0;
+        return;
+      }
+      auto it = std::ranges::find(sgrs, sgr);
+      if (it == sgrs.end()) {
+        if (sgrs.size() == unknown)
+          return;
+        it = sgrs.insert(sgrs.end(), sgr);
+      }
+      attr_idx = uint8_t(it - sgrs.begin());
+    }
+
+
+    void screen::text(std::string_view s)
+    {
+      for (size_t i = 0; i < s.size(); ) {
+        if (s[i] == '\n') {
+          px = 0;
+          ++py;
+          ++i;
+          continue;
+        }
+        auto c = uint8_t(s[i]);
+        auto len = std::min(c < 0xc0 ? 1zu : c < 0xe0 ? 2zu : c < 0xf0 ? 3zu : 4zu, s.size() - i);
+        if (px >= width) {
+          px = 0;
+          ++py;
+        }
+        if (px >= 0 && py >= 0 && py < height) {
+          auto& e = next[idx(px, py)];
+          e = { { }, uint8_t(len), attr_idx };
+          std::copy_n(s.data() + i, len, e.ch.begin());
+        }
+        ++px;
+        i += len;
+      }
+    }
+
+
+    void screen::clreol()
+    {
+      if (py < 0 || py >= height)
+        return;
+      for (auto x = std::max(px, 0); x < width; ++x)
+        next[idx(x, py)] = blank;
+    }
+
+
+    void screen::clear_below()
+    {
+      if (py < 0)
+        return;
+      clreol();
+      if (py + 1 < height)
+        std::fill(next.begin() + idx(0, py + 1), next.end(), blank);
+    }
+
+
+    void screen::scroll(int n)
+    {
+      if (n <= 0)
+        return;
+      out += std::format("\e[{}S", n);
+      auto k = idx(0, std::min(n, height));
+      for (auto v : { &cur, &next }) {
+        std::move(v->begin() + k, v->end(), v->begin());
+        std::fill(v->end() - k, v->end(), blank);
+      }
+      tx = ty = -1;
+    }
+
+
+    void screen::flush()
+    {
+      int cx = -1;
+      int cy = -1;
+      int ca = -1;
+      bool changed = false;
+      for (int y = 0; y < height; ++y) {
+        // From TAIL on the row is blank in the next frame.
+        auto tail = width;
+        while (tail > 0 && next[idx(tail - 1, y)] == blank)
+          --tail;
+
+        for (int x = 0; x < width; ++x) {
+          auto& n = next[idx(x, y)];
+          auto& c = cur[idx(x, y)];
+          if (n.attr == unknown || n == c)
+            continue;
+          changed = true;
+
+          // A short run of unchanged cells is written again instead of moving the cursor.
+          if (cy == y && cx >= 0 && cx < x && x - cx <= 4
+              && std::all_of(cur.begin() + idx(cx, y), cur.begin() + idx(x, y), [ca](const cell& e) { return e.attr == ca; }))
+            for (; cx < x; ++cx)
+              out.append(cur[idx(cx, y)].ch.data(), cur[idx(cx, y)].len);
+          else if (cx != x || cy != y) {
+            out += std::format("\e[{};{}H", 1 + y, 1 + x);
+            cx = x;
+            cy = y;
+          }
+
+          if (x >= tail) {
+            if (ca != 0) {
+              out += "\e[0m"sv;
+              ca = 0;
+            }
+            out += "\e[K"sv;
+            std::fill(cur.begin() + idx(x, y), cur.begin() + idx(0, y + 1), blank);
+            break;
+          }
+
+          if (ca != n.attr) {
+            out += "\e[0m"sv;
+            out += sgrs[n.attr];
+            ca = n.attr;
+          }
+          out.append(n.ch.data(), n.len);
+          c = n;
+          ++cx;
+        }
+      }
+      if (ca > 0)
+        out += "\e[0m"sv;
+
+      if (px >= 0 && py >= 0 && py < height && (changed || px != tx || py != ty)) {
+        out += std::format("\e[{};{}H", 1 + py, 1 + px);
+        tx = px;
+        ty = py;
+      }
+
+      for (size_t done = 0; done < out.size(); ) {
+        auto r = ::write(STDOUT_FILENO, out.data() + done, out.size() - done);
+        if (r == -1 && errno == EINTR)
+          continue;
+        if (r <= 0)
+          break;
+        done += size_t(r);
+      }
+      out.clear();
+    }
+
+
+    screen scr;
+
   } // anonymous namespace
 
 
@@ -426,6 +644,8 @@ namespace repl {
   std::string res;
   size_t pos = 0;
 
+  scql::context parser;
+
 
   std::pair<int,int> string_coords(size_t p)
   {
@@ -450,14 +670,13 @@ namespace repl {
 
   void goto_xy(int x, int y)
   {
-    auto s = std::format("\e[{};{}H", 1 + y, 1 + x);
-    auto n [[maybe_unused]] = ::write(STDOUT_FILENO, s.c_str(), s.size());
+    scr.go(x, y);
   }
 
 
   void clreol()
   {
-    auto n [[maybe_unused]] = ::write(STDOUT_FILENO, el0, sizeof(el0));
+    scr.clreol();
   }
 
 
@@ -474,33 +693,6 @@ namespace repl {
   }
 
 
-  void redisplay(std::string& s)
-  {
-    size_t p = 0;
-    size_t r = input_start_row;
-    while (p < s.size()) {
-      auto end = s.find('\n', p);
-      auto here = (end == std::string::npos ? s.size() : end) - p;
-      auto n [[maybe_unused]] = ::write(STDOUT_FILENO, s.data() + p, here);
-      if (end == std::string::npos)
-        break;
-      n = ::write(STDOUT_FILENO, el0nl, sizeof(el0nl));
-      p += here + 1;
-      for (int j = 0; j < input_start_col; ++j)
-      ++r;
-    }
-
-    auto n [[maybe_unused]] = ::write(STDOUT_FILENO, ed0, sizeof(ed0));
-  }
-
-
-  void su_n(size_t n)
-  {
-    auto s = std::format("\e[{}S", n);
-    auto nn [[maybe_unused]] = ::write(STDOUT_FILENO, s.data(), s.size());
-  }
-
-
   const std::string color_ident = "\e[38;5;200m";
   const std::string color_datacell = "\e[38;5;100m";
   const std::string color_datacell_incomplete = "\e[38;5;142m";
@@ -519,78 +711,99 @@ namespace repl {
 
   void redraw_all(scql::linear& lin)
   {
+    move(0);
+    scr.clear_below();
+
+    // Runs of text with the same attributes.
     std::string tr;
+    auto color = [&tr](const std::string& c) {
+      scr.text(tr);
+      tr.clear();
+      scr.attr(c);
+    };
 
+    // The text and the items are both walked in order of the positions.
+    scql::linear::sweep items(lin);
+    int x = 0;
+    int y = 0;
     scql::linear::item* last = nullptr;
     for (size_t p = 0; p < res.size(); ++p) {
-      auto[x, y] = string_coords(p);
-      auto l = lin.at(x, y);
+      auto l = items.at(x, y);
 
-      if (! l.empty() && last != l.back()) {
+      if (l != nullptr && last != l) {
         std::string s;
-        switch (l.back()->p->id) {
+        switch (l->p->id) {
         case scql::id_type::ident:
-          if (l.back()->p->parent != nullptr && l.back()->p->parent->is(scql::id_type::fcall)) {
-            if (static_cast<scql::fcall*>(l.back()->p->parent)->known)
-              tr += color_fname;
+          if (l->p->parent != nullptr && l->p->parent->is(scql::id_type::fcall)) {
+            if (static_cast<scql::fcall*>(l->p->parent)->known)
+              color(color_fname);
             else
-              tr += color_fname_missing;
+              color(color_fname_missing);
           } else
-            tr += color_ident;
-          last = l.back();
+            color(color_ident);
+          last = l;
           break;
         case scql::id_type::datacell:
-          last = l.back();
+          last = l;
           {
             auto d = scql::as<scql::datacell>(last->p);
             if (! d->permission) {
-              tr += color_datacell_permission;
+              color(color_datacell_permission);
               d->errmsg = "no permission to write";
-            } else if (auto av = scql::data::available.match(d->val); av.empty()) {
+            } else if (d->version != 0 && d->shape.empty())
+              color(color_datacell_missing);
+            else if (auto av = scql::data::available.match(d->val); av.empty()) {
               if (d->shape.empty())
-                tr += color_datacell_missing;
+                color(color_datacell_missing);
               else
-                tr += color_datacell;
+                color(color_datacell);
             } else {
               if (std::ranges::find(av, d->val) != av.end())
-                tr += color_datacell;
+                color(color_datacell);
               else
-                tr += color_datacell_incomplete;
+                color(color_datacell_incomplete);
             }
           }
           break;
         case scql::id_type::codecell:
-          tr += color_codecell;
-          last = l.back();
+          color(color_codecell);
+          last = l;
           break;
         case scql::id_type::computecell:
-          tr += color_computecell;
-          last = l.back();
+          color(color_computecell);
+          last = l;
           break;
         case scql::id_type::integer:
-          tr += color_integer;
-          last = l.back();
+          color(color_integer);
+          last = l;
           break;
         case scql::id_type::floatnum:
-          tr += color_floatnum;
-          last = l.back();
+          color(color_floatnum);
+          last = l;
           break;
         default:
           if (last != nullptr) {
-            tr += color_off;
+            color(color_off);
             last = nullptr;
           }
           break;
         }
       }
 
-      tr += res[p];
+      if (res[p] == '\n') {
+        // Continuation lines start in the column of the first, as in coords.
+        scr.text(tr);
+        tr.clear();
+        x = 0;
+        ++y;
+        goto_xy(input_start_col, input_start_row + y);
+      } else {
+        tr += res[p];
+        ++x;
+      }
     }
-    if (last)
-      tr += color_off;
+    color(color_off);
 
-    move(0);
-    redisplay(tr);
     move();
   }
 
@@ -610,7 +823,7 @@ namespace repl {
       ++pos;
       if (y + 1 == cur_height) {
         input_start_row -= 1;
-        auto nn [[maybe_unused]] = ::write(STDOUT_FILENO, su, sizeof(su));
+        scr.scroll(1);
       }
       s += here + 1;
       n -= here + 1;
@@ -654,7 +867,7 @@ namespace repl {
         clreol();
       }
       goto_xy(0, 0);
-      auto nn [[maybe_unused]] = ::write(STDOUT_FILENO, s.data(), s.size());
+      scr.text(s);
       move();
     }
 
@@ -677,7 +890,9 @@ namespace repl {
     ::tcsetattr(STDIN_FILENO, TCSANOW, &edit_tios);
 
     // Request the current cursor position.
-    auto nn [[maybe_unused]] = ::write(STDOUT_FILENO, dsr, sizeof(dsr));
+    scr.reset(cur_width, cur_height);
+    scr.raw({ dsr, sizeof(dsr) });
+    scr.flush();
     bool received_position = false;
 
     input_reset();
@@ -711,7 +926,7 @@ namespace repl {
           case input_sm::parsed::eol:
             pos = res.size();
             move();
-            nn = ::write(STDOUT_FILENO, ed0, sizeof(ed0));
+            scr.clear_below();
             goto out;
           case input_sm::parsed::tab:
             if (! lin.empty()) {
@@ -956,18 +1171,18 @@ namespace repl {
               if (! received_position) {
                 if (nrs.has_value()) {
                   // Finally show the prompt:
-                  nn = ::write(STDOUT_FILENO, prompt.c_str(), prompt.size());
+                  scr.raw(prompt);
                   prompt_row = (*nrs)[0] - 1;
                   prompt_col = (*nrs)[1] - 1;
                   received_position = true;
                 }
-                nn = ::write(STDOUT_FILENO, dsr, sizeof(dsr));
+                scr.raw({ dsr, sizeof(dsr) });
               } else {
                 if (nrs.has_value()) {
                   input_start_row = (*nrs)[0] - 1;
                   input_start_col = (*nrs)[1] - 1;
                 } else
-                  nn = ::write(STDOUT_FILENO, dsr, sizeof(dsr));
+                  scr.raw({ dsr, sizeof(dsr) });
               }
             }
             break;
@@ -981,23 +1196,18 @@ namespace repl {
 
         if (need_redraw) {
           while (true) {
-            scql::result.reset();
+            parser.result = nullptr;
 
             if (! res.empty()) {
-              auto buffer = scql_scan_bytes(res.data(), res.size());
-              // XYZ no need to free buffer
-              (void) buffer;
-
               auto old_yyres = yyres;
-              yyres = yyparse();
+              yyres = parser.parse(res);
               if (yyres != 0 && old_yyres == 0 && pos > 0)
                 switch (res[pos - 1]) {
                 case '(':
                   {
                     auto res2 = res;
                     res2.insert(pos, 1, ')');
-                    buffer = scql_scan_bytes(res2.data(), res2.size());
-                    if (yyparse() == 0) {
+                    if (parser.parse(res2) == 0) {
                       yyres = 0;
                       res = res2;
                     }
@@ -1007,8 +1217,7 @@ namespace repl {
                   {
                     auto res2 = res;
                     res2.insert(pos, 1, ']');
-                    buffer = scql_scan_bytes(res2.data(), res2.size());
-                    if (yyparse() == 0) {
+                    if (parser.parse(res2) == 0) {
                       yyres = 0;
                       res = res2;
                     }
@@ -1018,8 +1227,7 @@ namespace repl {
                   {
                     auto res2 = res;
                     res2.insert(pos, 1, '}');
-                    buffer = scql_scan_bytes(res2.data(), res2.size());
-                    if (yyparse() == 0) {
+                    if (parser.parse(res2) == 0) {
                       yyres = 0;
                       res = res2;
                     }
@@ -1031,7 +1239,7 @@ namespace repl {
 
               if (yyres != 0) {
                 auto[x, y] = string_coords(pos);
-                if (scql::result && scql::result->fixup(res, pos, x, y))
+                if (parser.result && parser.result->fixup(res, pos, x, y))
                   continue;
               }
             }
@@ -1039,10 +1247,10 @@ namespace repl {
             break;
           }
 
-          if (scql::result) {
-            annotate(scql::result);
+          if (parser.result) {
+            annotate(parser.result, parser.shapes);
 
-            lin = scql::linear(scql::result);
+            lin = scql::linear(parser.result);
           } else
             lin = scql::linear();
 
@@ -1076,7 +1284,7 @@ namespace repl {
             }
 
             if (! ctx.empty()) {
-              auto last = ctx.back()->p.get();
+              auto last = ctx.back()->p;
               while (last) {
                 if (last->is(scql::id_type::datacell)) {
                   if (! last->errmsg.empty()) {
@@ -1118,7 +1326,7 @@ namespace repl {
                       if (y < e->lloc.first_line || (y == e->lloc.first_line && x <= e->lloc.first_column))
                         break;
                       else
-                        end = e.get();
+                        end = e;
 
                     if (end != nullptr) {
                       auto st = static_cast<const scql::statements*>(end);
@@ -1137,7 +1345,7 @@ namespace repl {
             }
 
             move(res.size());
-            nn = ::write(STDOUT_FILENO, ed0, sizeof(ed0));
+            scr.clear_below();
             if (help.empty())
               move();
             else {
@@ -1170,7 +1378,7 @@ namespace repl {
               auto needed_end_y = std::max(input_start_row + help_loc.last_line + 4, end_y + 2) + help_nrows;
               if (needed_end_y >= size_t(cur_height)) {
                 size_t adj = 1 + (needed_end_y - size_t(cur_height));
-                su_n(adj);
+                scr.scroll(int(adj));
                 input_start_row -= adj;
                 end_y -= adj;
               }
@@ -1181,57 +1389,50 @@ namespace repl {
               auto mid_col = (help_loc.first_column + help_loc.last_column) / 2;
               auto lx = help_loc.first_column;
               auto ly = help_loc.first_line + 1;
+              auto box = [&](size_t k) {
+                scr.attr(color_frame[(lx + ly) % 2]);
+                scr.text(boxchars[k]);
+              };
               goto_xy(input_start_col + lx, input_start_row + ly);
               if (lx < mid_col) {
-                nn = ::write(STDOUT_FILENO, color_frame[(lx + ly) % 2].data(), std::size(color_frame[(lx + ly) % 2]));
-                nn = ::write(STDOUT_FILENO, boxchars[0], strlen(boxchars[0]));
+                box(0);
                 ++lx;
                 while (lx < mid_col) {
-                  nn = ::write(STDOUT_FILENO, color_frame[(lx + ly) % 2].data(), std::size(color_frame[(lx + ly) % 2]));
-                  nn = ::write(STDOUT_FILENO, boxchars[1], strlen(boxchars[1]));
+                  box(1);
                   ++lx;
                 }
               }
-              nn = ::write(STDOUT_FILENO, color_frame[(lx + ly) % 2].data(), std::size(color_frame[(lx + ly) % 2]));
-              nn = ::write(STDOUT_FILENO, boxchars[2], strlen(boxchars[2]));
+              box(2);
               ++lx;
               if (lx < help_loc.last_column) {
                 while (lx + 1 < help_loc.last_column) {
-                  nn = ::write(STDOUT_FILENO, color_frame[(lx + ly) % 2].data(), std::size(color_frame[(lx + ly) % 2]));
-                  nn = ::write(STDOUT_FILENO, boxchars[1], strlen(boxchars[1]));
+                  box(1);
                   ++lx;
                 }
-                nn = ::write(STDOUT_FILENO, color_frame[(lx + ly) % 2].data(), std::size(color_frame[(lx + ly) % 2]));
-                nn = ::write(STDOUT_FILENO, boxchars[3], strlen(boxchars[3]));
+                box(3);
               }
               ++ly;
 
               goto_xy(input_start_col + mid_col, input_start_row + ly);
-              nn = ::write(STDOUT_FILENO, color_frame[(lx + ly) % 2].data(), std::size(color_frame[(lx + ly) % 2]));
-              nn = ::write(STDOUT_FILENO, boxchars[4], strlen(boxchars[4]));
+              box(4);
               ++ly;
 
               int start_box = std::max(0, input_start_col + mid_col - max_row_len / 2 - 2);
               goto_xy(start_box, input_start_row + ly);
               lx = start_box;
-              nn = ::write(STDOUT_FILENO, color_frame[(lx + ly) % 2].data(), std::size(color_frame[(lx + ly) % 2]));
-              nn = ::write(STDOUT_FILENO, boxchars[5], strlen(boxchars[5]));
+              box(5);
               lx += 1;
               while (lx < input_start_col + mid_col) {
-                nn = ::write(STDOUT_FILENO, color_frame[(lx + ly) % 2].data(), std::size(color_frame[(lx + ly) % 2]));
-                nn = ::write(STDOUT_FILENO, boxchars[6], strlen(boxchars[6]));
+                box(6);
                 ++lx;
               }
-              nn = ::write(STDOUT_FILENO, color_frame[(lx + ly) % 2].data(), std::size(color_frame[(lx + ly) % 2]));
-              nn = ::write(STDOUT_FILENO, boxchars[7], strlen(boxchars[7]));
+              box(7);
               ++lx;
               while (lx < start_box + max_row_len + 3) {
-                nn = ::write(STDOUT_FILENO, color_frame[(lx + ly) % 2].data(), std::size(color_frame[(lx + ly) % 2]));
-                nn = ::write(STDOUT_FILENO, boxchars[6], strlen(boxchars[6]));
+                box(6);
                 ++lx;
               }
-              nn = ::write(STDOUT_FILENO, color_frame[(lx + ly) % 2].data(), std::size(color_frame[(lx + ly) % 2]));
-              nn = ::write(STDOUT_FILENO, boxchars[8], strlen(boxchars[8]));
+              box(8);
               ++ly;
 
               last_off = 0;
@@ -1242,15 +1443,13 @@ namespace repl {
 
                 goto_xy(start_box, input_start_row + ly);
                 lx = start_box;
-                nn = ::write(STDOUT_FILENO, color_frame[(lx + ly) % 2].data(), std::size(color_frame[(lx + ly) % 2]));
-                nn = ::write(STDOUT_FILENO, boxchars[9], strlen(boxchars[9]));
-                nn = ::write(STDOUT_FILENO, color_help.data(), std::size(color_help));
-                nn = ::write(STDOUT_FILENO, " ", 1);
-                nn = ::write(STDOUT_FILENO, help.data() + last_off, off - last_off);
+                box(9);
+                scr.attr(color_help);
+                scr.text(" ");
+                scr.text(std::string_view(help).substr(last_off, off - last_off));
                 goto_xy(start_box + 3 + max_row_len, input_start_row + ly);
                 lx = start_box + 3 + max_row_len;
-                nn = ::write(STDOUT_FILENO, color_frame[(lx + ly) % 2].data(), std::size(color_frame[(lx + ly) % 2]));
-                nn = ::write(STDOUT_FILENO, boxchars[9], strlen(boxchars[9]));
+                box(9);
 
                 ++ly;
                 last_off = off + 1;
@@ -1258,22 +1457,21 @@ namespace repl {
 
               lx = start_box;
               goto_xy(start_box, input_start_row + ly);
-              nn = ::write(STDOUT_FILENO, color_frame[(lx + ly) % 2].data(), std::size(color_frame[(lx + ly) % 2]));
-              nn = ::write(STDOUT_FILENO, boxchars[10], strlen(boxchars[10]));
+              box(10);
               lx += 1;
               while (lx < start_box + max_row_len + 3) {
-                nn = ::write(STDOUT_FILENO, color_frame[(lx + ly) % 2].data(), std::size(color_frame[(lx + ly) % 2]));
-                nn = ::write(STDOUT_FILENO, boxchars[6], strlen(boxchars[6]));
+                box(6);
                 ++lx;
               }
-              nn = ::write(STDOUT_FILENO, color_frame[(lx + ly) % 2].data(), std::size(color_frame[(lx + ly) % 2]));
-              nn = ::write(STDOUT_FILENO, boxchars[11], strlen(boxchars[11]));
+              box(11);
             }
-            nn = ::write(STDOUT_FILENO, color_off.data(), std::size(color_off));
+            scr.attr(color_off);
 
             debug(s);
           }
         }
+
+        scr.flush();
       } else if (evs[0].data.fd == sfd) {
         signalfd_siginfo ssi;
         if (::read(sfd, &ssi, sizeof(ssi)) == sizeof(ssi)) {
@@ -1283,6 +1481,7 @@ namespace repl {
     }
 
   out:
+    scr.flush();
     ::tcsetattr(STDIN_FILENO, TCSANOW, &old_tios);
 
     return std::make_tuple(res, yyres);
@@ -1293,38 +1492,305 @@ namespace repl {
 
 
 
+#include <fstream>
 #include <iostream>
 
-int main()
+
+namespace batch {
+
+  namespace {
+
+    const char* const status_names[] {
+      "invalid",
+      "unhandled",
+      "stored",
+      "computed",
+    };
+
+    // Output is written in blocks of about this size unless the input would block first.
+    constexpr size_t flush_size = 65536;
+
+
+    // Fields are separated by tabs, records by newlines.  Both and the backslash are escaped.
+    void add_field(std::string& out, std::string_view s)
+    {
+      out += '\t';
+      for (auto c : s)
+        switch (c) {
+        case '\t':
+          out += "\\t";
+          break;
+        case '\n':
+          out += "\\n";
+          break;
+        case '\\':
+          out += "\\\\";
+          break;
+        default:
+          out += c;
+          break;
+        }
+    }
+
+
+    template<typename T>
+    void add_value(std::string& field, const std::byte* p)
+    {
+      T v;
+      std::memcpy(&v, p, sizeof(v));
+      // Bytes are numbers, not characters.
+      std::format_to(std::back_inserter(field), "{}", +v);
+    }
+
+
+    void add_value(std::string& field, scql::data::data_type t, const std::byte* p)
+    {
+      switch (t) {
+      case scql::data::data_type::u8:
+        add_value<uint8_t>(field, p);
+        break;
+      case scql::data::data_type::u32:
+        add_value<uint32_t>(field, p);
+        break;
+      case scql::data::data_type::f32:
+        add_value<float>(field, p);
+        break;
+      case scql::data::data_type::f64:
+        add_value<double>(field, p);
+        break;
+      case scql::data::data_type::str:
+        break;
+      }
+    }
+
+
+    // One line per element, in row-major order of the dimensions, with one field per column.  Like the
+    // record the line starts with a tab, it is never empty.  Strings end at the first NUL byte, the
+    // values of array columns are separated by spaces.  An empty line ends the values of a result,
+    // results without data have just that.
+    void add_values(std::string& out, const scql::data::schema& r)
+    {
+      if (r.data != nullptr && ! r.columns.empty()) {
+        auto s = scql::data::plain(r);
+        std::vector<scql::data::schema::column_view> views;
+        for (size_t c = 0; c < s.columns.size(); ++c)
+          views.emplace_back(s.view(c));
+        std::string field;
+        for (size_t i = 0; i < s.nelems(); ++i) {
+          for (size_t c = 0; c < s.columns.size(); ++c) {
+            const auto& col = s.columns[c];
+            auto p = views[c].addr(i);
+            field.clear();
+            if (col.type == scql::data::data_type::str) {
+              auto e = std::find(p, p + col.size(), std::byte(0));
+              field.assign(reinterpret_cast<const char*>(p), e - p);
+            } else
+              for (size_t j = 0; j < col.size(); j += scql::data::type_size(col.type)) {
+                if (j > 0)
+                  field += ' ';
+                add_value(field, col.type, p + j);
+              }
+            add_field(out, field);
+          }
+          out += '\n';
+        }
+      }
+      out += '\n';
+    }
+
+
+    // The status, the message, and the shapes of the results, followed by the values of each result.
+    void add_record(std::string& out, const scql::server::reply& r)
+    {
+      out += status_names[size_t(r.status)];
+      add_field(out, r.message);
+      for (const auto& s : r.results)
+        add_field(out, std::string(s));
+      out += '\n';
+      for (const auto& s : r.results)
+        add_values(out, s);
+    }
+
+  } // anonymous namespace
+
+
+  // Each non-empty line of IN is a query.  The answer on standard output is one line with the status,
+  // the message, and the shapes of the results, each result's values follow.  See add_record.
+  // Without a connection the queries are handled like the server does, with one session for all of
+  // them.  Returns false if a query was invalid.
+  bool run(std::istream& in, std::optional<scql::server::client>& conn, scql::server::session& sess, bool& stop)
+  {
+    bool res = true;
+    std::string out;
+    std::string line;
+    while (std::getline(in, line)) {
+      if (line.find_first_not_of(" \t\r") == std::string::npos)
+        continue;
+      if (line == "quit") {
+        stop = true;
+        break;
+      }
+
+      auto r = conn ? conn->query(line, true) : scql::server::evaluate(sess, line);
+      if (! r) {
+        ::error(0, 0, "lost connection to server");
+        stop = true;
+        res = false;
+        break;
+      }
+      add_record(out, *r);
+      res &= r->status != scql::server::status_type::invalid;
+
+      // Programs talking to us through pipes wait for the answer before sending the next query.
+      if (out.size() >= flush_size || in.rdbuf()->in_avail() <= 0) {
+        std::cout.write(out.data(), out.size()).flush();
+        out.clear();
+      }
+    }
+    std::cout.write(out.data(), out.size()).flush();
+    return res;
+  }
+
+} // namespace batch
+
+
+int main(int argc, char* argv[])
 {
   std::locale::global(std::locale(""));
   if (strcmp("UTF-8", ::nl_langinfo(CODESET)) != 0)
     ::error(EXIT_FAILURE, 0, "locale with UTF-8 encoding needed");
 
+  // With --server PATH the process is the daemon keeping the data cells loaded.  The terminal front
+  // end only sends the queries if SCQL_SERVER names the socket.  It then maps the snapshot just for
+  // completion, the log and the checkpoints belong to the server.
+  bool serve = argc == 3 && argv[1] == "--server"sv;
+  std::optional<scql::server::client> conn;
+  if (auto path = ::getenv("SCQL_SERVER"); ! serve && path != nullptr && ! conn.emplace(path).ok())
+    ::error(EXIT_FAILURE, errno, "cannot connect to server %s", path);
+
+  // All processes using the same shared-memory object see the same data cells.  The size is just the
+  // address space, memory is allocated as the cells are stored.  Other accounts can attach if the
+  // object is created with SCQL_SHM_MODE, in octal, and the group SCQL_SHM_GROUP.
+  if (auto shm = ::getenv("SCQL_SHM"); shm != nullptr) {
+    unsigned mode = 0600;
+    if (auto m = ::getenv("SCQL_SHM_MODE"); m != nullptr)
+      mode = std::strtoul(m, nullptr, 8) & 0777;
+    int group = -1;
+    if (auto g = ::getenv("SCQL_SHM_GROUP"); g != nullptr) {
+      if (auto gr = ::getgrnam(g); gr != nullptr)
+        group = gr->gr_gid;
+      else
+        ::error(0, 0, "unknown group %s", g);
+    }
+    if (! scql::data::available.attach_shared(shm, 1zu << 36, mode, group))
+      ::error(0, errno, "cannot attach shared catalog %s", shm);
+  }
+
+  // Older versions of data cells, $name@id in queries, are kept up to this number per cell.
+  if (auto keep = ::getenv("SCQL_KEEP_VERSIONS"); keep != nullptr)
+    scql::data::available.retain(std::strtoul(keep, nullptr, 10));
+
+  // SCQL_TIERS is a list of NS=TIER separated by semicolons where TIER is resident, cold, or
+  // mapped:DIR.  New versions of the cells in namespace NS, e.g., $sensors::raw:temp for sensors::raw,
+  // are kept in that tier.  An empty NS applies to all cells without a more specific policy.
+  if (auto tiers = ::getenv("SCQL_TIERS"); tiers != nullptr)
+    for (std::string_view rest = tiers; ! rest.empty(); ) {
+      auto entry = rest.substr(0, rest.find(';'));
+      rest.remove_prefix(std::min(entry.size() + 1, rest.size()));
+      auto eq = entry.find('=');
+      if (eq == std::string_view::npos) {
+        if (! entry.empty())
+          ::error(0, 0, "invalid tier policy %.*s", int(entry.size()), entry.data());
+        continue;
+      }
+      auto ns = entry.substr(0, eq);
+      auto t = entry.substr(eq + 1);
+      if (t == "resident")
+        scql::data::available.set_placement(std::string(ns), scql::data::tier::resident);
+      else if (t == "cold")
+        scql::data::available.set_placement(std::string(ns), scql::data::tier::cold);
+      else if (t == "mapped" || t.starts_with("mapped:"))
+        scql::data::available.set_placement(std::string(ns), scql::data::tier::mapped, t.size() > 7 ? std::string(t.substr(7)) : "."s);
+      else
+        ::error(0, 0, "invalid tier %.*s for namespace %.*s", int(t.size()), t.data(), int(ns.size()), ns.data());
+    }
+
+  // With SCQL_WORKERS pipelines of row-local operations on large data cells are run by that many
+  // processes, each on a part of the records.  They are forked before any thread is started.
+  std::unique_ptr<scql::data::worker_pool> workers;
+  if (auto n = ::getenv("SCQL_WORKERS"); n != nullptr && ! conn && std::strtoul(n, nullptr, 10) > 0)
+    workers = std::make_unique<scql::data::worker_pool>(std::strtoul(n, nullptr, 10));
+
+  // The catalog of data cells is kept in a snapshot file between sessions.  Changes since the last
+  // checkpoint are recovered from the log.
+  auto catalog = ::getenv("SCQL_CATALOG");
+  if (catalog != nullptr) {
+    scql::data::available.load(catalog);
+    if (conn)
+      catalog = nullptr;
+    else if (! scql::data::available.open_log(catalog + ".wal"s))
+      ::error(0, errno, "cannot open log for %s", catalog);
+  }
+
+  if (serve) {
+    if (! scql::server::run(argv[2], workers.get()))
+      ::error(EXIT_FAILURE, errno, "cannot serve on %s", argv[2]);
+    if (catalog != nullptr && ! scql::data::available.checkpoint(catalog))
+      ::error(0, errno, "cannot save catalog %s", catalog);
+    return 0;
+  }
+
+  // With --batch the queries are read from the named files, or standard input if there are none, one
+  // per line.  The same happens if standard input is not a terminal.
+  if ((argc >= 2 && argv[1] == "--batch"sv) || (argc == 1 && ! ::isatty(STDIN_FILENO))) {
+    std::ios::sync_with_stdio(false);
+    scql::server::session sess;
+    sess.workers = workers.get();
+    bool ok = true;
+    bool stop = false;
+    if (argc <= 2)
+      ok = batch::run(std::cin, conn, sess, stop);
+    for (int i = 2; i < argc && ! stop; ++i)
+      if (argv[i] == "-"sv)
+        ok &= batch::run(std::cin, conn, sess, stop);
+      else if (std::ifstream f(argv[i]); f)
+        ok &= batch::run(f, conn, sess, stop);
+      else {
+        ::error(0, errno, "cannot read %s", argv[i]);
+        ok = false;
+      }
+
+    if (catalog != nullptr && ! scql::data::available.checkpoint(catalog))
+      ::error(0, errno, "cannot save catalog %s", catalog);
+    return ok ? 0 : 1;
+  }
+
   repl::init();
 
+  scql::server::session local;
+  local.workers = workers.get();
   while (true) {
     for (int i = 0; i < repl::cur_width; ++i) std::cout << "\u2501";
     std::cout << "\n";
 
-    auto [input,yyres] = repl::read("prompt> ");
+    auto input = std::get<std::string>(repl::read("prompt> "));
     std::cout << "\n";
     if (input == "quit")
       break;
 
-    if (yyres == 0 && scql::valid(scql::result)) {
-      assert(scql::result->is(scql::id_type::pipeline));
-      auto p = scql::as<scql::pipeline>(scql::result);
-      assert(! p->l.empty());
-
-      if (p->l.size() > 1 && p->l.back()->is(scql::id_type::statements)
-          && as<scql::statements>(p->l.back())->l.back()->is(scql::id_type::datacell)) {
-        std::cout << "store result in " << as<scql::datacell>(as<scql::statements>(p->l.back())->l.back())->val << std::endl;
-      } else
-        std::cout << "implement handling \"" << input << "\"\n";
-    } else
-      std::cout << "invalid input \"" << input << "\"\n";
+    // Without a server the query is handled the same way locally.
+    auto r = conn ? conn->query(input) : scql::server::evaluate(local, input);
+    if (! r) {
+      std::cout << "lost connection to server\n";
+      break;
+    }
+    std::cout << r->message << std::endl;
+    for (const auto& s : r->results)
+      std::cout << std::string(s) << std::endl;
   }
 
   repl::fini();
+
+  if (catalog != nullptr && ! scql::data::available.checkpoint(catalog))
+    ::error(0, errno, "cannot save catalog %s", catalog);
 }
@@ -3,6 +3,8 @@
 
 #include <algorithm>
 #include <cassert>
+#include <charconv>
+#include <string_view>
 
 using namespace std::literals;
 
@@ -21,9 +23,29 @@ namespace scql {
   }
 
 
-  void part::prefix_map(std::function<void(part::cptr_type)> fct)
+  void arena::clear()
   {
-    fct(shared_from_this());
+    for (auto it = nodes.rbegin(); it != nodes.rend(); ++it)
+      (*it)->~part();
+    nodes.clear();
+    current = 0;
+    used = 0;
+  }
+
+
+  void* arena::allocate(size_t n, size_t align)
+  {
+    used = (used + align - 1) & ~(align - 1);
+    if (blocks.empty() || used + n > block_size) {
+      if (! blocks.empty())
+        ++current;
+      if (current == blocks.size())
+        blocks.emplace_back(std::make_unique_for_overwrite<std::byte[]>(block_size));
+      used = 0;
+    }
+    auto res = blocks[current].get() + used;
+    used += n;
+    return res;
   }
 
 
@@ -54,15 +76,6 @@ namespace scql {
   }
 
 
-  void list::prefix_map(std::function<void(part::cptr_type)> fct)
-  {
-    fct(shared_from_this());
-    for (auto& e : l)
-      if (e)
-        e->prefix_map(fct);
-  }
-
-
   std::string pipeline::format() const
   {
     auto s = std::format("{{pipeline{} ", lloc.format());
@@ -90,15 +103,6 @@ namespace scql {
   }
 
 
-  void pipeline::prefix_map(std::function<void(part::cptr_type)> fct)
-  {
-    fct(shared_from_this());
-    for (auto& e : l)
-      if (e)
-        e->prefix_map(fct);
-  }
-
-
   std::string integer::format() const
   {
     return std::format("{{integer{}}}", lloc.format());
@@ -135,6 +139,18 @@ namespace scql {
   }
 
 
+  std::string param::format() const
+  {
+    return std::format("{{param{}}}", lloc.format());
+  }
+
+
+  bool param::fixup(std::string&, size_t, int, int) const
+  {
+    return false;
+  }
+
+
   std::string string::format() const
   {
     return std::format("{{string{}}}", lloc.format());
@@ -163,6 +179,17 @@ namespace scql {
   }
 
 
+  datacell* datacell::alloc(arena& a, const char* s, size_t l, const location& lloc_)
+  {
+    std::string_view text(s, l);
+    auto at = text.find('@');
+    auto res = a.make<datacell>(std::string(text.substr(0, at)), lloc_);
+    if (at != std::string_view::npos)
+      std::from_chars(s + at + 1, s + l, res->version);
+    return res;
+  }
+
+
   std::string datacell::format() const
   {
     return std::format("{{datacell{}}}", lloc.format());
@@ -205,28 +232,145 @@ namespace scql {
   }
 
 
-  void fcall::prefix_map(std::function<void(part::cptr_type)> fct)
+  namespace {
+
+    // Statements without a known shape.
+    const data::schema_ptr unknown = std::make_shared<const data::schema>();
+
+
+    template<typename T>
+    void put(std::string& k, const T& v)
+    {
+      k.append(reinterpret_cast<const char*>(&v), sizeof(v));
+    }
+
+
+    void put(std::string& k, const std::string& v)
+    {
+      put(k, v.size());
+      k += v;
+    }
+
+
+    // Everything about S that output shapes can depend on.  The data is identified by its address.
+    std::string describe(const data::schema& s)
+    {
+      std::string k;
+      put(k, s.title);
+      put(k, s.dimens.size());
+      for (auto d : s.dimens)
+        put(k, d);
+      put(k, s.columns.size());
+      for (const auto& c : s.columns) {
+        put(k, c.type);
+        put(k, c.dimens.size());
+        for (auto d : c.dimens)
+          put(k, d);
+        put(k, c.label);
+        put(k, c.encoding);
+        put(k, c.enc.get());
+      }
+      put(k, s.data);
+      put(k, s.writable);
+      put(k, s.layout);
+      put(k, s.zones.get());
+      return k;
+    }
+
+
+    // The literal value of an argument, without its location.
+    void describe(std::string& k, const part* p)
+    {
+      if (p == nullptr) {
+        k += '-';
+        return;
+      }
+      put(k, p->id);
+      switch (p->id) {
+      case id_type::integer:
+        put(k, static_cast<const integer*>(p)->val);
+        break;
+      case id_type::floatnum:
+        put(k, static_cast<const floatnum*>(p)->val);
+        break;
+      case id_type::string:
+        put(k, static_cast<const string*>(p)->val);
+        break;
+      case id_type::ident:
+      case id_type::datacell:
+      case id_type::codecell:
+      case id_type::computecell:
+        put(k, static_cast<const ident*>(p)->val);
+        break;
+      default:
+        break;
+      }
+    }
+
+  } // anonymous namespace
+
+
+  data::schema_ptr shape_cache::intern(const data::schema& s)
   {
-    fct(shared_from_this());
-    if (fname != nullptr)
-      fct(fname);
-    for (const auto& e : args)
-      if (e != nullptr)
-        e->prefix_map(fct);
+    auto k = describe(s);
+    // Once the data is released its address can be used again, the entry is replaced then.
+    if (auto it = schemas.find(k); it != schemas.end() && (! it->second.owned || ! it->second.owner.expired()))
+      return it->second.s;
+    if (schemas.size() >= max_entries) {
+      schemas.clear();
+      results.clear();
+    }
+
+    // Only the shape is kept, old versions of the data are not.
+    auto c = s;
+    c.owner.reset();
+    interned e { std::make_shared<const data::schema>(std::move(c)), s.owner, bool(s.owner) };
+    return schemas.insert_or_assign(std::move(k), std::move(e)).first->second.s;
   }
 
 
-  part::cptr_type result;
+  const shape_cache::result_type& shape_cache::output_shape(const std::string& fname, const std::vector<data::schema_ptr>& in, std::vector<part::cptr_type>& args)
+  {
+    std::string k;
+    put(k, fname);
+    for (auto a : args)
+      describe(k, a);
+    k += '\0';
+    for (const auto& s : in)
+      put(k, s.get());
+    if (auto it = results.find(k); it != results.end())
+      return it->second.out;
+
+    std::vector<const data::schema*> ptrs;
+    for (const auto& s : in)
+      ptrs.push_back(s.get());
+    auto oshape = code::available.get(fname).output_shape(ptrs, args);
+
+    result r { in, std::string() };
+    if (std::holds_alternative<std::vector<data::schema>>(oshape)) {
+      std::vector<data::schema_ptr> out;
+      for (const auto& s : std::get<std::vector<data::schema>>(oshape))
+        out.push_back(intern(s));
+      r.out = std::move(out);
+    } else
+      r.out = std::move(std::get<std::string>(oshape));
+
+    if (results.size() >= max_entries)
+      results.clear();
+    return results.insert_or_assign(std::move(k), std::move(r)).first->second.out;
+  }
 
 
-  void annotate(part::cptr_type& p, std::vector<data::schema*>* last, bool first)
+  void annotate(part::cptr_type p, shape_cache& cache, const std::vector<data::schema_ptr>* last, bool first)
   {
     if (p->id != id_type::pipeline)
       return;
 
     auto pl = as<pipeline>(p);
+    // Pipelines in reused statements were annotated before.
+    p->shape.clear();
 
-    std::vector<data::schema*> cur;
+    std::vector<data::schema_ptr> cur;
     if (last != nullptr)
       cur = *last;
 
@@ -236,58 +380,67 @@ namespace scql {
         continue;
       }
 
-      std::vector<data::schema*> next;
+      std::vector<data::schema_ptr> next;
 
       e->errmsg.clear();
+      e->shape.clear();
       assert(e->is(id_type::statements));
       auto stmts = as<statements>(e);
       bool first_statement = first;
       for (auto& ee : stmts->l) {
         if (ee == nullptr)
           next.push_back(nullptr);
+        else if (ee->is(id_type::fcall) && as<fcall>(ee)->input == cur)
+          next.insert(next.end(), ee->shape.begin(), ee->shape.end());
         else {
           ee->errmsg.clear();
           if (ee->is(id_type::pipeline)) {
-            annotate(ee, last, first_statement);
+            annotate(ee, cache, last, first_statement);
 
-            // next.append_range(ee->shape);
-            for (auto& pp : ee->shape)
-              next.push_back(&pp);
+            next.insert(next.end(), ee->shape.begin(), ee->shape.end());
           } else if (ee->is(id_type::datacell)) {
             auto d = scql::as<scql::datacell>(ee);
-            if (auto av = scql::data::available.match(d->val); av.size() == 1 && av[0] == d->val) {
-              d->shape = { scql::data::available.get(d->val) };
-              d->permission = first || d->shape[0].writable;
-              for (auto& eee : d->shape)
-                next.push_back(&eee);
-            } else if (! first && cur.size() == 1) {
+            d->shape.clear();
+            d->permission = true;
+            if (d->version != 0) {
+              // Older versions can be read but nothing can be stored in them.
+              if (! first)
+                d->permission = false;
+              else if (auto s = scql::data::available.get(d->val, d->version))
+                d->shape = { cache.intern(*s) };
+              else
+                d->errmsg = std::format("no version {} of data cell {}", d->version, d->val);
+              next.push_back(d->shape.empty() ? nullptr : d->shape[0]);
+            } else if (auto av = scql::data::available.match(d->val); av.size() == 1 && av[0] == d->val) {
+              d->shape = { cache.intern(scql::data::available.get(d->val)) };
+              d->permission = first || d->shape[0]->writable;
+              next.push_back(d->shape[0]);
+            } else if (! first && cur.size() == 1 && cur[0]) {
               // This is an assignment.
-              d->shape =  { *cur[0] };
-              for (auto& eee : d->shape)
-                next.push_back(&eee);
+              d->shape = { cur[0] };
+              next.push_back(cur[0]);
             } else
               next.push_back(nullptr);
           } else if (ee->is(id_type::fcall)) {
             auto f = scql::as<scql::fcall>(ee);
+            f->shape.clear();
             if (f->fname && f->fname->is(id_type::ident)) {
               auto fname = as<scql::ident>(f->fname)->val;
               if (auto av = scql::code::available.match(fname); av.size() == 1 && av[0] == fname) {
-                auto& fct = scql::code::available.get(fname);
-
                 f->known = true;
 
-                auto oshape = fct.output_shape(cur, f->args);
+                auto& oshape = cache.output_shape(fname, cur, f->args);
                 if (std::holds_alternative<std::string>(oshape)) {
                   if (auto& s = std::get<std::string>(oshape); ! s.empty()) {
                     f->errmsg = s;
                   }
                 } else {
-                  f->shape = std::get<std::vector<data::schema>>(oshape);
-                  for (auto& eee : f->shape)
-                    next.push_back(&eee);
+                  f->shape = std::get<std::vector<data::schema_ptr>>(oshape);
+                  next.insert(next.end(), f->shape.begin(), f->shape.end());
                 }
               }
             }
+            f->input = cur;
           }
         }
         first_statement = false;
@@ -295,11 +448,8 @@ namespace scql {
       first = false;
       cur = std::move(next);
 
-      for (auto ps : cur)
-        if (ps)
-          stmts->shape.emplace_back(*ps);
-        else
-          stmts->shape.emplace_back();
+      for (const auto& ps : cur)
+        stmts->shape.push_back(ps ? ps : unknown);
     }
 
     if (! pl->l.empty() && ! pl->l.back()->shape.empty())
@@ -307,35 +457,33 @@ namespace scql {
   }
 
 
-  bool valid(part::cptr_type& p)
+  bool valid(part::cptr_type p)
   {
-    switch (p->id) {
-    case id_type::datacell:
-      return ! p->shape.empty() && p->errmsg.empty();
-    case id_type::fcall:
-      return as<fcall>(p)->fname->is(id_type::ident) && as<fcall>(p)->known && ! p->shape.empty();
-    case id_type::pipeline:
-      if (as<pipeline>(p)->l.empty())
+    bool res = true;
+    walk(p, [&res](part& e) {
+      switch (e.id) {
+      case id_type::datacell:
+        res = res && ! e.shape.empty() && e.errmsg.empty();
         return false;
-      for (auto& e : as<pipeline>(p)->l)
-        if (e == nullptr || ! valid(e))
-          return false;
-      return true;
-    case id_type::statements:
-      if (as<statements>(p)->l.empty())
+      case id_type::fcall:
+        res = res && as<fcall>(&e)->fname != nullptr && as<fcall>(&e)->fname->is(id_type::ident) && as<fcall>(&e)->known && ! e.shape.empty();
         return false;
-      for (auto& e : as<statements>(p)->l)
-        if (e == nullptr || ! valid(e))
-          return false;
-      return true;
-    case id_type::integer:
-    case id_type::floatnum:
-    case id_type::string:
-      return true;
-    default:
-      break;
-    }
-    return false;
+      case id_type::pipeline:
+        res = res && ! as<pipeline>(&e)->l.empty() && std::ranges::find(as<pipeline>(&e)->l, nullptr) == as<pipeline>(&e)->l.end();
+        return res;
+      case id_type::statements:
+        res = res && ! as<statements>(&e)->l.empty() && std::ranges::find(as<statements>(&e)->l, nullptr) == as<statements>(&e)->l.end();
+        return res;
+      case id_type::integer:
+      case id_type::floatnum:
+      case id_type::string:
+        return false;
+      default:
+        res = false;
+        return false;
+      }
+    });
+    return res;
   }
 
 
@@ -3,10 +3,14 @@
 
 #include <cstdint>
 #include <format>
-#include <functional>
 #include <memory>
+#include <new>
+#include <optional>
+#include <queue>
 #include <string>
+#include <unordered_map>
 #include <utility>
+#include <variant>
 #include <vector>
 
 #include "data.hh"
@@ -22,6 +26,7 @@ namespace scql {
     integer,
     floatnum,
     glob,
+    param,
     string,
     list,
     statements,
@@ -41,6 +46,8 @@ namespace scql {
     int last_column;
 
     std::string format() const;
+
+    bool operator==(const location&) const = default;
   };
 #define YYLTYPE scql::location
 
@@ -51,12 +58,9 @@ namespace scql {
   }
 
 
-#pragma GCC diagnostic push
-// This warning must be disable due to the std::enable_shared_from_this class.
-#pragma GCC diagnostic ignored "-Wnon-virtual-dtor"
-  struct part : std::enable_shared_from_this<part> {
-    // This type should actually be std::unique_ptr but this runs into problems with the parser generated code.
-    using cptr_type = std::shared_ptr<part>;
+  struct part {
+    // The nodes are owned by an arena, the tree only refers to them.
+    using cptr_type = part*;
 
     part(id_type id_, const location& lloc_) : id(id_), lloc(lloc_) { }
     part(const part&) = delete;
@@ -67,8 +71,6 @@ namespace scql {
 
     virtual bool fixup(std::string& s, size_t p, int x, int y) const = 0;
 
-    virtual void prefix_map(std::function<void(part::cptr_type)> fct);
-
     bool is(id_type i) const { return id == i; }
     bool expandable() const;
 
@@ -76,18 +78,52 @@ namespace scql {
     location lloc;
     std::string errmsg { };
 
-    std::vector<data::schema> shape { };
+    std::vector<data::schema_ptr> shape { };
 
     part* parent = nullptr;
   };
-#pragma GCC diagnostic pop
+
+
+  // Storage for the nodes of syntax trees.  Nodes are placed one after the other in large blocks and
+  // are all destroyed at once.
+  class arena {
+  public:
+    arena() = default;
+    arena(const arena&) = delete;
+    arena& operator=(const arena&) = delete;
+    ~arena() { clear(); }
+
+    template<typename T, typename... Args>
+    T* make(Args&&... args)
+    {
+      static_assert(sizeof(T) <= block_size);
+      auto res = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+      nodes.push_back(res);
+      return res;
+    }
+
+    // Destroy all nodes.  The blocks are kept for the next tree.
+    void clear();
+
+    size_t size() const { return nodes.size(); }
+
+  private:
+    static constexpr size_t block_size = 16384;
+
+    void* allocate(size_t n, size_t align);
+
+    std::vector<std::unique_ptr<std::byte[]>> blocks { };
+    size_t current = 0;
+    size_t used = 0;
+    std::vector<part*> nodes { };
+  };
 
 
   struct syntax : part
   {
     syntax(const location& lloc_) : part(id_type::syntax, lloc_) { }
 
-    static auto alloc(const location& lloc_) { return std::make_unique<syntax>(lloc_); }
+    static auto alloc(arena& a, const location& lloc_) { return a.make<syntax>(lloc_); }
 
     std::string format() const override { std::unreachable(); }
     bool fixup(std::string&, size_t, int, int) const override { std::unreachable(); }
@@ -95,71 +131,67 @@ namespace scql {
 
 
   struct list : part {
-    using cptr_type = std::shared_ptr<list>;
+    using cptr_type = list*;
 
     list(const location& lloc_) : part(id_type::list, lloc_), l { } { }
-    list(part::cptr_type&& p, const location& lloc_) : part(id_type::list, lloc_), l() { if (p) p->parent = this; l.emplace_back(std::move(p)); }
-    list(part::cptr_type&& p1, part::cptr_type&& p2, const location& lloc_) : part(id_type::list, lloc_), l() { if (p1) p1->parent = this; l.emplace_back(std::move(p1)); if (p2) p2->parent = this; l.emplace_back(std::move(p2)); }
+    list(part::cptr_type p, const location& lloc_) : part(id_type::list, lloc_), l() { if (p) p->parent = this; l.emplace_back(p); }
+    list(part::cptr_type p1, part::cptr_type p2, const location& lloc_) : part(id_type::list, lloc_), l() { if (p1) p1->parent = this; l.emplace_back(p1); if (p2) p2->parent = this; l.emplace_back(p2); }
     ~list() override = default;
 
-    void prepend(part::cptr_type&& p) { l.emplace(l.begin(), std::move(p)); }
-    void add(part::cptr_type&& p) { if (p) p->parent = this; l.emplace_back(std::move(p)); }
+    void prepend(part::cptr_type p) { if (p) p->parent = this; l.emplace(l.begin(), p); }
+    void add(part::cptr_type p) { if (p) p->parent = this; l.emplace_back(p); }
 
-    static auto alloc(const location& lloc_) { return std::make_unique<list>(lloc_); }
-    static auto alloc(part::cptr_type&& p, const location& lloc_) { return std::make_unique<list>(std::move(p), lloc_); }
-    static auto alloc(part::cptr_type&& p1, part::cptr_type&& p2, const location& lloc_) { return std::make_unique<list>(std::move(p1), std::move(p2), lloc_); }
+    static auto alloc(arena& a, const location& lloc_) { return a.make<list>(lloc_); }
+    static auto alloc(arena& a, part::cptr_type p, const location& lloc_) { return a.make<list>(p, lloc_); }
+    static auto alloc(arena& a, part::cptr_type p1, part::cptr_type p2, const location& lloc_) { return a.make<list>(p1, p2, lloc_); }
 
     std::string format() const override;
 
     bool fixup(std::string& s, size_t p, int x, int y) const override;
 
-    void prefix_map(std::function<void(part::cptr_type)> fct) override;
-
     std::vector<part::cptr_type> l;
 
   protected:
-    list(id_type id_, part::cptr_type&& p, const location& lloc_) : part(id_, lloc_), l() { if (p) p->parent = this; l.emplace_back(std::move(p)); }
+    list(id_type id_, part::cptr_type p, const location& lloc_) : part(id_, lloc_), l() { if (p) p->parent = this; l.emplace_back(p); }
 
     std::string name = "list";
   };
 
 
   struct statements : list {
-    statements(part::cptr_type&& p, const location& lloc_) : list(id_type::statements, std::move(p), lloc_) { name = "statements"; }
+    statements(part::cptr_type p, const location& lloc_) : list(id_type::statements, p, lloc_) { name = "statements"; }
 
-    static auto alloc(part::cptr_type&& p, const location& lloc_) { return std::make_unique<statements>(std::move(p), lloc_); }
+    static auto alloc(arena& a, part::cptr_type p, const location& lloc_) { return a.make<statements>(p, lloc_); }
   };
 
 
   struct pipeline : part {
-    using cptr_type = std::shared_ptr<pipeline>;
+    using cptr_type = pipeline*;
 
-    pipeline(part::cptr_type&& p, const location& lloc_) : part(id_type::pipeline, lloc_), l() { if (p) p->parent = this; l.emplace_back(std::move(p)); }
-    pipeline(part::cptr_type&& p1, part::cptr_type&& p2, const location& lloc_) : part(id_type::pipeline, lloc_), l() { if (p1) p1->parent = this; l.emplace_back(std::move(p1)); if (p2) p2->parent = this; l.emplace_back(std::move(p2)); }
+    pipeline(part::cptr_type p, const location& lloc_) : part(id_type::pipeline, lloc_), l() { if (p) p->parent = this; l.emplace_back(p); }
+    pipeline(part::cptr_type p1, part::cptr_type p2, const location& lloc_) : part(id_type::pipeline, lloc_), l() { if (p1) p1->parent = this; l.emplace_back(p1); if (p2) p2->parent = this; l.emplace_back(p2); }
     ~pipeline() override = default;
 
-    void prepend(part::cptr_type&& p) { if (p) p->parent = this; l.emplace(l.begin(), std::move(p)); }
+    void prepend(part::cptr_type p) { if (p) p->parent = this; l.emplace(l.begin(), p); }
 
-    static auto alloc(part::cptr_type&& p, const location& lloc_) { return std::make_unique<pipeline>(std::move(p), lloc_); }
-    static auto alloc(part::cptr_type&& p1, part::cptr_type&& p2, const location& lloc_) { return std::make_unique<pipeline>(std::move(p1), std::move(p2), lloc_); }
+    static auto alloc(arena& a, part::cptr_type p, const location& lloc_) { return a.make<pipeline>(p, lloc_); }
+    static auto alloc(arena& a, part::cptr_type p1, part::cptr_type p2, const location& lloc_) { return a.make<pipeline>(p1, p2, lloc_); }
 
     std::string format() const override;
 
     bool fixup(std::string& s, size_t p, int x, int y) const override;
 
-    void prefix_map(std::function<void(part::cptr_type)> fct) override;
-
     std::vector<part::cptr_type> l;
   };
 
 
   struct integer : part {
-    using cptr_type = std::shared_ptr<integer>;
+    using cptr_type = integer*;
 
     integer(intmax_t v, const location& lloc_) : part(id_type::integer, lloc_), val(v) { }
     ~integer() override = default;
 
-    static auto alloc(intmax_t v, const location& lloc_) { return std::make_unique<integer>(v, lloc_); }
+    static auto alloc(arena& a, intmax_t v, const location& lloc_) { return a.make<integer>(v, lloc_); }
 
     std::string format() const override;
 
@@ -170,14 +202,14 @@ namespace scql {
 
 
   struct floatnum : part {
-    using cptr_type = std::shared_ptr<floatnum>;
+    using cptr_type = floatnum*;
 
     using float_type = double;
 
     floatnum(float_type v, const location& lloc_) : part(id_type::floatnum, lloc_), val(v) { }
     ~floatnum() override = default;
 
-    static auto alloc(float_type v, const location& lloc_) { return std::make_unique<floatnum>(v, lloc_); }
+    static auto alloc(arena& a, float_type v, const location& lloc_) { return a.make<floatnum>(v, lloc_); }
 
     std::string format() const override;
 
@@ -188,12 +220,27 @@ namespace scql {
 
 
   struct glob : part {
-    using cptr_type = std::shared_ptr<glob>;
+    using cptr_type = glob*;
 
     glob(const location& lloc_) : part(id_type::glob, lloc_) { }
     ~glob() override = default;
 
-    static auto alloc(const location& lloc_) { return std::make_unique<glob>(lloc_); }
+    static auto alloc(arena& a, const location& lloc_) { return a.make<glob>(lloc_); }
+
+    std::string format() const override;
+
+    bool fixup(std::string& s, size_t p, int x, int y) const override;
+  };
+
+
+  // Placeholder for an argument of a prepared pipeline, see prepare.hh.
+  struct param : part {
+    using cptr_type = param*;
+
+    param(const location& lloc_) : part(id_type::param, lloc_) { }
+    ~param() override = default;
+
+    static auto alloc(arena& a, const location& lloc_) { return a.make<param>(lloc_); }
 
     std::string format() const override;
 
@@ -202,15 +249,15 @@ namespace scql {
 
 
   struct string : part {
-    using cptr_type = std::shared_ptr<string>;
+    using cptr_type = string*;
 
     string(const std::string& v, const location& lloc_) : part(id_type::string, lloc_), val(v) { }
     string(std::string&& v, const location& lloc_) : part(id_type::string, lloc_), val(std::move(v)) { }
     ~string() override = default;
 
-    static auto alloc(const std::string& v, const location& lloc_) { return std::make_unique<string>(v, lloc_); }
-    static auto alloc(std::string&& v, const location& lloc_) { return std::make_unique<string>(std::move(v), lloc_); }
-    static auto alloc(const char*s, size_t l, const location& lloc_) { return std::make_unique<string>(std::string(s, l), lloc_); }
+    static auto alloc(arena& a, const std::string& v, const location& lloc_) { return a.make<string>(v, lloc_); }
+    static auto alloc(arena& a, std::string&& v, const location& lloc_) { return a.make<string>(std::move(v), lloc_); }
+    static auto alloc(arena& a, const char*s, size_t l, const location& lloc_) { return a.make<string>(std::string(s, l), lloc_); }
 
     std::string format() const override;
 
@@ -223,15 +270,15 @@ namespace scql {
 
 
   struct ident : part {
-    using cptr_type = std::shared_ptr<ident>;
+    using cptr_type = ident*;
 
     ident(const std::string& v, const location& lloc_) : part(id_type::ident, lloc_), val(v) { }
     ident(std::string&& v, const location& lloc_) : part(id_type::ident, lloc_), val(std::move(v)) { }
     ~ident() override = default;
 
-    static auto alloc(const std::string& v, const location& lloc_) { return std::make_unique<ident>(v, lloc_); }
-    static auto alloc(std::string&& v, const location& lloc_) { return std::make_unique<ident>(std::move(v), lloc_); }
-    static auto alloc(const char*s, size_t l, const location& lloc_) { return std::make_unique<ident>(std::string(s, l), lloc_); }
+    static auto alloc(arena& a, const std::string& v, const location& lloc_) { return a.make<ident>(v, lloc_); }
+    static auto alloc(arena& a, std::string&& v, const location& lloc_) { return a.make<ident>(std::move(v), lloc_); }
+    static auto alloc(arena& a, const char*s, size_t l, const location& lloc_) { return a.make<ident>(std::string(s, l), lloc_); }
 
     std::string format() const override;
 
@@ -251,14 +298,15 @@ namespace scql {
     datacell operator=(const datacell&) = delete;
     ~datacell() override = default;
 
-    static auto alloc(const std::string& v, const location& lloc_) { return std::make_unique<datacell>(v, lloc_); }
-    static auto alloc(std::string&& v, const location& lloc_) { return std::make_unique<datacell>(std::move(v), lloc_); }
-    static auto alloc(const char*s, size_t l, const location& lloc_) { return std::make_unique<datacell>(std::string(s, l), lloc_); }
+    static auto alloc(arena& a, const std::string& v, const location& lloc_) { return a.make<datacell>(v, lloc_); }
+    static auto alloc(arena& a, std::string&& v, const location& lloc_) { return a.make<datacell>(std::move(v), lloc_); }
+    // The text of the token is the name, optionally followed by @ and a version id.
+    static datacell* alloc(arena& a, const char*s, size_t l, const location& lloc_);
 
     std::string format() const override;
 
-    data::schema* schema = nullptr;
     bool permission = true;
+    uint64_t version = 0;    // Zero for the newest version.
   };
 
 
@@ -267,9 +315,9 @@ namespace scql {
     codecell(std::string&& v, const location& lloc_) : ident(id_type::codecell, std::move(v), lloc_) { }
     ~codecell() override = default;
 
-    static auto alloc(const std::string& v, const location& lloc_) { return std::make_unique<codecell>(v, lloc_); }
-    static auto alloc(std::string&& v, const location& lloc_) { return std::make_unique<codecell>(std::move(v), lloc_); }
-    static auto alloc(const char*s, size_t l, const location& lloc_) { return std::make_unique<codecell>(std::string(s, l), lloc_); }
+    static auto alloc(arena& a, const std::string& v, const location& lloc_) { return a.make<codecell>(v, lloc_); }
+    static auto alloc(arena& a, std::string&& v, const location& lloc_) { return a.make<codecell>(std::move(v), lloc_); }
+    static auto alloc(arena& a, const char*s, size_t l, const location& lloc_) { return a.make<codecell>(std::string(s, l), lloc_); }
 
     std::string format() const override;
 
@@ -282,28 +330,30 @@ namespace scql {
     computecell(std::string&& v, const location& lloc_) : ident(id_type::computecell, std::move(v), lloc_) { }
     ~computecell() override = default;
 
-    static auto alloc(const std::string& v, const location& lloc_) { return std::make_unique<computecell>(v, lloc_); }
-    static auto alloc(std::string&& v, const location& lloc_) { return std::make_unique<computecell>(std::move(v), lloc_); }
-    static auto alloc(const char*s, size_t l, const location& lloc_) { return std::make_unique<computecell>(std::string(s, l), lloc_); }
+    static auto alloc(arena& a, const std::string& v, const location& lloc_) { return a.make<computecell>(v, lloc_); }
+    static auto alloc(arena& a, std::string&& v, const location& lloc_) { return a.make<computecell>(std::move(v), lloc_); }
+    static auto alloc(arena& a, const char*s, size_t l, const location& lloc_) { return a.make<computecell>(std::string(s, l), lloc_); }
 
     std::string format() const override;
   };
 
 
   struct fcall : part {
-    using cptr_type = std::shared_ptr<fcall>;
+    using cptr_type = fcall*;
 
-    fcall(part::cptr_type&& fname_, const location& lloc_) : part(id_type::fcall, lloc_), fname(std::move(fname_)) { if (fname) fname->parent = this; }
-    fcall(part::cptr_type&& fname_, part::cptr_type&& arg_, const location& lloc_) : part(id_type::fcall, lloc_), fname(std::move(fname_)), args {std::move(arg_)} { if (fname) fname->parent = this; for (auto& e : args) if (e) e->parent = this; }
-    fcall(part::cptr_type&& fname_, part::cptr_type&& arg1_, part::cptr_type&& arg2_, const location& lloc_) : part(id_type::fcall, lloc_), fname(std::move(fname_)), args {std::move(arg1_), std::move(arg2_)} { if (fname) fname->parent = this; for (auto& e : args) if (e) e->parent = this; }
+    fcall(part::cptr_type fname_, const location& lloc_) : part(id_type::fcall, lloc_), fname(fname_) { if (fname) fname->parent = this; }
+    fcall(part::cptr_type fname_, part::cptr_type arg_, const location& lloc_) : part(id_type::fcall, lloc_), fname(fname_), args {arg_} { if (fname) fname->parent = this; for (auto& e : args) if (e) e->parent = this; }
+    fcall(part::cptr_type fname_, part::cptr_type arg1_, part::cptr_type arg2_, const location& lloc_) : part(id_type::fcall, lloc_), fname(fname_), args {arg1_, arg2_} { if (fname) fname->parent = this; for (auto& e : args) if (e) e->parent = this; }
+    fcall(const fcall&) = delete;
+    fcall operator=(const fcall&) = delete;
     ~fcall() override = default;
 
-    static auto alloc(part::cptr_type&& fname_, const location& lloc_) { return std::make_unique<fcall>(std::move(fname_), lloc_); }
-    static auto alloc(part::cptr_type&& fname_, part::cptr_type&& arg_, const location& lloc_) { return std::make_unique<fcall>(std::move(fname_), std::move(arg_), lloc_); }
-    static auto alloc(part::cptr_type&& fname_, part::cptr_type&& arg1_, part::cptr_type&& arg2_, const location& lloc_) { return std::make_unique<fcall>(std::move(fname_), std::move(arg1_), std::move(arg2_), lloc_); }
+    static auto alloc(arena& a, part::cptr_type fname_, const location& lloc_) { return a.make<fcall>(fname_, lloc_); }
+    static auto alloc(arena& a, part::cptr_type fname_, part::cptr_type arg_, const location& lloc_) { return a.make<fcall>(fname_, arg_, lloc_); }
+    static auto alloc(arena& a, part::cptr_type fname_, part::cptr_type arg1_, part::cptr_type arg2_, const location& lloc_) { return a.make<fcall>(fname_, arg1_, arg2_, lloc_); }
 
-    void set_fname(part::cptr_type&& fname_) { fname_->parent = this; fname = std::move(fname_); }
-    void prepend(part::cptr_type&& p) { if (p) p->parent = this; args.emplace(args.begin(), std::move(p)); }
+    void set_fname(part::cptr_type fname_) { if (fname_) fname_->parent = this; fname = fname_; }
+    void prepend(part::cptr_type p) { if (p) p->parent = this; args.emplace(args.begin(), p); }
 
     part::cptr_type fname;
     std::vector<part::cptr_type> args {};
@@ -312,24 +362,87 @@ namespace scql {
 
     bool fixup(std::string& s, size_t p, int x, int y) const override;
 
-    void prefix_map(std::function<void(part::cptr_type)> fct) override;
-
     bool known = false;
 
     bool missing_close = false;
+
+    // The input shapes of the last annotate.  Calls reused by the next parse keep their shape if the
+    // input did not change.
+    std::optional<std::vector<data::schema_ptr>> input {};
   };
 
 
   template<typename T>
-  inline auto as(part::cptr_type& p)
+  inline auto as(part::cptr_type p)
   {
-    return std::static_pointer_cast<T>(p);
+    return static_cast<T*>(p);
   }
 
 
-  void annotate(part::cptr_type& p, std::vector<data::schema*>* last = nullptr, bool first = true);
+  // Call FCT for P and the nodes below it, parents before children.  FCT returns whether the children
+  // of the node are visited as well.  Missing nodes are skipped.
+  template<typename F>
+  void walk(part::cptr_type p, F&& fct)
+  {
+    if (p == nullptr || ! fct(*p))
+      return;
+    switch (p->id) {
+    case id_type::list:
+    case id_type::statements:
+      for (auto e : as<list>(p)->l)
+        walk(e, fct);
+      break;
+    case id_type::pipeline:
+      for (auto e : as<pipeline>(p)->l)
+        walk(e, fct);
+      break;
+    case id_type::fcall:
+      walk(as<fcall>(p)->fname, fct);
+      for (auto e : as<fcall>(p)->args)
+        walk(e, fct);
+      break;
+    default:
+      break;
+    }
+  }
+
 
-  bool valid(part::cptr_type& p);
+  // Shapes which are kept from one parse to the next.  Equal schemas are stored once and shared by
+  // all nodes with that shape.  The output shapes of functions are remembered for the input schemas
+  // and the literal arguments.  The stored schemas do not keep the data alive, their data pointer is
+  // only valid while that version of the data exists.
+  class shape_cache {
+  public:
+    using result_type = std::variant<std::vector<data::schema_ptr>,std::string>;
+
+    data::schema_ptr intern(const data::schema& s);
+
+    // FNAME must be a known function.  The inputs must be interned.
+    const result_type& output_shape(const std::string& fname, const std::vector<data::schema_ptr>& in, std::vector<part::cptr_type>& args);
+
+  private:
+    // The tables are cleared when they get larger, the nodes keep their schemas.
+    static constexpr size_t max_entries = 4096;
+
+    struct result {
+      std::vector<data::schema_ptr> in;    // Keeps the addresses in the key valid.
+      result_type out;
+    };
+
+    struct interned {
+      data::schema_ptr s;
+      std::weak_ptr<const void> owner;    // Of the data, if it has one.
+      bool owned;
+    };
+
+    std::unordered_map<std::string,interned> schemas { };
+    std::unordered_map<std::string,result> results { };
+  };
+
+
+  void annotate(part::cptr_type p, shape_cache& cache, const std::vector<data::schema_ptr>* last = nullptr, bool first = true);
+
+  bool valid(part::cptr_type p);
 
 
   using yyscan_t = void*;
@@ -342,21 +455,115 @@ namespace scql {
     };
 
     linear() { }
-    linear(part::cptr_type& root);
+    linear(part::cptr_type root);
 
     auto empty() const { return items.empty(); }
     const auto& back() const { return items.back(); }
     auto& back() { return items.back(); }
 
+    // The items covering column X of line Y, outer ones first.
     std::vector<item*> at(int x, int y);
 
+    // The innermost item covering each of a series of positions, which must not decrease.  For a
+    // single pass over the text.
+    class sweep {
+    public:
+      explicit sweep(linear& lin_) : lin(lin_) { }
+
+      item* at(int x, int y);
+
+    private:
+      linear& lin;
+      size_t next = 0;
+      std::priority_queue<uint32_t> active { };
+    };
+
     std::vector<item> items { };
+
+  private:
+    static int64_t key(int x, int y) { return (int64_t(y) << 32) + x; }
+    static int64_t start(const item& i) { return key(i.lloc.first_column, i.lloc.first_line); }
+    static int64_t end(const item& i) { return key(i.lloc.last_column, i.lloc.last_line); }
+
+    void collect(size_t node, size_t lo, size_t hi, size_t n, int64_t pos, std::vector<uint32_t>& res) const;
+
+    // The items ordered by their start.  Over this order a tree with the largest end in each subtree.
+    std::vector<uint32_t> order { };
+    std::vector<int64_t> starts { };
+    std::vector<int64_t> max_end { };
   };
 
 
+  // Tokens of the text in the line editor.  After an edit only the tokens around the changed range are
+  // scanned again, the others are reused with adjusted locations.  See tokens.cc.
+  struct token {
+    int type;
+    part::cptr_type val;
+    location lloc;
+    size_t from;
+    size_t to;
+  };
+
+  struct token_cache {
+    // Returns whether tokens of the previous text are kept.
+    bool update(const std::string& s, yyscan_t scanner);
+
+    std::string text { };
+    std::vector<token> tokens { };
+    // The tokens scanned by the last update, all others are from the previous text.
+    size_t fresh_from = 0;
+    size_t fresh_to = 0;
+    // The nodes of the tokens, also of those no longer used.  They are dropped when the text is scanned
+    // again completely.
+    arena nodes { };
+  };
 
 
-  extern part::cptr_type result;
+  // Everything one parse needs: the scanner, the tokens of the last text, the syntax tree with the
+  // arena of its inner nodes, and the shapes for annotate.  Statements whose tokens did not change
+  // are not parsed again, the parser gets their subtree from the last parse as a single token.
+  // Different contexts can be used concurrently.
+  class context {
+  public:
+    context();
+    context(const context&) = delete;
+    context& operator=(const context&) = delete;
+    ~context();
+
+    // Parse S, the tokens are updated first.  The result is that of yyparse.
+    int parse(const std::string& s);
+
+    // The scanner used by the parser.  While parse runs it hands out the cached tokens.
+    int next_token(part::cptr_type* lval, location* lloc);
+    // Called by the parser for each statement and each syntax error.
+    void reduced_stage(const location& lloc, part::cptr_type p);
+    void syntax_error();
+
+    part::cptr_type result = nullptr;
+    token_cache tokens { };
+    arena nodes { };
+    shape_cache shapes { };
+
+  private:
+    struct cached_stage {
+      part::cptr_type node;
+      part::cptr_type last;     // The value of the last token.
+      size_t ntokens;
+      location lloc;            // Of the first token.
+    };
+
+    int run(const std::vector<std::pair<size_t,size_t>>& segments, const std::vector<part::cptr_type>& reused, size_t upto);
+
+    yyscan_t scanner = nullptr;
+    size_t next = 0;
+    // The statements of the last parse by the value of their first token.
+    std::unordered_map<part::cptr_type,cached_stage> stages { };
+    // What the parser gets, and for each the index of its first token.
+    std::vector<token> input { };
+    std::vector<size_t> origin { };
+    std::unordered_map<int64_t,std::pair<location,part::cptr_type>> reduced { };
+    size_t first_error = 0;
+  };
 
 } // namespace scql
 
@@ -11,17 +11,21 @@
 %define parse.lac full
 %define api.value.type {scql::part::cptr_type}
 %define api.token.prefix {scql}
+%parse-param {scql::context& ctx}
+%lex-param {scql::context& ctx}
 
 
 %code provides {
-#define YY_DECL int scqllex(YYSTYPE* yylval_param, YYLTYPE* yylloc_param)
+#define YY_DECL int scqllex(YYSTYPE* yylval_param, YYLTYPE* yylloc_param, void* yyscanner)
 YY_DECL;
-extern void yyerror(const YYLTYPE* l, const char* s);
+extern void yyerror(const YYLTYPE* l, scql::context& ctx, const char* s);
 }
 
 %code {
-#define yylex scqllex
-#include "scql-scan.hh"
+static int yylex(YYSTYPE* lval, YYLTYPE* lloc, scql::context& ctx)
+{
+  return ctx.next_token(lval, lloc);
+}
 
 // XYZ Debugging
 //#include <iostream>
@@ -31,7 +35,9 @@ extern void yyerror(const YYLTYPE* l, const char* s);
 %token ATOM
 %token CODECELL
 %token IDENT
+%token PARAM
 %token END
+%token STAGE
 
 
 %start start
@@ -39,7 +45,7 @@ extern void yyerror(const YYLTYPE* l, const char* s);
 %%
 
 start:            pipeline END {
-                    scql::result = std::move($1);
+                    ctx.result = $1;
                     YYACCEPT;
                   }
                 ;
@@ -52,18 +58,18 @@ pipeline:         pipeline_list {
                       lloc.last_line = std::min(lloc.last_line, $1->lloc.last_line);
                       lloc.last_column = std::min(lloc.last_column, $1->lloc.last_column);
                     }
-                    $$ = scql::pipeline::alloc(std::move($1), lloc);
+                    $$ = scql::pipeline::alloc(ctx.nodes, $1, lloc);
                   }
                 | pipeline_list '|' pipeline {
                     if ($1) {
                       $3->lloc.first_line = $1->lloc.first_line;
                       $3->lloc.first_column = $1->lloc.first_column;
                     }
-                    scql::as<scql::pipeline>($3)->prepend(std::move($1));
-                    $$ = std::move($3);
+                    scql::as<scql::pipeline>($3)->prepend($1);
+                    $$ = $3;
                   }
                 | pipeline_list '|' error {
-                    $$ = scql::pipeline::alloc(std::move($1), nullptr, $1 ? $1->lloc : yylloc);
+                    $$ = scql::pipeline::alloc(ctx.nodes, $1, nullptr, $1 ? $1->lloc : yylloc);
                   }
                 ;
 
@@ -75,30 +81,39 @@ pipeline_list:    stage {
                       lloc.last_line = std::min(lloc.last_line, $1->lloc.last_line);
                       lloc.last_column = std::min(lloc.last_column, $1->lloc.last_column);
                     }
-                    $$ = scql::statements::alloc(std::move($1), lloc);
+                    $$ = scql::statements::alloc(ctx.nodes, $1, lloc);
                   }
                 | stage ';' pipeline_list {
                     if ($1) {
                       $3->lloc.first_line = $1->lloc.first_line;
                       $3->lloc.first_column = $1->lloc.first_column;
                     }
-                    scql::as<scql::statements>($3)->prepend(std::move($1));
-                    $$ = std::move($3);
+                    scql::as<scql::statements>($3)->prepend($1);
+                    $$ = $3;
                   }
                 ;
 
-stage:            %empty {
+stage:            stage_body {
+                    ctx.reduced_stage(@1, $1);
+                    $$ = $1;
+                  }
+                ;
+
+stage_body:       %empty {
                     $$ = nullptr;
                   }
+                | STAGE {
+                    $$ = $1;
+                  }
                 | ATOM {
-                    $$ = std::move($1);
+                    $$ = $1;
                   }
                 | IDENT {
-                    $$ = std::move($1);
+                    $$ = $1;
                   }
                 | CODECELL {
                     scql::as<scql::codecell>($1)->missing_brackets = true;
-                    $$ = std::move($1);
+                    $$ = $1;
                   }
                 | fname '[' ']' {
                     auto lloc = yylloc;
@@ -106,15 +121,15 @@ stage:            %empty {
                       lloc.first_line = $1->lloc.first_line;
                       lloc.first_column = $1->lloc.first_column;
                     }
-                    $$ = scql::fcall::alloc(std::move($1), lloc);
+                    $$ = scql::fcall::alloc(ctx.nodes, $1, lloc);
                   }
                 | fname '[' arglist ']' {
                     if ($1) {
                       $3->lloc.first_line = $1->lloc.first_line;
                       $3->lloc.first_column = $1->lloc.first_column;
                     }
-                    scql::as<scql::fcall>($3)->set_fname(std::move($1));
-                    $$ = std::move($3);
+                    scql::as<scql::fcall>($3)->set_fname($1);
+                    $$ = $3;
                   }
                 | fname '[' error {
                     auto lloc = yylloc;
@@ -122,24 +137,24 @@ stage:            %empty {
                       lloc.first_line = $1->lloc.first_line;
                       lloc.first_column = $1->lloc.first_column;
                     }
-                    auto n = scql::fcall::alloc(std::move($1), lloc);
+                    auto n = scql::fcall::alloc(ctx.nodes, $1, lloc);
                     n->missing_close = true;
-                    $$ = std::move(n);
+                    $$ = n;
                   }
                 | '(' pipeline ')' {
                     $2->lloc.first_line = $1->lloc.first_line;
                     $2->lloc.first_column = $1->lloc.first_column;
                     $2->lloc.last_line = $3->lloc.last_line;
                     $2->lloc.last_column = $3->lloc.last_column;
-                    $$ = std::move($2);
+                    $$ = $2;
                   }
                 ;
 
 fname:            CODECELL {
-                    $$ = std::move($1);
+                    $$ = $1;
                   }
                 | IDENT {
-                    $$ = std::move($1);
+                    $$ = $1;
                   }
                 | ATOM {
                     $$ = nullptr;
@@ -147,39 +162,42 @@ fname:            CODECELL {
                 ;
 
 arglist:          arg {
-                    $$ = scql::fcall::alloc(nullptr, std::move($1), yylloc);
+                    $$ = scql::fcall::alloc(ctx.nodes, nullptr, $1, yylloc);
                   }
                 | arg ',' arglist {
                     $3->lloc.first_line = $1->lloc.first_line;
                     $3->lloc.first_column = $1->lloc.first_column;
-                    scql::as<scql::fcall>($3)->prepend(std::move($1));
-                    $$ = std::move($3);
+                    scql::as<scql::fcall>($3)->prepend($1);
+                    $$ = $3;
                   }
                 | error ',' arglist {
                     $3->lloc.first_line = $2->lloc.first_line;
                     $3->lloc.first_column = $2->lloc.first_column;
                     scql::as<scql::fcall>($3)->prepend(nullptr);
-                    $$ = std::move($3);
+                    $$ = $3;
                   }
                 | arg ',' error {
                     auto lloc = $1->lloc;
                     lloc.last_line = $2->lloc.last_line;
                     lloc.last_column = $2->lloc.last_column;
-                    $$ = scql::fcall::alloc(nullptr, std::move($1), nullptr, lloc);
+                    $$ = scql::fcall::alloc(ctx.nodes, nullptr, $1, nullptr, lloc);
                   }
                 | error ',' error {
-                    $$ = scql::fcall::alloc(nullptr, nullptr, nullptr, $2->lloc);
+                    $$ = scql::fcall::alloc(ctx.nodes, nullptr, nullptr, nullptr, $2->lloc);
                   }
                 ;
 
 arg:              ATOM {
-                   $$ = std::move($1);
+                   $$ = $1;
                   }
                 | IDENT {
-                    $$ = std::move($1);
+                    $$ = $1;
                   }
                 | '*' {
-                    $$ = scql::glob::alloc(yyloc);
+                    $$ = scql::glob::alloc(ctx.nodes, yyloc);
+                  }
+                | PARAM {
+                    $$ = $1;
                   }
                 ;
 
@@ -188,7 +206,8 @@ arg:              ATOM {
 
 #include <iostream>
 
-void yyerror(const YYLTYPE*, const char*)
+void yyerror(const YYLTYPE*, scql::context& ctx, const char*)
 {
+  ctx.syntax_error();
   // std::cout << "yyerror s=\"" << s << "\"\n";
 }
@@ -0,0 +1,561 @@
+#include "server.hh"
+#include "scql.hh"
+#include "prepare.hh"
+#include "compress.hh"
+#include "wal.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <format>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+
+using namespace std::literals;
+
+
+namespace scql::server {
+
+  namespace {
+
+    // Larger requests are not queries, the connection is dropped.
+    constexpr size_t max_request = 1 << 24;
+
+    // How often the access counts of the data cells are aged, see tier.cc.
+    constexpr time_t age_interval = 60;
+
+
+    template<typename T>
+    void put(std::string& out, T v)
+    {
+      out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+    }
+
+
+    template<typename T>
+    T get(const char* p)
+    {
+      T r;
+      std::memcpy(&r, p, sizeof(T));
+      return r;
+    }
+
+
+    bool read_all(int fd, void* p, size_t n)
+    {
+      for (auto b = static_cast<char*>(p); n > 0; ) {
+        auto r = ::read(fd, b, n);
+        if (r <= 0) {
+          if (r == -1 && errno == EINTR)
+            continue;
+          return false;
+        }
+        b += r;
+        n -= r;
+      }
+      return true;
+    }
+
+
+    bool write_all(int fd, const void* p, size_t n)
+    {
+      for (auto b = static_cast<const char*>(p); n > 0; ) {
+        auto r = ::write(fd, b, n);
+        if (r <= 0) {
+          if (r == -1 && errno == EINTR)
+            continue;
+          return false;
+        }
+        b += r;
+        n -= r;
+      }
+      return true;
+    }
+
+
+    sockaddr_un address(const std::string& path)
+    {
+      sockaddr_un sun { };
+      sun.sun_family = AF_UNIX;
+      std::memcpy(sun.sun_path, path.c_str(), std::min(path.size() + 1, sizeof(sun.sun_path) - 1));
+      return sun;
+    }
+
+
+    // A socket left behind by a server which is gone refuses connections.
+    bool stale(const sockaddr_un& sun)
+    {
+      auto fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (fd == -1)
+        return false;
+      auto res = ::connect(fd, reinterpret_cast<const sockaddr*>(&sun), sizeof(sun)) != 0 && errno == ECONNREFUSED;
+      ::close(fd);
+      return res;
+    }
+
+
+    void add_result(std::string& out, const data::schema& s, bool with_data)
+    {
+      // The description does not depend on the encoding, only the data needs to be decompressed.
+      auto ps = with_data ? data::plain(s) : s;
+      auto desc = data::encode_schema("", ps);
+      put<uint64_t>(out, desc.size());
+      out += desc;
+      auto n = ! with_data || ps.data == nullptr ? 0 : ps.nelems() * ps.row_size();
+      put<uint64_t>(out, n);
+      out.append(static_cast<const char*>(ps.data), n);
+    }
+
+
+    std::string handle(session& sess, const std::string& text, uint32_t flags)
+    {
+      auto [status,message,results] = evaluate(sess, text);
+
+      std::string out;
+      put(out, status);
+      put(out, uint32_t(message.size()));
+      out += message;
+      put(out, uint32_t(results.size()));
+      for (const auto& s : results)
+        add_result(out, s, flags & with_data);
+      return out;
+    }
+
+
+    // Each connection has its own session.  Its requests are evaluated one at a time, the next one is
+    // handed out when the reply to the previous one is queued.  SERIAL tells replies for a closed
+    // connection apart from those for a new one with the same descriptor.
+    struct connection {
+      uint64_t serial = 0;
+      std::shared_ptr<session> sess = std::make_shared<session>();
+      std::string in {};
+      std::string out {};
+      size_t written = 0;
+      std::deque<std::pair<std::string,uint32_t>> pending {};
+      bool busy = false;
+      bool eof = false;
+      bool watched = true;
+    };
+
+
+    // A request of connection FD, OUT is the encoded reply.
+    struct job {
+      int fd;
+      uint64_t serial;
+      std::shared_ptr<session> sess;
+      std::string text;
+      uint32_t flags;
+      std::string out {};
+    };
+
+
+    // Threads evaluating the requests.  Finished jobs are announced on the eventfd notifier(), the
+    // loop collects them.  Jobs still running are completed before the threads stop.
+    class evaluators {
+    public:
+      explicit evaluators(unsigned n) : done(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+      {
+        for (unsigned i = 0; i < n; ++i)
+          ts.emplace_back([this] { work(); });
+      }
+      evaluators(const evaluators&) = delete;
+      evaluators& operator=(const evaluators&) = delete;
+      ~evaluators()
+      {
+        {
+          std::lock_guard guard(lock);
+          stop = true;
+        }
+        cv.notify_all();
+        ts.clear();
+        ::close(done);
+      }
+
+      int notifier() const { return done; }
+
+      void submit(job&& j)
+      {
+        {
+          std::lock_guard guard(lock);
+          queue.push_back(std::move(j));
+        }
+        cv.notify_one();
+      }
+
+      std::vector<job> collect()
+      {
+        std::lock_guard guard(lock);
+        return std::exchange(finished, { });
+      }
+
+    private:
+      void work()
+      {
+        std::unique_lock guard(lock);
+        while (true) {
+          cv.wait(guard, [this] { return stop || ! queue.empty(); });
+          if (stop)
+            return;
+          auto j = std::move(queue.front());
+          queue.pop_front();
+          guard.unlock();
+          j.out = handle(*j.sess, j.text, j.flags);
+          guard.lock();
+          finished.push_back(std::move(j));
+          uint64_t one = 1;
+          [[maybe_unused]] auto r = ::write(done, &one, sizeof(one));
+        }
+      }
+
+      int done;
+      std::mutex lock {};
+      std::condition_variable cv {};
+      std::deque<job> queue {};
+      std::vector<job> finished {};
+      bool stop = false;
+      std::vector<std::jthread> ts {};
+    };
+
+  } // anonymous namespace
+
+
+  // Queries which can be prepared, pipelines of data cells and function calls, are run.  Their plans
+  // are kept, running the same text again needs no parsing.  The result of an assignment is stored
+  // through the catalog and its log.  Other queries are checked like the interactive front end does,
+  // for valid ones just the shapes of the last statements are known, without data.
+  reply evaluate(session& sess, const std::string& text)
+  {
+    auto it = sess.prepared.find(text);
+    std::string why;
+    if (it == sess.prepared.end()) {
+      auto stmt = std::make_unique<scql::prepared>(text);
+      if (stmt->ok() && stmt->unrunnable().empty()) {
+        if (sess.prepared.size() >= session::max_prepared)
+          sess.prepared.clear();
+        it = sess.prepared.emplace(text, std::move(stmt)).first;
+      } else
+        why = stmt->ok() ? stmt->unrunnable() : stmt->error();
+    }
+
+    reply res { status_type::invalid, "invalid input \""s + text + "\"", { } };
+    if (it != sess.prepared.end()) {
+      auto& stmt = *it->second;
+      auto r = stmt({}, sess.workers);
+      if (std::holds_alternative<std::string>(r))
+        res.message = std::get<std::string>(r);
+      else {
+        res.results = std::move(std::get<std::vector<data::schema>>(r));
+        if (! stmt.destination().empty()) {
+          res.status = status_type::stored;
+          res.message = std::format("stored result in {}@{}", stmt.destination(), stmt.stored());
+        } else {
+          res.status = status_type::computed;
+          res.message = std::format("{} result{}", res.results.size(), res.results.size() == 1 ? "" : "s");
+        }
+      }
+      return res;
+    }
+
+    auto& parser = sess.parser;
+    auto yyres = parser.parse(text);
+    if (yyres == 0 && parser.result)
+      annotate(parser.result, parser.shapes);
+    if (yyres != 0 || ! scql::valid(parser.result))
+      return res;
+
+    res.status = status_type::unhandled;
+    res.message = std::move(why);
+    auto p = scql::as<scql::pipeline>(parser.result);
+    if (p->l.back()->is(scql::id_type::statements))
+      for (const auto& e : as<scql::statements>(p->l.back())->l)
+        if (e)
+          for (const auto& s : e->shape) {
+            auto& r = res.results.emplace_back(*s);
+            r.data = nullptr;
+          }
+
+    return res;
+  }
+
+
+  bool run(const std::string& path, data::worker_pool* workers)
+  {
+    if (path.size() >= sizeof(sockaddr_un::sun_path))
+      return false;
+
+    auto lfd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (lfd == -1)
+      return false;
+    auto sun = address(path);
+    // Only the socket of a previous server which is gone is replaced, never a file or a running server.
+    if (struct stat st; ::lstat(path.c_str(), &st) == 0) {
+      if (! S_ISSOCK(st.st_mode) || ! stale(sun)) {
+        ::close(lfd);
+        errno = EADDRINUSE;
+        return false;
+      }
+      ::unlink(path.c_str());
+    }
+    // The socket is created with mode 0600, other users cannot connect.
+    auto old_mask = ::umask(0177);
+    auto bound = ::bind(lfd, reinterpret_cast<sockaddr*>(&sun), sizeof(sun)) == 0;
+    ::umask(old_mask);
+    if (! bound || ::listen(lfd, SOMAXCONN) != 0) {
+      ::close(lfd);
+      return false;
+    }
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGPIPE);
+    ::sigprocmask(SIG_BLOCK, &mask, nullptr);
+    auto sfd = ::signalfd(-1, &mask, SFD_CLOEXEC);
+
+    auto efd = ::epoll_create1(EPOLL_CLOEXEC);
+    epoll_event ev { };
+    ev.events = EPOLLIN;
+    ev.data.fd = lfd;
+    ::epoll_ctl(efd, EPOLL_CTL_ADD, lfd, &ev);
+    ev.data.fd = sfd;
+    ::epoll_ctl(efd, EPOLL_CTL_ADD, sfd, &ev);
+
+    // Cold cells which are no longer used often only keep their compressed data.
+    auto tfd = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    itimerspec period { { age_interval, 0 }, { age_interval, 0 } };
+    ::timerfd_settime(tfd, 0, &period, nullptr);
+    ev.data.fd = tfd;
+    ::epoll_ctl(efd, EPOLL_CTL_ADD, tfd, &ev);
+
+    evaluators pool(std::max(1u, std::thread::hardware_concurrency()));
+    auto dfd = pool.notifier();
+    ev.data.fd = dfd;
+    ::epoll_ctl(efd, EPOLL_CTL_ADD, dfd, &ev);
+
+    std::map<int,connection> conns;
+    uint64_t serial = 0;
+    auto drop = [efd,&conns](int fd) {
+      ::epoll_ctl(efd, EPOLL_CTL_DEL, fd, nullptr);
+      ::close(fd);
+      conns.erase(fd);
+    };
+    // Write as much as possible, the rest once the socket is writable.  False if the connection is gone.
+    auto flush = [&drop](int fd, connection& c) {
+      while (c.written < c.out.size()) {
+        auto r = ::write(fd, c.out.data() + c.written, c.out.size() - c.written);
+        if (r == -1 && errno == EINTR)
+          continue;
+        if (r == -1 && errno == EAGAIN)
+          break;
+        if (r <= 0) {
+          drop(fd);
+          return false;
+        }
+        c.written += r;
+      }
+      if (c.written == c.out.size()) {
+        c.out.clear();
+        c.written = 0;
+      }
+      return true;
+    };
+    auto dispatch = [&pool](int fd, connection& c) {
+      if (c.busy || c.pending.empty())
+        return;
+      auto& [text, flags] = c.pending.front();
+      pool.submit(job { fd, c.serial, c.sess, std::move(text), flags });
+      c.pending.pop_front();
+      c.busy = true;
+    };
+    // After the client closed its side nothing is read anymore.  The connection goes away once all
+    // requests are answered.
+    auto settle = [efd,&conns,&drop](int fd) {
+      auto it = conns.find(fd);
+      if (it == conns.end())
+        return;
+      auto& c = it->second;
+      if (c.eof && ! c.busy && c.pending.empty() && c.out.empty()) {
+        drop(fd);
+        return;
+      }
+      epoll_event cev { };
+      cev.events = (c.eof ? 0u : EPOLLIN) | (c.out.empty() ? 0u : EPOLLOUT);
+      cev.data.fd = fd;
+      if (cev.events != 0)
+        ::epoll_ctl(efd, c.watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &cev);
+      else if (c.watched)
+        ::epoll_ctl(efd, EPOLL_CTL_DEL, fd, nullptr);
+      c.watched = cev.events != 0;
+    };
+
+    bool done = false;
+    while (! done) {
+      epoll_event evs[16];
+      auto n = ::epoll_wait(efd, evs, std::size(evs), -1);
+      if (n == -1) {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+
+      for (int i = 0; i < n; ++i) {
+        auto fd = evs[i].data.fd;
+        if (fd == sfd) {
+          signalfd_siginfo ssi;
+          if (::read(sfd, &ssi, sizeof(ssi)) == sizeof(ssi) && ssi.ssi_signo != SIGPIPE)
+            done = true;
+        } else if (fd == tfd) {
+          uint64_t count;
+          if (::read(tfd, &count, sizeof(count)) == sizeof(count))
+            data::available.age();
+        } else if (fd == lfd) {
+          int cfd;
+          while ((cfd = ::accept4(lfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+            epoll_event cev { };
+            cev.events = EPOLLIN;
+            cev.data.fd = cfd;
+            ::epoll_ctl(efd, EPOLL_CTL_ADD, cfd, &cev);
+            auto& c = conns[cfd];
+            c.serial = ++serial;
+            c.sess->workers = workers;
+          }
+        } else if (fd == dfd) {
+          uint64_t count;
+          [[maybe_unused]] auto r = ::read(dfd, &count, sizeof(count));
+          for (auto& j : pool.collect())
+            if (auto it = conns.find(j.fd); it != conns.end() && it->second.serial == j.serial) {
+              auto& c = it->second;
+              c.out += j.out;
+              c.busy = false;
+              dispatch(j.fd, c);
+              if (flush(j.fd, c))
+                settle(j.fd);
+            }
+        } else if (auto it = conns.find(fd); it != conns.end()) {
+          auto& c = it->second;
+          if (evs[i].events & EPOLLOUT) {
+            if (flush(fd, c))
+              settle(fd);
+            continue;
+          }
+
+          char buf[65536];
+          ssize_t r;
+          while ((r = ::read(fd, buf, sizeof(buf))) > 0)
+            c.in.append(buf, r);
+          // A client may close its side right after the last request.
+          c.eof = r == 0 || (r == -1 && errno != EAGAIN && errno != EINTR);
+
+          // Queue all complete requests received so far.
+          size_t off = 0;
+          bool bad = false;
+          constexpr size_t header_size = 2 * sizeof(uint32_t);
+          while (c.in.size() - off >= header_size) {
+            auto len = get<uint32_t>(c.in.data() + off);
+            if (len > max_request) {
+              bad = true;
+              break;
+            }
+            if (c.in.size() - off - header_size < len)
+              break;
+            c.pending.emplace_back(c.in.substr(off + header_size, len), get<uint32_t>(c.in.data() + off + sizeof(uint32_t)));
+            off += header_size + len;
+          }
+          if (bad) {
+            drop(fd);
+            continue;
+          }
+          c.in.erase(0, off);
+          dispatch(fd, c);
+          settle(fd);
+        }
+      }
+    }
+
+    for (auto& [fd,_] : conns)
+      ::close(fd);
+    ::close(efd);
+    ::close(tfd);
+    ::close(sfd);
+    ::close(lfd);
+    ::unlink(path.c_str());
+    ::sigprocmask(SIG_UNBLOCK, &mask, nullptr);
+
+    return true;
+  }
+
+
+  client::client(const std::string& path)
+  : fd(::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0))
+  {
+    if (fd == -1)
+      return;
+    auto sun = address(path);
+    if (path.size() >= sizeof(sun.sun_path) || ::connect(fd, reinterpret_cast<sockaddr*>(&sun), sizeof(sun)) != 0) {
+      ::close(fd);
+      fd = -1;
+    }
+  }
+
+
+  client::~client()
+  {
+    if (fd != -1)
+      ::close(fd);
+  }
+
+
+  std::optional<reply> client::query(const std::string& text, bool data)
+  {
+    std::string req;
+    put(req, uint32_t(text.size()));
+    put<uint32_t>(req, data ? with_data : 0u);
+    req += text;
+    if (fd == -1 || ! write_all(fd, req.data(), req.size()))
+      return std::nullopt;
+
+    reply res { status_type::invalid, ""s, { } };
+    uint32_t mlen;
+    uint32_t nresults;
+    if (! read_all(fd, &res.status, sizeof(res.status)) || ! read_all(fd, &mlen, sizeof(mlen)))
+      return std::nullopt;
+    res.message.resize(mlen);
+    if (! read_all(fd, res.message.data(), mlen) || ! read_all(fd, &nresults, sizeof(nresults)))
+      return std::nullopt;
+
+    for (uint32_t i = 0; i < nresults; ++i) {
+      uint64_t dlen;
+      if (! read_all(fd, &dlen, sizeof(dlen)))
+        return std::nullopt;
+      std::vector<std::byte> desc(dlen);
+      std::string name;
+      auto& s = res.results.emplace_back();
+      if (! read_all(fd, desc.data(), dlen) || ! data::decode_schema(desc.data(), dlen, name, s) || ! read_all(fd, &dlen, sizeof(dlen)))
+        return std::nullopt;
+      if (dlen > 0) {
+        auto buf = std::make_shared<std::vector<std::byte>>(dlen);
+        if (! read_all(fd, buf->data(), dlen))
+          return std::nullopt;
+        s.data = buf->data();
+        s.owner = std::move(buf);
+      }
+    }
+
+    return res;
+  }
+
+} // namespace scql::server
@@ -0,0 +1,85 @@
+#ifndef _SERVER_HH
+#define _SERVER_HH 1
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "data.hh"
+#include "prepare.hh"
+#include "workers.hh"
+
+
+namespace scql::server {
+
+  // The protocol on the Unix domain socket.  A request is the length of the query text and flags,
+  // both as 32-bit numbers, followed by the text.  The reply is the status, the length and text of a
+  // message, the number of results, and for each result the length and encoded description of the
+  // schema followed by the length of the data and the data.  The data is only sent if the request
+  // has the with_data flag, otherwise its length is zero.
+  enum struct status_type : uint32_t {
+    invalid,
+    unhandled,
+    stored,
+    computed,
+  };
+
+  enum request_flags : uint32_t {
+    with_data = 1,
+  };
+
+  struct reply {
+    status_type status;
+    std::string message;
+    std::vector<data::schema> results;    // The data is owned by the schemas.
+  };
+
+
+  // What is kept from one query to the next: the parser context, which remembers the tokens of the
+  // last query and the shapes computed so far, and the pipelines prepared so far by their text.
+  // Prepared pipelines which can be distributed are run by WORKERS, if there are any.
+  struct session {
+    // The prepared pipelines are dropped when there are more.
+    static constexpr size_t max_prepared = 1024;
+
+    scql::context parser {};
+    std::unordered_map<std::string,std::unique_ptr<scql::prepared>> prepared {};
+    data::worker_pool* workers = nullptr;
+  };
+
+
+  // What the server replies to query TEXT, without encoding.  The same session should be used for all
+  // queries of a client, one at a time.
+  reply evaluate(session& sess, const std::string& text);
+
+
+  // Serve queries of clients connecting to the socket at PATH until SIGINT or SIGTERM.  Only the
+  // owner can connect.  The queries are evaluated by a pool of threads.  Each connection has its own
+  // session, using WORKERS, its requests are evaluated one at a time and answered in order.  The
+  // access counts of the data cells are aged periodically.  Anything at PATH other than the socket
+  // of a server which is gone is left alone.
+  bool run(const std::string& path, data::worker_pool* workers = nullptr);
+
+
+  // The connection of the front end.
+  class client {
+  public:
+    explicit client(const std::string& path);
+    client(const client&) = delete;
+    client& operator=(const client&) = delete;
+    ~client();
+
+    bool ok() const { return fd != -1; }
+
+    std::optional<reply> query(const std::string& text, bool data = false);
+
+  private:
+    int fd;
+  };
+
+} // namespace scql::server
+
+#endif // server.hh
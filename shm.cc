@@ -0,0 +1,598 @@
+#include "shm.hh"
+#include "compress.hh"
+#include "store.hh"
+#include "wal.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <new>
+#include <thread>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std::literals;
+
+
+namespace scql::data {
+
+  namespace {
+
+    constexpr char region_magic[8] = { 'S', 'C', 'Q', 'L', 'S', 'H', 'M', '3' };
+    constexpr size_t max_entries = 1 << 16;
+
+    // Use count of a free entry slot.
+    constexpr uint32_t free_slot = UINT32_MAX;
+
+    // Processes attaching to an existing region wait this long for the creator to initialize it.
+    constexpr auto attach_timeout = 5s;
+
+
+    // The description of the version at META_OFF is followed by the offsets of its chunks.  The fields
+    // after REFS only change while the slot is free.
+    struct shared_entry {
+      std::atomic<uint32_t> refs;    // Schemas from get() using the entry, FREE_SLOT if there is none.
+      std::atomic<uint64_t> seq;     // Position in the order of publication.
+      uint64_t id;
+      uint64_t meta_off;
+      uint64_t desc_len;
+      uint64_t nchunks;
+      uint64_t data_len;
+    };
+
+
+    size_t align_up(size_t n, size_t a)
+    {
+      return (n + a - 1) & ~(a - 1);
+    }
+
+
+    uint64_t* chunk_table(std::byte* meta, size_t desc_len)
+    {
+      return reinterpret_cast<uint64_t*>(meta + align_up(desc_len, alignof(uint64_t)));
+    }
+
+
+    // Descriptions and chunk tables are kept in whole chunks as well.
+    size_t meta_chunks(size_t desc_len, size_t nchunks)
+    {
+      return (align_up(desc_len, alignof(uint64_t)) + nchunks * sizeof(uint64_t) + chunk_size - 1) / chunk_size;
+    }
+
+  } // anonymous namespace
+
+
+  struct shared_header {
+    std::atomic<uint64_t> ready;    // Set last by the creator.
+    char magic[8];
+    uint64_t size;
+    std::atomic<uint64_t> published;    // Number of entries published so far.
+    std::atomic<uint64_t> nslots;       // Slots ever used.
+    uint64_t next_version;              // These are protected by LOCK.
+    uint64_t used;
+    uint64_t free_chunks;               // Chunks below USED no entry uses.
+    uint64_t free_slots;                // Free slots below NSLOTS.
+    pthread_mutex_t lock;
+    std::atomic<uint32_t> order[max_entries];    // Slot of the entry published as SEQ at SEQ % MAX_ENTRIES.
+    shared_entry entries[max_entries];
+  };
+
+
+  namespace {
+
+    // The header is followed by the use counts of all chunks of the region.
+    size_t chunk_refs_offset()
+    {
+      return align_up(sizeof(shared_header), alignof(uint32_t));
+    }
+
+
+    size_t region_data_start(size_t size)
+    {
+      return align_up(chunk_refs_offset() + size / chunk_size * sizeof(uint32_t), chunk_size);
+    }
+
+
+    // A writer which died while holding the lock left at most an unpublished entry behind.
+    struct region_lock {
+      region_lock(pthread_mutex_t& m_) : m(m_)
+      {
+        if (::pthread_mutex_lock(&m) == EOWNERDEAD)
+          ::pthread_mutex_consistent(&m);
+      }
+      region_lock(const region_lock&) = delete;
+      region_lock& operator=(const region_lock&) = delete;
+      ~region_lock() { ::pthread_mutex_unlock(&m); }
+
+      pthread_mutex_t& m;
+    };
+
+
+    // The chunks of one version, mapped contiguously.  Empty data has no chunks.  The entry stays in
+    // use as long as the mapping exists.
+    struct region_mapping {
+      region_mapping(std::byte* addr_, size_t len_, std::shared_ptr<const shared_region> region_, size_t idx_) : addr(addr_), len(len_), region(std::move(region_)), idx(idx_) { }
+      region_mapping(const region_mapping&) = delete;
+      region_mapping& operator=(const region_mapping&) = delete;
+      ~region_mapping()
+      {
+        if (addr != nullptr)
+          ::munmap(addr, len);
+        region->release(idx);
+      }
+
+      std::byte* addr;
+      size_t len;
+      std::shared_ptr<const shared_region> region;
+      size_t idx;
+    };
+
+  } // anonymous namespace
+
+
+  std::shared_ptr<shared_region> shared_region::open(const std::string& name, size_t size, mode_t mode, gid_t group)
+  {
+    bool created = true;
+    auto fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+    if (fd == -1 && errno == EEXIST) {
+      created = false;
+      fd = ::shm_open(name.c_str(), O_RDWR | O_CLOEXEC, mode);
+    }
+    if (fd == -1)
+      return nullptr;
+
+    // Only the header and the chunk use counts are allocated right away.  The rest is sparse, it is
+    // allocated as it is used.  The mode is set explicitly, the umask would restrict it.
+    size = std::max(size, sizeof(shared_header) + (1 << 20));
+    if (created && (::fchmod(fd, mode) != 0 || (group != gid_t(-1) && ::fchown(fd, -1, group) != 0) || ::ftruncate(fd, size) != 0 || ::fallocate(fd, 0, 0, region_data_start(size)) != 0)) {
+      ::close(fd);
+      ::shm_unlink(name.c_str());
+      return nullptr;
+    }
+    auto deadline = std::chrono::steady_clock::now() + attach_timeout;
+    auto expired = [deadline] {
+      if (std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(1ms);
+        return false;
+      }
+      errno = ETIMEDOUT;
+      return true;
+    };
+    if (! created) {
+      // Wait for the creator to set the size.
+      size_t cur;
+      while ((cur = ::lseek(fd, 0, SEEK_END)) < sizeof(shared_header))
+        if (expired()) {
+          ::close(fd);
+          return nullptr;
+        }
+      size = cur;
+    }
+
+    auto p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    if (p == MAP_FAILED) {
+      ::close(fd);
+      return nullptr;
+    }
+
+    std::shared_ptr<shared_region> res(new shared_region(fd, static_cast<std::byte*>(p), size));
+    auto& h = res->header();
+    if (created) {
+      std::memcpy(h.magic, region_magic, sizeof(region_magic));
+      h.size = size;
+      h.next_version = 1;
+      h.used = res->data_start();
+      pthread_mutexattr_t attr;
+      ::pthread_mutexattr_init(&attr);
+      ::pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+      ::pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+      ::pthread_mutex_init(&h.lock, &attr);
+      ::pthread_mutexattr_destroy(&attr);
+      h.ready.store(1, std::memory_order_release);
+    } else {
+      // A creator which died before finishing leaves an unusable object behind.
+      while (h.ready.load(std::memory_order_acquire) == 0)
+        if (expired())
+          return nullptr;
+      if (std::memcmp(h.magic, region_magic, sizeof(region_magic)) != 0)
+        return nullptr;
+    }
+
+    return res;
+  }
+
+
+  shared_region::~shared_region()
+  {
+    ::munmap(base, len);
+    ::close(fd);
+  }
+
+
+  shared_header& shared_region::header() const
+  {
+    return *reinterpret_cast<shared_header*>(base);
+  }
+
+
+  // Number of entries using each chunk, zero for free chunks.  Protected by the lock.
+  uint32_t* shared_region::chunk_refs() const
+  {
+    return reinterpret_cast<uint32_t*>(base + chunk_refs_offset());
+  }
+
+
+  size_t shared_region::data_start() const
+  {
+    return region_data_start(len);
+  }
+
+
+  // Take N chunks, freed ones first, and store their offsets in TO.  With RUN they are consecutive.
+  // The memory is allocated right away.  Touching unallocated memory of a full file system would raise
+  // SIGBUS, running out of space is noticed here instead.
+  bool shared_region::allocate(size_t n, bool run, uint64_t* to)
+  {
+    if (n == 0)
+      return true;
+
+    auto& h = header();
+    auto refs = chunk_refs();
+    {
+      region_lock guard(h.lock);
+      size_t got = 0;
+      if (run ? h.free_chunks >= n : h.free_chunks > 0)
+        for (auto c = data_start() / chunk_size; c < h.used / chunk_size && got < std::min<size_t>(n, h.free_chunks); ++c) {
+          if (refs[c] == 0)
+            to[got++] = c * chunk_size;
+          else if (run)
+            got = 0;
+        }
+      if (run && got < n)
+        got = 0;
+      auto reused = got;
+      if (got < n && (h.used > len || n - got > (len - h.used) / chunk_size))
+        return false;
+      for (; got < n; ++got, h.used += chunk_size)
+        to[got] = h.used;
+      for (size_t i = 0; i < n; ++i)
+        refs[to[i] / chunk_size] = 1;
+      h.free_chunks -= reused;
+    }
+
+    for (size_t i = 0; i < n; ) {
+      auto j = i + 1;
+      while (j < n && to[j] == to[j - 1] + chunk_size)
+        ++j;
+      if (::fallocate(fd, 0, to[i], (j - i) * chunk_size) != 0) {
+        region_lock guard(h.lock);
+        for (size_t k = 0; k < n; ++k)
+          unref(to[k]);
+        return false;
+      }
+      i = j;
+    }
+    return true;
+  }
+
+
+  // The chunks [FROM, TO) of TABLE get used by one more entry.
+  void shared_region::hold(const uint64_t* table, size_t from, size_t to)
+  {
+    region_lock guard(header().lock);
+    for (auto c = from; c < to; ++c)
+      ++chunk_refs()[table[c] / chunk_size];
+  }
+
+
+  // The chunk at OFF is used by one entry less.  Free chunks are returned to the system.  The caller
+  // holds the lock.
+  void shared_region::unref(uint64_t off)
+  {
+    if (--chunk_refs()[off / chunk_size] == 0) {
+      ++header().free_chunks;
+      ::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, chunk_size);
+    }
+  }
+
+
+  // Give up the chunks of the description at META_OFF and of the data.  The caller holds the lock.
+  void shared_region::drop(uint64_t meta_off, size_t desc_len, size_t nchunks)
+  {
+    auto table = chunk_table(base + meta_off, desc_len);
+    for (size_t c = 0; c < nchunks; ++c)
+      unref(table[c]);
+    for (size_t c = 0; c < meta_chunks(desc_len, nchunks); ++c)
+      unref(meta_off + c * chunk_size);
+  }
+
+
+  // Free slots are used before new ones.  Without a slot the chunks are given up.
+  std::optional<size_t> shared_region::publish(uint64_t id, uint64_t meta_off, size_t desc_len, size_t nchunks, size_t data_len)
+  {
+    auto& h = header();
+    region_lock guard(h.lock);
+    auto n = h.nslots.load(std::memory_order_relaxed);
+    auto idx = n;
+    if (h.free_slots > 0) {
+      idx = 0;
+      while (h.entries[idx].refs.load(std::memory_order_relaxed) != free_slot)
+        ++idx;
+      --h.free_slots;
+    } else if (n == max_entries) {
+      drop(meta_off, desc_len, nchunks);
+      return std::nullopt;
+    }
+    if (id == 0)
+      id = h.next_version++;
+
+    auto seq = h.published.load(std::memory_order_relaxed);
+    auto& e = h.entries[idx];
+    e.seq.store(seq, std::memory_order_relaxed);
+    e.id = id;
+    e.meta_off = meta_off;
+    e.desc_len = desc_len;
+    e.nchunks = nchunks;
+    e.data_len = data_len;
+    e.refs.store(0, std::memory_order_release);
+    h.order[seq % max_entries].store(idx, std::memory_order_relaxed);
+    if (idx == n)
+      h.nslots.store(n + 1, std::memory_order_release);
+    h.published.store(seq + 1, std::memory_order_release);
+    return idx;
+  }
+
+
+  uint64_t shared_region::reserve(uint64_t min)
+  {
+    auto& h = header();
+    region_lock guard(h.lock);
+    auto id = std::max(h.next_version, min);
+    h.next_version = id + 1;
+    return id;
+  }
+
+
+  std::optional<size_t> shared_region::add(const std::string& name, const schema& s, uint64_t id, size_t offset, const void* p, size_t n)
+  {
+    auto ps = plain(s);
+    auto desc = encode_schema(name, ps);
+    auto data_len = ps.data == nullptr ? 0 : ps.nelems() * ps.row_size();
+    if (offset + n > data_len)
+      return std::nullopt;
+
+    // The copying happens without holding the lock.
+    auto nchunks = (data_len + chunk_size - 1) / chunk_size;
+    std::vector<uint64_t> chunks(nchunks);
+    uint64_t meta_off;
+    if (! allocate(nchunks, false, chunks.data()))
+      return std::nullopt;
+    if (! allocate(meta_chunks(desc.size(), nchunks), true, &meta_off)) {
+      region_lock guard(header().lock);
+      for (auto c : chunks)
+        unref(c);
+      return std::nullopt;
+    }
+
+    std::memcpy(base + meta_off, desc.data(), desc.size());
+    std::ranges::copy(chunks, chunk_table(base + meta_off, desc.size()));
+    for (size_t c = 0; c < nchunks; ++c)
+      std::memcpy(base + chunks[c], static_cast<const std::byte*>(ps.data) + c * chunk_size, std::min(chunk_size, data_len - c * chunk_size));
+    for (auto c = offset / chunk_size; n > 0 && c * chunk_size < offset + n; ++c) {
+      auto from = std::max(offset, c * chunk_size);
+      auto to = std::min(offset + n, (c + 1) * chunk_size);
+      std::memcpy(base + chunks[c] + (from - c * chunk_size), static_cast<const std::byte*>(p) + (from - offset), to - from);
+    }
+
+    return publish(id, meta_off, desc.size(), nchunks, data_len);
+  }
+
+
+  std::optional<size_t> shared_region::update(const std::string& name, size_t base_idx, uint64_t id, size_t offset, const void* p, size_t n)
+  {
+    if (base_idx >= size())
+      return std::nullopt;
+    auto& e = header().entries[base_idx];
+    if (offset + n > e.data_len)
+      return std::nullopt;
+
+    std::string oname;
+    schema s;
+    if (! decode_schema(base + e.meta_off, e.desc_len, oname, s))
+      return std::nullopt;
+    auto desc = encode_schema(name, s);
+
+    // Only the chunks overlapping the range are copied, the others get one more user.
+    auto first = offset / chunk_size;
+    auto last = n == 0 ? first : (offset + n - 1) / chunk_size + 1;
+    std::vector<uint64_t> chunks(last - first);
+    uint64_t meta_off;
+    if (! allocate(chunks.size(), false, chunks.data()))
+      return std::nullopt;
+    if (! allocate(meta_chunks(desc.size(), e.nchunks), true, &meta_off)) {
+      region_lock guard(header().lock);
+      for (auto c : chunks)
+        unref(c);
+      return std::nullopt;
+    }
+
+    std::memcpy(base + meta_off, desc.data(), desc.size());
+    auto old = chunk_table(base + e.meta_off, e.desc_len);
+    auto table = chunk_table(base + meta_off, desc.size());
+    std::copy_n(old, e.nchunks, table);
+    hold(table, 0, first);
+    hold(table, last, e.nchunks);
+    for (auto c = first; c < last; ++c) {
+      table[c] = chunks[c - first];
+      std::memcpy(base + table[c], base + old[c], std::min(chunk_size, e.data_len - c * chunk_size));
+      auto from = std::max(offset, c * chunk_size);
+      auto to = std::min(offset + n, (c + 1) * chunk_size);
+      std::memcpy(base + table[c] + (from - c * chunk_size), static_cast<const std::byte*>(p) + (from - offset), to - from);
+    }
+
+    return publish(id, meta_off, desc.size(), e.nchunks, e.data_len);
+  }
+
+
+  size_t shared_region::size() const
+  {
+    return header().nslots.load(std::memory_order_acquire);
+  }
+
+
+  // A free slot cannot be used anymore, reclaim() only frees slots nobody uses.
+  bool shared_region::pin(size_t idx) const
+  {
+    auto& refs = header().entries[idx].refs;
+    auto r = refs.load(std::memory_order_relaxed);
+    do
+      if (r == free_slot)
+        return false;
+    while (! refs.compare_exchange_weak(r, r + 1, std::memory_order_acquire, std::memory_order_relaxed));
+    return true;
+  }
+
+
+  void shared_region::release(size_t idx) const
+  {
+    header().entries[idx].refs.fetch_sub(1, std::memory_order_release);
+  }
+
+
+  std::optional<std::pair<std::string,version>> shared_region::get(size_t idx) const
+  {
+    return entry(idx, UINT64_MAX);
+  }
+
+
+  // Entry IDX if it was published as SEQ, any entry in the slot for UINT64_MAX.
+  std::optional<std::pair<std::string,version>> shared_region::entry(size_t idx, uint64_t seq) const
+  {
+    if (idx >= size() || ! pin(idx))
+      return std::nullopt;
+    auto& e = header().entries[idx];
+    std::pair<std::string,version> res { ""s, version { e.id, schema { } } };
+    res.second.entry = idx;
+    auto& s = res.second.s;
+    if ((seq != UINT64_MAX && e.seq.load(std::memory_order_relaxed) != seq) || ! decode_schema(base + e.meta_off, e.desc_len, res.first, s)) {
+      release(idx);
+      return std::nullopt;
+    }
+    // No zone map, computing it would touch all the data in every process.
+    if (e.nchunks == 0) {
+      s.data = nullptr;
+      s.owner = std::make_shared<const region_mapping>(nullptr, 0, shared_from_this(), idx);
+      return res;
+    }
+
+    // The chunks are mapped in order, runs of consecutive chunks together.
+    auto maplen = e.nchunks * chunk_size;
+    auto p = ::mmap(nullptr, maplen, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+      release(idx);
+      throw std::bad_alloc();
+    }
+    auto addr = static_cast<std::byte*>(p);
+    auto table = chunk_table(base + e.meta_off, e.desc_len);
+    for (size_t i = 0; i < e.nchunks; ) {
+      auto j = i + 1;
+      while (j < e.nchunks && table[j] == table[j - 1] + chunk_size)
+        ++j;
+      if (::mmap(addr + i * chunk_size, (j - i) * chunk_size, PROT_READ, MAP_SHARED | MAP_FIXED, fd, table[i]) == MAP_FAILED) {
+        ::munmap(addr, maplen);
+        release(idx);
+        throw std::bad_alloc();
+      }
+      i = j;
+    }
+    s.data = addr;
+    s.owner = std::make_shared<const region_mapping>(addr, maplen, shared_from_this(), idx);
+    return res;
+  }
+
+
+  // The slot of each entry is recorded in the order of publication.  A reader which fell behind so far
+  // that the record was overwritten searches all slots instead.
+  std::vector<std::pair<std::string,version>> shared_region::since(uint64_t& seen) const
+  {
+    auto& h = header();
+    auto n = h.published.load(std::memory_order_acquire);
+    std::vector<std::pair<uint64_t,size_t>> slots;
+    for (auto seq = seen; seq < n; ++seq)
+      slots.emplace_back(seq, h.order[seq % max_entries].load(std::memory_order_relaxed));
+    if (h.published.load(std::memory_order_acquire) - seen >= max_entries) {
+      slots.clear();
+      for (size_t idx = 0; idx < size(); ++idx)
+        if (auto seq = h.entries[idx].seq.load(std::memory_order_relaxed); seq >= seen && seq < n)
+          slots.emplace_back(seq, idx);
+      std::ranges::sort(slots);
+    }
+
+    std::vector<std::pair<std::string,version>> res;
+    for (auto [seq, idx] : slots)
+      if (auto e = entry(idx, seq))
+        res.emplace_back(std::move(*e));
+    seen = n;
+    return res;
+  }
+
+
+  size_t shared_region::reclaim()
+  {
+    auto& h = header();
+    region_lock guard(h.lock);
+    auto n = size();
+
+    // The newest version of each cell is kept even if nobody uses it right now.
+    std::vector<std::optional<std::string>> names(n);
+    std::map<std::string,uint64_t> newest;
+    for (size_t idx = 0; idx < n; ++idx) {
+      auto& e = h.entries[idx];
+      std::string name;
+      schema s;
+      if (e.refs.load(std::memory_order_relaxed) == free_slot || ! decode_schema(base + e.meta_off, e.desc_len, name, s))
+        continue;
+      auto& id = newest[name];
+      id = std::max(id, e.id);
+      names[idx] = std::move(name);
+    }
+
+    size_t res = 0;
+    for (size_t idx = 0; idx < n; ++idx) {
+      auto& e = h.entries[idx];
+      uint32_t unused = 0;
+      if (names[idx] && e.id != newest[*names[idx]] && e.refs.compare_exchange_strong(unused, free_slot, std::memory_order_acquire)) {
+        drop(e.meta_off, e.desc_len, e.nchunks);
+        ++h.free_slots;
+        ++res;
+      }
+    }
+    return res;
+  }
+
+
+  void shared_region::reset()
+  {
+    auto& h = header();
+    region_lock guard(h.lock);
+    h.published.store(0, std::memory_order_release);
+    h.nslots.store(0, std::memory_order_release);
+    h.next_version = 1;
+    h.free_chunks = 0;
+    h.free_slots = 0;
+    // The memory is returned to the system.
+    if (auto start = data_start(); h.used > start) {
+      ::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, h.used - start);
+      std::fill(chunk_refs() + start / chunk_size, chunk_refs() + h.used / chunk_size, 0);
+      h.used = start;
+    }
+  }
+
+} // namespace scql::data
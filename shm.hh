@@ -0,0 +1,97 @@
+#ifndef _SHM_HH
+#define _SHM_HH 1
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "data.hh"
+
+
+namespace scql::data {
+
+  struct shared_header;
+
+
+  // Data cells in a POSIX shared-memory object which all processes on the host can map.  The region
+  // is a table of entries, one per version, followed by the chunks of their descriptions and data.
+  // The data is kept in chunks, like in store.hh, and a version derived from another one shares all
+  // unchanged chunks.  Writers serialize on a process-shared mutex.  A new entry is completely written
+  // before it is published, readers never lock.  Memory is allocated when it is used, the size is only
+  // the limit of the address space.
+  //
+  // Each entry counts the schemas from get() which still use it.  reclaim() frees the slots and chunks
+  // of entries nobody uses which are not the newest version of their cell.  The uses of a process
+  // which dies are never released, its entries stay until the region is removed.
+  class shared_region : public std::enable_shared_from_this<shared_region> {
+  public:
+    // Create the object NAME with SIZE bytes of address space or map the existing one.  A new object
+    // gets the permissions MODE and, unless it is -1, the group GROUP.  Processes opening an existing
+    // object give up if its creator does not finish initializing it in time.
+    static std::shared_ptr<shared_region> open(const std::string& name, size_t size, mode_t mode = 0600, gid_t group = -1);
+
+    shared_region(const shared_region&) = delete;
+    shared_region& operator=(const shared_region&) = delete;
+    ~shared_region();
+
+    // A new version id, not less than MIN.  The ids are unique among all processes using the region.
+    uint64_t reserve(uint64_t min = 0);
+
+    // Copy S into the region, with the range [OFFSET, OFFSET+N) replaced by P if N is not zero.  ID
+    // is from reserve(), with zero a new one is used.  The result is the index of the new entry,
+    // nothing if the region is full.
+    std::optional<size_t> add(const std::string& name, const schema& s, uint64_t id = 0, size_t offset = 0, const void* p = nullptr, size_t n = 0);
+
+    // Derive a new version from entry BASE where the range [OFFSET, OFFSET+N) is replaced by P.  Only
+    // the chunks overlapping the range are new.  The caller still uses BASE.  The result is as for add().
+    std::optional<size_t> update(const std::string& name, size_t base, uint64_t id, size_t offset, const void* p, size_t n);
+
+    // Number of entry slots ever used.
+    size_t size() const;
+
+    // Entry IDX, the data is used in place.  The schema's owner keeps the entry in use.  Nothing if the
+    // slot is free or the description of the entry is damaged.
+    std::optional<std::pair<std::string,version>> get(size_t idx) const;
+
+    // The entries published since SEEN, in order, which is advanced.  Entries already reclaimed are
+    // missing.
+    std::vector<std::pair<std::string,version>> since(uint64_t& seen) const;
+
+    // Free the unused entries which are superseded by a newer version of the same cell.  The result is
+    // the number of entries freed.
+    size_t reclaim();
+
+    // Drop all entries.  Only for a region private to cooperating processes none of which still uses
+    // an entry.
+    void reset();
+
+    // Drop the use of entry IDX made by get().
+    void release(size_t idx) const;
+
+  private:
+    shared_region(int fd_, std::byte* base_, size_t len_) : fd(fd_), base(base_), len(len_) { }
+
+    shared_header& header() const;
+    uint32_t* chunk_refs() const;
+    size_t data_start() const;
+    bool allocate(size_t n, bool run, uint64_t* to);
+    void hold(const uint64_t* table, size_t from, size_t to);
+    void drop(uint64_t meta_off, size_t desc_len, size_t nchunks);
+    void unref(uint64_t off);
+    std::optional<size_t> publish(uint64_t id, uint64_t meta_off, size_t desc_len, size_t nchunks, size_t data_len);
+    bool pin(size_t idx) const;
+    std::optional<std::pair<std::string,version>> entry(size_t idx, uint64_t seq) const;
+
+    int fd;
+    std::byte* base;
+    size_t len;
+  };
+
+} // namespace scql::data
+
+#endif // shm.hh
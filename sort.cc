@@ -0,0 +1,207 @@
+#include "sort.hh"
+#include "parallel.hh"
+
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <utility>
+
+
+namespace scql::data {
+
+  namespace {
+
+    // Keys are unsigned integers with the same order as the values.  For floating-point numbers the
+    // sign bit is flipped for positive numbers, all bits are flipped for negative numbers.  All NaNs
+    // get the key of the positive quiet NaN, they are sorted last as by value_less.
+    template<typename T> struct key_traits;
+
+    template<> struct key_traits<uint8_t> {
+      using key_type = uint8_t;
+      static key_type key(uint8_t v) { return v; }
+      static uint8_t value(key_type k) { return k; }
+    };
+
+    template<> struct key_traits<uint32_t> {
+      using key_type = uint32_t;
+      static key_type key(uint32_t v) { return v; }
+      static uint32_t value(key_type k) { return k; }
+    };
+
+    template<> struct key_traits<float> {
+      using key_type = uint32_t;
+      static constexpr key_type sign = key_type(1) << 31;
+      static key_type key(float v) { auto b = std::bit_cast<key_type>(std::isnan(v) ? std::numeric_limits<float>::quiet_NaN() : v); return (b & sign) ? ~b : b | sign; }
+      static float value(key_type k) { return std::bit_cast<float>((k & sign) ? k & ~sign : ~k); }
+    };
+
+    template<> struct key_traits<double> {
+      using key_type = uint64_t;
+      static constexpr key_type sign = key_type(1) << 63;
+      static key_type key(double v) { auto b = std::bit_cast<key_type>(std::isnan(v) ? std::numeric_limits<double>::quiet_NaN() : v); return (b & sign) ? ~b : b | sign; }
+      static double value(key_type k) { return std::bit_cast<double>((k & sign) ? k & ~sign : ~k); }
+    };
+
+
+    using histogram = std::array<size_t,256>;
+
+
+    // LSD radix sort with 8-bit digits.  In each pass every thread computes the histogram of its block,
+    // the prefix sums over (digit, thread) then give each thread its own output positions so that the
+    // scatter needs no synchronization and stays stable.
+    template<typename K>
+    void radix_sort(std::vector<K>& keys, std::vector<uint32_t>* idx)
+    {
+      constexpr unsigned npasses = sizeof(K);
+      auto n = keys.size();
+      auto nt = nthreads(n);
+
+      // Passes where all keys have the same digit can be skipped.  These global histograms do not
+      // change while sorting.
+      std::vector<std::array<histogram,npasses>> all(nt);
+      parallel(nt, [&](unsigned t) {
+        auto& h = all[t];
+        for (auto& e : h)
+          e.fill(0);
+        auto [from, to] = block(n, nt, t);
+        for (auto i = from; i < to; ++i)
+          for (unsigned p = 0; p < npasses; ++p)
+            ++h[p][(keys[i] >> (8 * p)) & 0xff];
+      });
+
+      std::vector<K> tkeys(n);
+      std::vector<uint32_t> tidx(idx != nullptr ? n : 0);
+      std::vector<histogram> hist(nt);
+
+      for (unsigned p = 0; p < npasses; ++p) {
+        bool trivial = false;
+        for (unsigned d = 0; d < 256 && ! trivial; ++d) {
+          size_t cnt = 0;
+          for (unsigned t = 0; t < nt; ++t)
+            cnt += all[t][p][d];
+          trivial = cnt == n;
+        }
+        if (trivial)
+          continue;
+
+        parallel(nt, [&](unsigned t) {
+          hist[t].fill(0);
+          auto [from, to] = block(n, nt, t);
+          for (auto i = from; i < to; ++i)
+            ++hist[t][(keys[i] >> (8 * p)) & 0xff];
+        });
+
+        size_t off = 0;
+        for (unsigned d = 0; d < 256; ++d)
+          for (unsigned t = 0; t < nt; ++t)
+            off += std::exchange(hist[t][d], off);
+
+        parallel(nt, [&](unsigned t) {
+          auto& h = hist[t];
+          auto [from, to] = block(n, nt, t);
+          for (auto i = from; i < to; ++i) {
+            auto pos = h[(keys[i] >> (8 * p)) & 0xff]++;
+            tkeys[pos] = keys[i];
+            if (idx != nullptr)
+              tidx[pos] = (*idx)[i];
+          }
+        });
+
+        keys.swap(tkeys);
+        if (idx != nullptr)
+          idx->swap(tidx);
+      }
+    }
+
+
+    template<typename T>
+    std::vector<typename key_traits<T>::key_type> load_keys(const schema::column_view& v)
+    {
+      std::vector<typename key_traits<T>::key_type> res(v.count);
+      auto nt = nthreads(v.count);
+      parallel(nt, [&](unsigned t) {
+        auto [from, to] = block(v.count, nt, t);
+        for (auto i = from; i < to; ++i)
+          res[i] = key_traits<T>::key(v.get<T>(i));
+      });
+      return res;
+    }
+
+
+    template<typename T>
+    std::vector<uint32_t> argsort(const schema::column_view& v)
+    {
+      auto keys = load_keys<T>(v);
+      std::vector<uint32_t> idx(v.count);
+      for (size_t i = 0; i < v.count; ++i)
+        idx[i] = i;
+      radix_sort(keys, &idx);
+      return idx;
+    }
+
+
+    template<typename T>
+    void sort(const schema::column_view& v, std::byte* out)
+    {
+      auto keys = load_keys<T>(v);
+      radix_sort(keys, nullptr);
+      auto nt = nthreads(v.count);
+      parallel(nt, [&](unsigned t) {
+        auto [from, to] = block(v.count, nt, t);
+        for (auto i = from; i < to; ++i) {
+          auto e = key_traits<T>::value(keys[i]);
+          std::memcpy(out + i * sizeof(T), &e, sizeof(T));
+        }
+      });
+    }
+
+  } // anonymous namespace
+
+
+  bool sortable(const schema::column& c)
+  {
+    return c.type != data_type::str && c.size() == type_size(c.type);
+  }
+
+
+  std::vector<uint32_t> argsort(const schema::column& c, const schema::column_view& v)
+  {
+    switch (c.type) {
+    case data_type::u8:
+      return argsort<uint8_t>(v);
+    case data_type::u32:
+      return argsort<uint32_t>(v);
+    case data_type::f32:
+      return argsort<float>(v);
+    case data_type::f64:
+      return argsort<double>(v);
+    case data_type::str:
+      break;
+    }
+    std::unreachable();
+  }
+
+
+  void sort(const schema::column& c, const schema::column_view& v, std::byte* out)
+  {
+    switch (c.type) {
+    case data_type::u8:
+      sort<uint8_t>(v, out);
+      break;
+    case data_type::u32:
+      sort<uint32_t>(v, out);
+      break;
+    case data_type::f32:
+      sort<float>(v, out);
+      break;
+    case data_type::f64:
+      sort<double>(v, out);
+      break;
+    case data_type::str:
+      std::unreachable();
+    }
+  }
+
+} // namespace scql::data
@@ -0,0 +1,24 @@
+#ifndef _SORT_HH
+#define _SORT_HH 1
+
+#include <cstdint>
+#include <vector>
+
+#include "data.hh"
+
+
+namespace scql::data {
+
+  // Radix sort of scalar numeric columns (u8, u32, f32, f64).  Both functions are stable: equal
+  // values keep their relative order.
+  bool sortable(const schema::column& c);
+
+  // Indices of the values in sorted order.
+  std::vector<uint32_t> argsort(const schema::column& c, const schema::column_view& v);
+
+  // Write the sorted values contiguously to OUT.
+  void sort(const schema::column& c, const schema::column_view& v, std::byte* out);
+
+} // namespace scql::data
+
+#endif // sort.hh
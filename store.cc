@@ -0,0 +1,232 @@
+#include "store.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <set>
+
+#include <error.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+
+namespace scql::data {
+
+  namespace {
+
+    // All chunks are pages of one memory file.  This allows to map arbitrary sequences of chunks
+    // contiguously into the address space.
+    struct chunk_file {
+      chunk_file()
+      : fd(::memfd_create("scql-chunks", MFD_CLOEXEC))
+      {
+        if (fd == -1)
+          ::error(EXIT_FAILURE, errno, "cannot create chunk storage");
+      }
+      chunk_file(const chunk_file&) = delete;
+      chunk_file& operator=(const chunk_file&) = delete;
+      ~chunk_file() { ::close(fd); }
+
+      // Take N chunks.  Every run of consecutive chunks of a version needs a mapping of its own and the
+      // number of mappings of a process is limited.  Therefore the first run of N free chunks is used,
+      // the file grows if there is none.
+      std::vector<size_t> alloc(size_t n)
+      {
+        std::lock_guard guard(lock);
+        auto res = first_run(n);
+        if (res.size() < n) {
+          auto newsize = std::max({ 2 * size, size + n * chunk_size, 16 * chunk_size });
+          if (::ftruncate(fd, newsize) != 0)
+            throw std::bad_alloc();
+          for (auto off = size; off < newsize; off += chunk_size)
+            free.insert(off);
+          size = newsize;
+          res = first_run(n);
+        }
+        for (auto off : res)
+          free.erase(off);
+        return res;
+      }
+
+      void release(size_t off)
+      {
+        std::lock_guard guard(lock);
+        // Return the memory to the system, the content of the chunk is not needed anymore.
+        ::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, chunk_size);
+        free.insert(off);
+      }
+
+      int fd;
+      size_t size = 0;
+      std::set<size_t> free { };
+      std::mutex lock { };
+
+    private:
+      // Offsets of the lowest N consecutive free chunks, fewer if there is no such run.
+      std::vector<size_t> first_run(size_t n) const
+      {
+        std::vector<size_t> res;
+        for (auto it = free.begin(); it != free.end() && res.size() < n; ++it) {
+          if (! res.empty() && *it != res.back() + chunk_size)
+            res.clear();
+          res.push_back(*it);
+        }
+        return res;
+      }
+    };
+
+
+    // Never destroyed: chunks of static objects like the catalog are released during program exit.
+    chunk_file& file()
+    {
+      static auto f = new chunk_file;
+      return *f;
+    }
+
+
+    // Fill the entries of CHUNKS selected by FRESH with new chunks, consecutive if possible.
+    void new_chunks(std::vector<chunk_ptr>& chunks, const std::vector<size_t>& fresh)
+    {
+      auto offs = file().alloc(fresh.size());
+      size_t i = 0;
+      try {
+        for (; i < fresh.size(); ++i)
+          chunks[fresh[i]] = std::make_shared<const chunk>(offs[i]);
+      } catch (const std::bad_alloc&) {
+        for (; i < offs.size(); ++i)
+          file().release(offs[i]);
+        throw;
+      }
+    }
+
+  } // anonymous namespace
+
+
+  chunk::~chunk()
+  {
+    file().release(off);
+  }
+
+
+  mapping::mapping(std::vector<chunk_ptr>&& chunks_, size_t len_)
+  : len(len_), chunks(std::move(chunks_))
+  {
+    if (chunks.empty())
+      return;
+
+    reserved = chunks.size() * chunk_size;
+    auto p = ::mmap(nullptr, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+      throw std::bad_alloc();
+    addr = static_cast<std::byte*>(p);
+
+    // Chunks which are consecutive in the file are mapped together.
+    for (size_t i = 0; i < chunks.size(); ) {
+      auto j = i + 1;
+      while (j < chunks.size() && chunks[j]->off == chunks[j - 1]->off + chunk_size)
+        ++j;
+      if (::mmap(addr + i * chunk_size, (j - i) * chunk_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, file().fd, chunks[i]->off) == MAP_FAILED) {
+        ::munmap(addr, reserved);
+        copy_in();
+        return;
+      }
+      i = j;
+    }
+  }
+
+
+  // The chunks cannot be mapped, usually because the process has too many mappings.  They are copied
+  // into anonymous memory instead and written back by seal.
+  void mapping::copy_in()
+  {
+    auto p = ::mmap(nullptr, reserved, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+      throw std::bad_alloc();
+    addr = static_cast<std::byte*>(p);
+    copied = true;
+
+    for (size_t i = 0; i < chunks.size(); ++i)
+      if (::pread(file().fd, addr + i * chunk_size, chunk_size, chunks[i]->off) != ssize_t(chunk_size)) {
+        ::munmap(addr, reserved);
+        throw std::bad_alloc();
+      }
+  }
+
+
+  mapping::~mapping()
+  {
+    if (reserved != 0)
+      ::munmap(addr, reserved);
+  }
+
+
+  void mapping::seal() const
+  {
+    if (reserved == 0)
+      return;
+    // Chunks shared with other versions are written with the content they already have.
+    if (copied)
+      for (size_t i = 0; i < chunks.size(); ++i)
+        if (::pwrite(file().fd, addr + i * chunk_size, chunk_size, chunks[i]->off) != ssize_t(chunk_size))
+          throw std::bad_alloc();
+    ::mprotect(addr, reserved, PROT_READ);
+  }
+
+
+  std::shared_ptr<const mapping> store(const void* p, size_t len, const mapping* prev)
+  {
+    auto src = static_cast<const std::byte*>(p);
+    auto n = (len + chunk_size - 1) / chunk_size;
+    std::vector<chunk_ptr> chunks(n);
+    std::vector<size_t> fresh;
+
+    for (size_t i = 0; i < n; ++i) {
+      auto here = std::min(chunk_size, len - i * chunk_size);
+      if (prev != nullptr && i < prev->chunks.size() && i * chunk_size + here <= prev->len
+          && std::memcmp(prev->addr + i * chunk_size, src + i * chunk_size, here) == 0)
+        chunks[i] = prev->chunks[i];
+      else
+        fresh.push_back(i);
+    }
+    new_chunks(chunks, fresh);
+
+    auto res = std::make_shared<const mapping>(std::move(chunks), len);
+    for (auto i : fresh)
+      std::memcpy(res->addr + i * chunk_size, src + i * chunk_size, std::min(chunk_size, len - i * chunk_size));
+    res->seal();
+
+    return res;
+  }
+
+
+  std::shared_ptr<const mapping> store_update(const mapping& prev, size_t off, const void* p, size_t len)
+  {
+    auto total = std::max(prev.len, off + len);
+    auto n = (total + chunk_size - 1) / chunk_size;
+    auto first = off / chunk_size;
+    auto last = len == 0 ? first : (off + len + chunk_size - 1) / chunk_size;
+
+    std::vector<chunk_ptr> chunks(n);
+    std::vector<size_t> fresh;
+    for (size_t i = 0; i < n; ++i)
+      if ((i >= first && i < last) || i >= prev.chunks.size())
+        fresh.push_back(i);
+      else
+        chunks[i] = prev.chunks[i];
+    new_chunks(chunks, fresh);
+
+    auto res = std::make_shared<const mapping>(std::move(chunks), total);
+    for (auto i = first; i < last; ++i)
+      if (i < prev.chunks.size())
+        std::memcpy(res->addr + i * chunk_size, prev.addr + i * chunk_size, std::min(chunk_size, prev.len - i * chunk_size));
+    std::memcpy(res->addr + off, p, len);
+    res->seal();
+
+    return res;
+  }
+
+} // namespace scql::data
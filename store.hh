@@ -0,0 +1,60 @@
+#ifndef _STORE_HH
+#define _STORE_HH 1
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+
+namespace scql::data {
+
+  // The contents of data cells are kept in fixed-size chunks.  Chunks are reference counted and never
+  // modified once they are part of a version.  A new version of a cell shares all unchanged chunks with
+  // its predecessor, only the modified chunks are copied.
+  constexpr size_t chunk_size = 64 * 1024;
+
+
+  struct chunk {
+    chunk(size_t off_) : off(off_) { }
+    chunk(const chunk&) = delete;
+    chunk& operator=(const chunk&) = delete;
+    ~chunk();
+
+    size_t off;    // Offset in the backing file.
+  };
+  using chunk_ptr = std::shared_ptr<const chunk>;
+
+
+  // Read-only, contiguous mapping of a sequence of chunks.  This is what the DATA pointer of the schema
+  // of a stored data cell points to.
+  struct mapping {
+    mapping(std::vector<chunk_ptr>&& chunks_, size_t len_);
+    mapping(const mapping&) = delete;
+    mapping& operator=(const mapping&) = delete;
+    ~mapping();
+
+    // Make the mapping read-only once the new chunks are filled in.
+    void seal() const;
+
+    std::byte* addr = nullptr;
+    size_t len;
+    std::vector<chunk_ptr> chunks;
+
+  private:
+    void copy_in();
+
+    size_t reserved = 0;
+    bool copied = false;    // Not mapped, the chunks are copied.
+  };
+
+
+  // Store LEN bytes at P.  Chunks of PREV with identical content are reused.
+  std::shared_ptr<const mapping> store(const void* p, size_t len, const mapping* prev = nullptr);
+
+  // Derive a new version from PREV where the LEN bytes at offset OFF are replaced by the content of P.
+  // Only the chunks overlapping the modified range are copied.
+  std::shared_ptr<const mapping> store_update(const mapping& prev, size_t off, const void* p, size_t len);
+
+} // namespace scql::data
+
+#endif // store.hh
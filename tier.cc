@@ -0,0 +1,169 @@
+#include "data.hh"
+#include "compress.hh"
+
+#include <cerrno>
+#include <new>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+using namespace std::literals;
+
+
+namespace scql::data {
+
+  namespace {
+
+    // Accesses since the last aging after which the plain data of a cold cell is kept.
+    constexpr unsigned promote_after = 4;
+
+
+    // The namespace of aa::bb:cc is aa::bb, the same as that of aa::bb::cc.  Names without colons have
+    // none.
+    std::string_view namespace_of(std::string_view name)
+    {
+      auto p = name.rfind(':');
+      if (p == std::string_view::npos)
+        return { };
+      auto ns = name.substr(0, p);
+      while (ns.ends_with(':'))
+        ns.remove_suffix(1);
+      return ns;
+    }
+
+
+    // The file is unnamed, it disappears with the mapping.
+    struct file_mapping {
+      file_mapping(std::byte* addr_, size_t len_) : addr(addr_), len(len_) { }
+      file_mapping(const file_mapping&) = delete;
+      file_mapping& operator=(const file_mapping&) = delete;
+      ~file_mapping() { ::munmap(addr, len); }
+
+      std::byte* addr;
+      size_t len;
+    };
+
+
+    std::shared_ptr<const file_mapping> map_file(const std::string& dir, const void* p, size_t n)
+    {
+      auto fd = ::open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+      if (fd == -1)
+        return nullptr;
+
+      size_t off = 0;
+      while (off < n) {
+        auto r = ::pwrite(fd, static_cast<const char*>(p) + off, n - off, off);
+        if (r <= 0) {
+          if (r == -1 && errno == EINTR)
+            continue;
+          ::close(fd);
+          return nullptr;
+        }
+        off += r;
+      }
+
+      auto addr = ::mmap(nullptr, n, PROT_READ, MAP_SHARED, fd, 0);
+      ::close(fd);
+      if (addr == MAP_FAILED)
+        return nullptr;
+      return std::make_shared<const file_mapping>(static_cast<std::byte*>(addr), n);
+    }
+
+  } // anonymous namespace
+
+
+  void data_info::set_placement(const std::string& ns, tier t, const std::string& dir)
+  {
+    std::lock_guard guard(lock);
+    policies.insert_or_assign(ns, placement { t, dir });
+  }
+
+
+  // Move the data of a new version to the tier of its namespace.  Resident versions share chunks with
+  // their predecessors, mapped and cold versions are copies.
+  void data_info::place(const std::string& name, version& v) const
+  {
+    auto ns = namespace_of(name);
+    const placement* p = nullptr;
+    size_t best = 0;
+    for (const auto& [n,pl] : policies)
+      if ((n.empty() || ns == n || (ns.starts_with(n) && ns.substr(n.size()).starts_with("::"))) && (p == nullptr || n.size() > best)) {
+        p = &pl;
+        best = n.size();
+      }
+
+    if (p == nullptr || p->where == tier::resident || ! v.s.writable || v.s.data == nullptr || v.s.nelems() * v.s.row_size() == 0)
+      return;
+
+    if (p->where == tier::mapped) {
+      auto f = map_file(p->dir, v.s.data, v.s.nelems() * v.s.row_size());
+      // Without the file the version just stays in memory.
+      if (! f)
+        return;
+      v.s.data = f->addr;
+      v.s.owner = std::move(f);
+    } else {
+      v.packed = compress(v.s);
+      v.s = v.packed;
+    }
+    v.m.reset();
+  }
+
+
+  // Keep version V in another form, the contents and the id stay the same.  Readers hold copies of the
+  // schema whose owner keeps the old form alive as long as they need it.  Nothing is logged, after a
+  // replay the cell is just kept in the other form.
+  void data_info::republish(version& v, schema s, schema packed)
+  {
+    v.s = std::move(s);
+    v.packed = std::move(packed);
+  }
+
+
+  // Only executing queries count as accesses, not the lookups when they are analyzed.  Cold cells used
+  // often keep the plain data of their newest version as well.
+  schema data_info::use(const std::string& name)
+  {
+    std::lock_guard guard(lock);
+    auto vs = find(name);
+    if (vs == nullptr || vs->empty())
+      std::unreachable();
+    auto n = ++accesses[name];
+    if (auto& b = vs->back(); n >= promote_after && b.packed && b.s.data == nullptr)
+      try {
+        auto s = decompress(b.packed);
+        s.zones = b.packed.zones;
+        republish(b, std::move(s), b.packed);
+      } catch (const std::bad_alloc&) {
+        // Without the memory for the plain data the compressed version is used.
+      }
+    return vs->back().s;
+  }
+
+
+  size_t data_info::age()
+  {
+    std::lock_guard guard(lock);
+    size_t res = 0;
+    for (auto& [n,vs] : known) {
+      auto it = accesses.find(n);
+      unsigned cnt = 0;
+      if (it != accesses.end()) {
+        cnt = it->second /= 2;
+        if (cnt == 0)
+          accesses.erase(it);
+      }
+      if (cnt < promote_after && ! vs.empty())
+        if (auto& b = vs.back(); b.packed && b.s.data != nullptr) {
+          republish(b, b.packed, b.packed);
+          ++res;
+        }
+    }
+    return res;
+  }
+
+} // namespace scql::data
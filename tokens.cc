@@ -0,0 +1,290 @@
+#include "scql.hh"
+#include "scql-tab.hh"
+#ifdef SCQL_HANDWRITTEN_LEXER
+#include "parse.hh"
+#else
+#include "scql-scan.hh"
+#endif
+
+#include <algorithm>
+#include <cstdint>
+#include <ranges>
+
+
+namespace scql {
+
+  namespace {
+
+    // The scanner looks at most this many characters beyond the end of a token, for the exponent of
+    // a floating-point number.
+    constexpr size_t max_lookahead = 2;
+
+
+    // Offset of column X in line Y, both counted from zero.
+    size_t offset(const std::vector<size_t>& lines, int x, int y)
+    {
+      return lines[std::clamp<size_t>(y, 0, lines.size() - 1)] + x;
+    }
+
+
+    // The parser only sets flags in the nodes of tokens, they are cleared before a node is used again.
+    void reuse(part& p)
+    {
+      p.errmsg.clear();
+      p.shape.clear();
+      p.parent = nullptr;
+      if (p.is(id_type::codecell))
+        static_cast<codecell&>(p).missing_brackets = false;
+      else if (p.is(id_type::datacell))
+        static_cast<datacell&>(p).permission = true;
+    }
+
+
+    void shift(location& l, int line, int dl, int dc)
+    {
+      if (l.first_line == line)
+        l.first_column += dc;
+      if (l.last_line == line)
+        l.last_column += dc;
+      l.first_line += dl;
+      l.last_line += dl;
+    }
+
+
+    // The nodes made by the parser, the others are the values of tokens.
+    bool inner(const part& p)
+    {
+      switch (p.id) {
+      case id_type::list:
+      case id_type::statements:
+      case id_type::pipeline:
+      case id_type::fcall:
+      case id_type::glob:
+        return true;
+      default:
+        return false;
+      }
+    }
+
+
+    int64_t end_key(const location& l)
+    {
+      return (int64_t(l.last_line) << 32) + l.last_column;
+    }
+
+  } // anonymous namespace
+
+
+  bool token_cache::update(const std::string& s, yyscan_t scanner)
+  {
+    fresh_from = fresh_to = 0;
+    if (s == text && ! tokens.empty())
+      return true;
+
+    // Start over once most nodes belong to replaced tokens.
+    if (nodes.size() > 2 * tokens.size() + 64) {
+      tokens.clear();
+      text.clear();
+      nodes.clear();
+    }
+
+    // The unchanged text before and after the edit.
+    auto pre = size_t(std::ranges::mismatch(text, s).in1 - text.begin());
+    size_t suf = 0;
+    while (suf < std::min(text.size(), s.size()) - pre && text[text.size() - 1 - suf] == s[s.size() - 1 - suf])
+      ++suf;
+    auto delta = ptrdiff_t(s.size()) - ptrdiff_t(text.size());
+
+    std::vector<size_t> lines { 0 };
+    for (size_t i = 0; i < s.size(); ++i)
+      if (s[i] == '\n')
+        lines.push_back(i + 1);
+
+    // Tokens which end well before the edit are kept as they are.  Scanning resumes after the last.
+    auto keep = size_t(std::ranges::find_if(tokens, [pre](const auto& t) { return t.to + max_lookahead >= pre || t.type == scqlEND; }) - tokens.begin());
+    location lloc { 0, 0, 0, 0 };
+    size_t start = 0;
+    if (keep > 0) {
+      auto& last = tokens[keep - 1];
+      start = last.to;
+      lloc = { last.lloc.last_line, last.lloc.last_column, last.lloc.last_line, last.lloc.last_column };
+    }
+
+    std::vector<token> res(std::make_move_iterator(tokens.begin()), std::make_move_iterator(tokens.begin() + keep));
+    fresh_from = keep;
+    bool kept = keep > 0;
+
+    scqlset_extra(&nodes, scanner);
+    auto buffer = scql_scan_bytes(s.data() + start, s.size() - start, scanner);
+    while (true) {
+      part::cptr_type val;
+      auto type = scqllex(&val, &lloc, scanner);
+      if (type == scqlEND) {
+        res.emplace_back(type, std::move(val), lloc, s.size(), s.size());
+        fresh_to = res.size();
+        break;
+      }
+      auto from = offset(lines, lloc.first_column, lloc.first_line);
+
+      // Once a token starts in the unchanged rest of the text the remaining old tokens are the same.
+      if (from >= s.size() - suf) {
+        auto old = std::ranges::lower_bound(tokens.begin() + keep, tokens.end(), from - delta, {}, &token::from);
+        if (old != tokens.end() && old->from == from - delta && old->type == type) {
+          fresh_to = res.size();
+          kept = true;
+          auto line = old->lloc.first_line;
+          auto dl = lloc.first_line - line;
+          auto dc = lloc.first_column - old->lloc.first_column;
+          for (; old != tokens.end(); ++old) {
+            shift(old->lloc, line, dl, dc);
+            if (old->val)
+              shift(old->val->lloc, line, dl, dc);
+            old->from += delta;
+            old->to += delta;
+            res.emplace_back(std::move(*old));
+          }
+          break;
+        }
+      }
+
+      res.emplace_back(type, std::move(val), lloc, from, offset(lines, lloc.last_column, lloc.last_line));
+    }
+    scql_delete_buffer(buffer, scanner);
+
+    tokens = std::move(res);
+    text = s;
+    return kept;
+  }
+
+
+  context::context()
+  {
+    scqllex_init(&scanner);
+  }
+
+
+  context::~context()
+  {
+    scqllex_destroy(scanner);
+  }
+
+
+  int context::parse(const std::string& s)
+  {
+    // The inner nodes of statements are kept for the next parse.  Once most of them are no longer used
+    // everything is parsed again.
+    if (! tokens.update(s, scanner) || nodes.size() > 4 * tokens.tokens.size() + 64) {
+      stages.clear();
+      nodes.clear();
+    }
+    const auto& toks = tokens.tokens;
+
+    // The statements on the outermost level are separated by ';' and '|'.  Those with only kept tokens
+    // which were parsed without errors the last time are reused.  Their inner nodes are moved along
+    // with the tokens.
+    std::vector<std::pair<size_t,size_t>> segments;
+    std::vector<part::cptr_type> reused;
+    int depth = 0;
+    size_t b = 0;
+    for (size_t i = 0; i < toks.size(); ++i) {
+      auto t = toks[i].type;
+      if (t == '(' || t == '[')
+        ++depth;
+      else if ((t == ')' || t == ']') && depth > 0)
+        --depth;
+      else if (t == scqlEND || (depth == 0 && (t == ';' || t == '|'))) {
+        part::cptr_type node = nullptr;
+        if (b < i && (i <= tokens.fresh_from || b >= tokens.fresh_to))
+          if (auto it = stages.find(toks[b].val); it != stages.end() && it->second.last == toks[i - 1].val && it->second.ntokens == i - b) {
+            node = it->second.node;
+            if (auto& old = it->second.lloc; old != toks[b].lloc) {
+              auto dl = toks[b].lloc.first_line - old.first_line;
+              auto dc = toks[b].lloc.first_column - old.first_column;
+              walk(node, [&old, dl, dc](part& p) { if (inner(p)) shift(p.lloc, old.first_line, dl, dc); return true; });
+            }
+          }
+        segments.emplace_back(b, i);
+        reused.push_back(node);
+        b = i + 1;
+      }
+    }
+
+    auto res = run(segments, reused, SIZE_MAX);
+    // After a syntax error the tokens of a later statement might not form a statement anymore.
+    if (res != 0 && std::ranges::any_of(std::views::iota(0zu, segments.size()), [&](auto j) { return reused[j] != nullptr && segments[j].first >= first_error; }))
+      res = run(segments, reused, first_error);
+
+    std::unordered_map<part::cptr_type,cached_stage> next_stages;
+    for (auto [from, to] : segments)
+      if (from < to && to < first_error)
+        if (auto it = reduced.find(end_key(toks[to - 1].lloc)); it != reduced.end() && it->second.first.first_line == toks[from].lloc.first_line && it->second.first.first_column == toks[from].lloc.first_column)
+          next_stages.emplace(toks[from].val, cached_stage { it->second.second, toks[to - 1].val, to - from, toks[from].lloc });
+    stages = std::move(next_stages);
+
+    return res;
+  }
+
+
+  // Parse with the reused statements which start before token UPTO as single tokens.
+  int context::run(const std::vector<std::pair<size_t,size_t>>& segments, const std::vector<part::cptr_type>& reused, size_t upto)
+  {
+    const auto& toks = tokens.tokens;
+    input.clear();
+    origin.clear();
+    for (size_t j = 0; j < segments.size(); ++j) {
+      auto [b, e] = segments[j];
+      if (reused[j] != nullptr && b < upto) {
+        reused[j]->parent = nullptr;
+        input.emplace_back(scqlSTAGE, reused[j], location { toks[b].lloc.first_line, toks[b].lloc.first_column, toks[e - 1].lloc.last_line, toks[e - 1].lloc.last_column }, toks[b].from, toks[e - 1].to);
+        origin.push_back(b);
+      } else
+        for (auto i = b; i < e; ++i) {
+          reuse(*toks[i].val);
+          input.push_back(toks[i]);
+          origin.push_back(i);
+        }
+      // The separator.
+      reuse(*toks[e].val);
+      input.push_back(toks[e]);
+      origin.push_back(e);
+    }
+
+    result = nullptr;
+    next = 0;
+    reduced.clear();
+    first_error = SIZE_MAX;
+    return yyparse(*this);
+  }
+
+
+  int context::next_token(part::cptr_type* lval, location* lloc)
+  {
+    // After the END token the input is exhausted.  Error recovery would otherwise discard END tokens
+    // forever.
+    if (next >= input.size()) {
+      *lval = syntax::alloc(nodes, input.back().lloc);
+      *lloc = input.back().lloc;
+      return 0;
+    }
+    auto& t = input[next++];
+    *lval = t.val;
+    *lloc = t.lloc;
+    return t.type;
+  }
+
+
+  void context::reduced_stage(const location& lloc, part::cptr_type p)
+  {
+    if (p != nullptr)
+      reduced.insert_or_assign(end_key(lloc), std::pair { lloc, p });
+  }
+
+
+  // The error is noticed at the token read last.
+  void context::syntax_error()
+  {
+    if (next > 0)
+      first_error = std::min(first_error, origin[next - 1]);
+  }
+
+} // namespace scql
@@ -0,0 +1,345 @@
+#include "wal.hh"
+#include "compress.hh"
+#include "hash.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <optional>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace std::literals;
+
+
+namespace scql::data {
+
+  namespace {
+
+    // Each record is the length of the body, a checksum of the body, and the body.  The length has
+    // 64 bits, the body of an added version contains all of its data.
+    constexpr size_t frame_size = sizeof(uint64_t) + sizeof(uint64_t);
+
+
+    struct writer {
+      template<typename T>
+      void put(T v) { out.append(reinterpret_cast<const char*>(&v), sizeof(v)); }
+
+      void put(const std::string& s)
+      {
+        put(uint32_t(s.size()));
+        out += s;
+      }
+
+      void put(const std::vector<size_t>& d)
+      {
+        put(uint32_t(d.size()));
+        for (auto e : d)
+          put<uint64_t>(e);
+      }
+
+      void put(const void* p, size_t n)
+      {
+        put<uint64_t>(n);
+        out.append(static_cast<const char*>(p), n);
+      }
+
+      std::string finish()
+      {
+        uint64_t len = out.size() - frame_size;
+        auto sum = hash_bytes(reinterpret_cast<const std::byte*>(out.data() + frame_size), len);
+        std::memcpy(out.data(), &len, sizeof(len));
+        std::memcpy(out.data() + sizeof(len), &sum, sizeof(sum));
+        return std::move(out);
+      }
+
+      std::string out = std::string(frame_size, '\0');
+    };
+
+
+    // Reading stops at the end of the body.  All getters fail from then on.
+    struct reader {
+      template<typename T>
+      bool get(T& v)
+      {
+        if (size_t(end - p) < sizeof(T))
+          return false;
+        std::memcpy(&v, p, sizeof(T));
+        p += sizeof(T);
+        return true;
+      }
+
+      bool get(std::string& s)
+      {
+        uint32_t n;
+        if (! get(n) || size_t(end - p) < n)
+          return false;
+        s.assign(reinterpret_cast<const char*>(p), n);
+        p += n;
+        return true;
+      }
+
+      bool get(std::vector<size_t>& d)
+      {
+        uint32_t n;
+        if (! get(n))
+          return false;
+        d.clear();
+        for (uint32_t i = 0; i < n; ++i) {
+          uint64_t e;
+          if (! get(e))
+            return false;
+          d.push_back(e);
+        }
+        return true;
+      }
+
+      bool get(std::vector<std::byte>& b)
+      {
+        uint64_t n;
+        if (! get(n) || size_t(end - p) < n)
+          return false;
+        b.assign(p, p + n);
+        p += n;
+        return true;
+      }
+
+      const std::byte* p;
+      const std::byte* end;
+    };
+
+
+    // The description of a schema, without data and encodings.
+    void put_schema(writer& w, const schema& s)
+    {
+      w.put(s.title);
+      w.put(uint8_t(s.layout));
+      w.put(uint8_t(s.writable));
+      w.put(s.dimens);
+      w.put(uint32_t(s.columns.size()));
+      for (const auto& c : s.columns) {
+        w.put(uint32_t(c.type));
+        w.put(c.dimens);
+        w.put(c.label);
+      }
+    }
+
+    bool get_schema(reader& r, schema& s)
+    {
+      uint8_t layout;
+      uint8_t writable;
+      uint32_t ncols;
+      if (! r.get(s.title) || ! r.get(layout) || ! r.get(writable) || ! r.get(s.dimens) || ! r.get(ncols))
+        return false;
+      s.layout = layout_type(layout);
+      s.writable = writable != 0;
+      for (uint32_t j = 0; j < ncols; ++j) {
+        uint32_t type;
+        auto& c = s.columns.emplace_back(data_type::u8, std::vector<size_t> { }, ""s);
+        if (! r.get(type) || ! r.get(c.dimens) || ! r.get(c.label))
+          return false;
+        c.type = data_type(type);
+      }
+      return true;
+    }
+
+
+    std::optional<wal_record> parse(reader& r)
+    {
+      uint8_t kind;
+      wal_record rec { wal_record::kind_type::add, 0, { } };
+      if (! r.get(kind) || ! r.get(rec.id) || ! r.get(rec.name))
+        return std::nullopt;
+      rec.kind = wal_record::kind_type(kind);
+
+      if (rec.kind == wal_record::kind_type::add) {
+        if (! get_schema(r, rec.s) || ! r.get(rec.bytes) || rec.bytes.size() != rec.s.nelems() * rec.s.row_size())
+          return std::nullopt;
+      } else if (rec.kind == wal_record::kind_type::update) {
+        uint64_t offset;
+        if (! r.get(offset) || ! r.get(rec.bytes))
+          return std::nullopt;
+        rec.offset = offset;
+      } else if (rec.kind != wal_record::kind_type::abort)
+        return std::nullopt;
+
+      return rec;
+    }
+
+  } // anonymous namespace
+
+
+  std::string encode_add(uint64_t id, const std::string& name, const schema& s)
+  {
+    auto ps = plain(s);
+
+    writer w;
+    w.put(uint8_t(wal_record::kind_type::add));
+    w.put(id);
+    w.put(name);
+    put_schema(w, ps);
+    w.put(ps.data, ps.data == nullptr ? 0 : ps.nelems() * ps.row_size());
+    return w.finish();
+  }
+
+
+  std::string encode_schema(const std::string& name, const schema& s)
+  {
+    writer w;
+    w.put(name);
+    put_schema(w, s);
+    return w.finish();
+  }
+
+
+  bool decode_schema(const std::byte* p, size_t n, std::string& name, schema& s)
+  {
+    if (n < frame_size)
+      return false;
+    reader r { p + frame_size, p + n };
+    return r.get(name) && get_schema(r, s);
+  }
+
+
+  std::string encode_update(uint64_t id, const std::string& name, size_t offset, const void* p, size_t n)
+  {
+    writer w;
+    w.put(uint8_t(wal_record::kind_type::update));
+    w.put(id);
+    w.put(name);
+    w.put<uint64_t>(offset);
+    w.put(p, n);
+    return w.finish();
+  }
+
+
+  std::string encode_abort(uint64_t id)
+  {
+    writer w;
+    w.put(uint8_t(wal_record::kind_type::abort));
+    w.put(id);
+    w.put(""s);
+    return w.finish();
+  }
+
+
+  std::vector<wal_record> read_log(const std::string& path)
+  {
+    std::vector<wal_record> res;
+
+    auto fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd == -1)
+      return res;
+
+    std::vector<std::byte> buf;
+    struct stat st;
+    if (::fstat(fd, &st) == 0) {
+      buf.resize(st.st_size);
+      size_t have = 0;
+      while (have < buf.size()) {
+        auto r = ::pread(fd, buf.data() + have, buf.size() - have, have);
+        if (r == -1 && errno == EINTR)
+          continue;
+        if (r <= 0)
+          break;
+        have += r;
+      }
+      buf.resize(have);
+    }
+
+    size_t valid = 0;
+    while (buf.size() - valid >= frame_size) {
+      uint64_t len;
+      uint64_t sum;
+      std::memcpy(&len, buf.data() + valid, sizeof(len));
+      std::memcpy(&sum, buf.data() + valid + sizeof(len), sizeof(sum));
+      auto body = buf.data() + valid + frame_size;
+      if (buf.size() - valid - frame_size < len || hash_bytes(body, len) != sum)
+        break;
+      reader r { body, body + len };
+      auto rec = parse(r);
+      if (! rec)
+        break;
+      res.emplace_back(std::move(*rec));
+      valid += frame_size + len;
+    }
+
+    if (valid < buf.size() && ::ftruncate(fd, valid) == 0)
+      ::fsync(fd);
+    ::close(fd);
+
+    return res;
+  }
+
+
+  wal::wal(const std::string& path)
+  : fd(::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644))
+  {
+  }
+
+
+  wal::~wal()
+  {
+    if (fd != -1)
+      ::close(fd);
+  }
+
+
+  uint64_t wal::append(std::string&& rec)
+  {
+    std::lock_guard guard(lock);
+    pending += rec;
+    return ++appended;
+  }
+
+
+  bool wal::commit(uint64_t lsn)
+  {
+    std::unique_lock guard(lock);
+    while (durable < lsn && ! failed && fd != -1) {
+      if (flushing) {
+        cv.wait(guard);
+        continue;
+      }
+
+      // This thread writes the records of all waiting threads.
+      flushing = true;
+      auto buf = std::move(pending);
+      pending.clear();
+      auto upto = appended;
+      guard.unlock();
+
+      bool ok = true;
+      for (size_t off = 0; ok && off < buf.size(); ) {
+        auto r = ::write(fd, buf.data() + off, buf.size() - off);
+        if (r == -1 && errno == EINTR)
+          continue;
+        ok = r > 0;
+        off += std::max<ssize_t>(r, 0);
+      }
+      ok = ok && ::fdatasync(fd) == 0;
+
+      guard.lock();
+      flushing = false;
+      if (ok)
+        durable = upto;
+      else
+        failed = true;
+      cv.notify_all();
+    }
+    return durable >= lsn;
+  }
+
+
+  bool wal::reset()
+  {
+    std::unique_lock guard(lock);
+    cv.wait(guard, [this]{ return ! flushing; });
+    pending.clear();
+    durable = appended;
+    return fd != -1 && ::ftruncate(fd, 0) == 0 && ::fsync(fd) == 0;
+  }
+
+} // namespace scql::data
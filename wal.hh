@@ -0,0 +1,78 @@
+#ifndef _WAL_HH
+#define _WAL_HH 1
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "data.hh"
+
+
+namespace scql::data {
+
+  // A mutation of the catalog as stored in the log.  For an addition S describes the new version and
+  // BYTES is its data, for an update BYTES replaces the data at OFFSET.  An abort record says that the
+  // change with the same id was logged but could not be applied, it is not replayed.
+  struct wal_record {
+    enum struct kind_type : uint8_t {
+      add,
+      update,
+      abort,
+    };
+
+    kind_type kind;
+    uint64_t id;
+    std::string name;
+    schema s {};
+    size_t offset = 0;
+    std::vector<std::byte> bytes {};
+  };
+
+  std::string encode_add(uint64_t id, const std::string& name, const schema& s);
+  std::string encode_update(uint64_t id, const std::string& name, size_t offset, const void* p, size_t n);
+  std::string encode_abort(uint64_t id);
+
+  // Just the name and the description of a schema, in the same format.
+  std::string encode_schema(const std::string& name, const schema& s);
+  bool decode_schema(const std::byte* p, size_t n, std::string& name, schema& s);
+
+  // The complete records in the log at PATH.  A torn record at the end, from a crash while writing,
+  // is cut off the file.
+  std::vector<wal_record> read_log(const std::string& path);
+
+
+  // Append-only log with group commit.  Records are appended to a buffer.  The first thread waiting
+  // for its record to become durable writes and syncs the buffer for all records appended so far,
+  // threads arriving in the meantime wait for this or the next flush.
+  class wal {
+  public:
+    explicit wal(const std::string& path);
+    wal(const wal&) = delete;
+    wal& operator=(const wal&) = delete;
+    ~wal();
+
+    bool ok() const { return fd != -1 && ! failed; }
+
+    // The result is the sequence number to wait for.
+    uint64_t append(std::string&& rec);
+    bool commit(uint64_t lsn);
+
+    // Drop all records, they are part of a checkpoint.
+    bool reset();
+
+  private:
+    int fd;
+    std::mutex lock {};
+    std::condition_variable cv {};
+    std::string pending {};
+    uint64_t appended = 0;
+    uint64_t durable = 0;
+    bool flushing = false;
+    bool failed = false;
+  };
+
+} // namespace scql::data
+
+#endif // wal.hh
@@ -0,0 +1,447 @@
+#include "workers.hh"
+#include "scql.hh"
+#include "code.hh"
+#include "compress.hh"
+#include "hash.hh"
+#include "parallel.hh"
+#include "shm.hh"
+#include "sort.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <format>
+#include <limits>
+#include <optional>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+using namespace std::literals;
+
+
+namespace scql::data {
+
+  namespace {
+
+    // Address space of the exchange region.  Nothing is allocated before it is used.
+    constexpr size_t region_size = 1zu << 36;
+
+
+    // Elements per record, also for empty data.
+    size_t per_record(const schema& s)
+    {
+      size_t res = 1;
+      for (size_t i = 1; i < s.dimens.size(); ++i)
+        res *= s.dimens[i];
+      return res;
+    }
+
+
+    bool send_msg(int fd, const std::string& msg)
+    {
+      ssize_t r;
+      while ((r = ::send(fd, msg.data(), msg.size(), MSG_NOSIGNAL)) == -1 && errno == EINTR)
+        ;
+      return r == ssize_t(msg.size());
+    }
+
+
+    // Messages are sent as single packets, the size is known before reading.
+    std::optional<std::string> recv_msg(int fd)
+    {
+      ssize_t n;
+      while ((n = ::recv(fd, nullptr, 0, MSG_PEEK | MSG_TRUNC)) == -1 && errno == EINTR)
+        ;
+      if (n <= 0)
+        return std::nullopt;
+      std::string res(n, '\0');
+      while ((n = ::recv(fd, res.data(), res.size(), 0)) == -1 && errno == EINTR)
+        ;
+      if (n != ssize_t(res.size()))
+        return std::nullopt;
+      return res;
+    }
+
+
+    template<typename T>
+    void put(std::string& out, T v)
+    {
+      out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+    }
+
+
+    template<typename T>
+    T get(const std::string& in, size_t off)
+    {
+      T r;
+      std::memcpy(&r, in.data() + off, sizeof(T));
+      return r;
+    }
+
+
+    // The function calls of FRAGMENT, which PARSER keeps.
+    std::variant<std::vector<fcall*>,std::string> operations(scql::context& parser, const std::string& fragment)
+    {
+      if (parser.parse(fragment) != 0 || ! parser.result || ! parser.result->is(id_type::pipeline))
+        return std::format("invalid plan fragment \"{}\"", fragment);
+
+      std::vector<fcall*> res;
+      for (auto& e : as<pipeline>(parser.result)->l) {
+        if (e == nullptr || ! e->is(id_type::statements) || as<statements>(e)->l.size() != 1)
+          return "plan fragment must be a pipeline of operations"s;
+        auto& stage = as<statements>(e)->l[0];
+        if (stage == nullptr || ! stage->is(id_type::fcall))
+          return "plan fragment must be a pipeline of operations"s;
+        auto f = as<fcall>(stage);
+        if (! f->fname || ! f->fname->is(id_type::ident))
+          return "plan fragment must be a pipeline of operations"s;
+        auto& fname = as<ident>(f->fname)->val;
+        if (auto av = code::available.match(fname); av.size() != 1 || av[0] != fname)
+          return std::format("unknown operation {}", fname);
+        if (! code::available.get(fname).runs())
+          return std::format("operation {} cannot be run yet", fname);
+        res.push_back(f);
+      }
+      return res;
+    }
+
+
+    // Run the operations of FRAGMENT, one after the other, on IN.  The results are added to REGION as
+    // they become available, the indices of their entries are returned.
+    std::variant<std::vector<uint64_t>,std::string> execute(const schema& in, const std::string& fragment, shared_region& region)
+    {
+      scql::context parser;
+      auto ops = operations(parser, fragment);
+      if (std::holds_alternative<std::string>(ops))
+        return std::get<std::string>(ops);
+
+      std::vector<code::step> steps;
+      std::vector<schema> shapes { in };
+      for (auto f : std::get<std::vector<fcall*>>(ops)) {
+        auto& fname = as<ident>(f->fname)->val;
+        auto& fct = code::available.get(fname);
+        std::vector<const schema*> cur;
+        for (auto& s : shapes)
+          cur.push_back(&s);
+        auto shape = fct.output_shape(cur, f->args);
+        if (std::holds_alternative<std::string>(shape))
+          return std::format("{}: {}", fname, std::get<std::string>(shape));
+        shapes = std::move(std::get<std::vector<schema>>(shape));
+        steps.push_back({ &fct, &f->args });
+      }
+
+      std::vector<uint64_t> idx;
+      code::cursor c(std::move(steps), { &in });
+      while (auto g = c.next())
+        for (const auto& o : *g) {
+          auto e = region.add("", o);
+          if (! e)
+            return "exchange region is full"s;
+          idx.push_back(*e);
+        }
+
+      return idx;
+    }
+
+
+    // Requests are the index of the partition in the region and the fragment.  The reply is a flag
+    // followed by the indices of the results in the region or an error message.
+    [[noreturn]] void serve(int fd, shared_region& region)
+    {
+      while (auto req = recv_msg(fd)) {
+        std::string reply;
+        auto part = req->size() < sizeof(uint64_t) ? std::nullopt : region.get(get<uint64_t>(*req, 0));
+        if (! part) {
+          put(reply, uint8_t(0));
+          reply += "invalid request";
+        } else {
+          // The partition is no longer used once the parent has the reply, the region is reset then.
+          auto res = execute(part->second.s, req->substr(sizeof(uint64_t)), region);
+          part.reset();
+          if (std::holds_alternative<std::string>(res)) {
+            put(reply, uint8_t(0));
+            reply += std::get<std::string>(res);
+          } else {
+            put(reply, uint8_t(1));
+            for (auto idx : std::get<std::vector<uint64_t>>(res))
+              put(reply, idx);
+          }
+        }
+
+        if (! send_msg(fd, reply))
+          break;
+      }
+
+      ::_exit(0);
+    }
+
+
+    // The counts of all workers added up.
+    schema sum_counts(const std::vector<schema>& parts)
+    {
+      uint64_t n = 0;
+      for (const auto& p : parts)
+        n += p.view(0).get<uint32_t>(0);
+      schema res { parts[0].title, parts[0].columns, { 1zu }, nullptr };
+      auto buf = std::make_shared_for_overwrite<std::byte[]>(sizeof(uint32_t));
+      uint32_t n32 = n;
+      std::memcpy(buf.get(), &n32, sizeof(n32));
+      res.data = buf.get();
+      res.owner = std::move(buf);
+      return res;
+    }
+
+  } // anonymous namespace
+
+
+  std::vector<std::vector<uint32_t>> partition(const schema& s, partitioning how, size_t key, size_t n)
+  {
+    std::vector<std::vector<uint32_t>> res(std::max(1zu, n));
+    auto nrec = s.dimens.empty() ? 0 : s.dimens[0];
+    if (res.size() == 1 || nrec == 0 || how == partitioning::block) {
+      for (size_t i = 0; i < res.size(); ++i) {
+        auto [from, to] = block(nrec, unsigned(res.size()), unsigned(i));
+        for (auto r = uint32_t(from); r < to; ++r)
+          res[i].push_back(r);
+      }
+      return res;
+    }
+
+    auto ps = plain(s);
+    auto& c = ps.columns[key];
+    auto v = ps.view(key);
+    auto per = per_record(ps);
+
+    if (how == partitioning::hash) {
+      auto csize = c.size();
+      for (uint32_t r = 0; r < nrec; ++r)
+        res[hash_bytes(v.addr(r * per), csize) % res.size()].push_back(r);
+      return res;
+    }
+
+    // Bounds at the quantiles of an evenly spaced sample of the keys.  NaNs are ordered last, as by
+    // value_less, they all go to the last partition.
+    auto nan_last = [](double a, double b) { return ! std::isnan(a) && (std::isnan(b) || a < b); };
+    constexpr size_t sample_per_partition = 256;
+    auto step = std::max(1zu, nrec / (sample_per_partition * res.size()));
+    std::vector<double> sample;
+    for (size_t r = 0; r < nrec; r += step)
+      sample.push_back(to_double(c.type, v.addr(r * per)));
+    std::ranges::sort(sample, nan_last);
+    std::vector<double> bounds;
+    for (size_t i = 1; i < res.size(); ++i)
+      bounds.push_back(sample[i * sample.size() / res.size()]);
+
+    for (uint32_t r = 0; r < nrec; ++r)
+      if (auto k = to_double(c.type, v.addr(r * per)); std::isnan(k))
+        res.back().push_back(r);
+      else
+        res[std::ranges::upper_bound(bounds, k, nan_last) - bounds.begin()].push_back(r);
+    return res;
+  }
+
+
+  schema gather(const schema& s, const std::vector<uint32_t>& recs)
+  {
+    schema res { s.title, s.columns, s.dimens, nullptr };
+    res.layout = s.layout;
+    if (res.dimens.empty())
+      res.dimens.push_back(recs.size());
+    else
+      res.dimens[0] = recs.size();
+    auto per = per_record(s);
+
+    auto buf = std::make_shared_for_overwrite<std::byte[]>(std::max(1zu, res.nelems() * res.row_size()));
+    res.data = buf.get();
+    res.owner = std::move(buf);
+
+    if (s.layout == layout_type::rows) {
+      auto rs = per * s.row_size();
+      for (size_t k = 0; k < recs.size(); ++k)
+        std::memcpy(static_cast<std::byte*>(res.data) + k * rs, static_cast<const std::byte*>(s.data) + recs[k] * rs, rs);
+    } else
+      for (size_t j = 0; j < s.columns.size(); ++j) {
+        auto src = s.view(j);
+        auto dst = res.view(j);
+        auto rs = per * s.columns[j].size();
+        for (size_t k = 0; k < recs.size(); ++k)
+          std::memcpy(dst.addr(k * per), src.addr(recs[k] * per), rs);
+      }
+
+    return res;
+  }
+
+
+  schema concat(const std::vector<schema>& parts)
+  {
+    schema res { parts[0].title, parts[0].columns, parts[0].dimens, nullptr };
+    res.layout = parts[0].layout;
+    if (res.dimens.empty())
+      res.dimens.push_back(0);
+    res.dimens[0] = 0;
+    for (const auto& p : parts)
+      res.dimens[0] += p.dimens.empty() ? 1 : p.dimens[0];
+    auto per = per_record(parts[0]);
+
+    auto buf = std::make_shared_for_overwrite<std::byte[]>(std::max(1zu, res.nelems() * res.row_size()));
+    res.data = buf.get();
+    res.owner = std::move(buf);
+
+    size_t at = 0;
+    for (const auto& p : parts) {
+      auto nrec = p.dimens.empty() ? 1 : p.dimens[0];
+      if (res.layout == layout_type::rows)
+        std::memcpy(static_cast<std::byte*>(res.data) + at * per * res.row_size(), p.data, nrec * per * p.row_size());
+      else
+        for (size_t j = 0; j < res.columns.size(); ++j)
+          std::memcpy(res.view(j).addr(at * per), p.view(j).addr(0), nrec * per * p.columns[j].size());
+      at += nrec;
+    }
+
+    return res;
+  }
+
+
+  bool distributable(const std::vector<std::string>& operations)
+  {
+    auto row_local = [](const std::string& fname) { return fname == "filter" || fname == "compress"; };
+    auto n = operations.size();
+    if (n > 0 && operations.back() == "count")
+      --n;
+    return std::all_of(operations.begin(), operations.begin() + n, row_local);
+  }
+
+
+  worker_pool::worker_pool(size_t n)
+  {
+    auto name = std::format("/scql-workers-{}", ::getpid());
+    region = shared_region::open(name, region_size);
+    // The mapping is inherited, nobody else needs to find the object.
+    ::shm_unlink(name.c_str());
+    if (! region)
+      return;
+
+    for (size_t i = 0; i < n; ++i) {
+      int fds[2];
+      if (::socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) != 0)
+        break;
+      auto pid = ::fork();
+      if (pid == 0) {
+        ::signal(SIGINT, SIG_IGN);
+        ::close(fds[0]);
+        for (const auto& w : workers)
+          ::close(w.fd);
+        serve(fds[1], *region);
+      }
+      ::close(fds[1]);
+      if (pid == -1) {
+        ::close(fds[0]);
+        break;
+      }
+      workers.emplace_back(pid, fds[0]);
+    }
+  }
+
+
+  worker_pool::~worker_pool()
+  {
+    // The workers exit when their socket is closed.
+    for (const auto& w : workers)
+      ::close(w.fd);
+    for (const auto& w : workers)
+      ::waitpid(w.pid, nullptr, 0);
+  }
+
+
+  std::variant<std::vector<schema>,std::string> worker_pool::run(const schema& s, partitioning how, size_t key, const std::string& fragment)
+  {
+    if (workers.empty())
+      return "no workers"s;
+    if (key >= s.columns.size())
+      return "invalid key column"s;
+    if (how == partitioning::range && ! sortable(s.columns[key]))
+      return "range partitioning requires a scalar number key"s;
+    if (s.dimens.empty() || s.dimens[0] > std::numeric_limits<uint32_t>::max())
+      return "input must have between one and 2^32 records"s;
+
+    std::lock_guard guard(lock);
+    scql::context parser;
+    auto ops = operations(parser, fragment);
+    if (std::holds_alternative<std::string>(ops))
+      return std::get<std::string>(ops);
+    std::vector<std::string> fnames;
+    for (auto f : std::get<std::vector<fcall*>>(ops))
+      fnames.push_back(as<ident>(f->fname)->val);
+    if (! distributable(fnames))
+      return "plan fragment must consist of row-local operations, optionally followed by count"s;
+    auto counts = ! fnames.empty() && fnames.back() == "count";
+
+    region->reset();
+
+    // Each partition is copied into the exchange region by a separate thread.  All partitions are
+    // added before the first request is sent, the workers must not get out of sync.
+    auto ps = plain(s);
+    auto parts = partition(ps, how, key, workers.size());
+    std::vector<std::optional<size_t>> in_idx(workers.size());
+    auto nt = unsigned(std::min<size_t>(workers.size(), nthreads(ps.dimens[0])));
+    parallel(nt, [&](unsigned t) {
+      auto [from, to] = block(workers.size(), nt, t);
+      for (auto i = from; i < to; ++i)
+        in_idx[i] = region->add("", gather(ps, parts[i]));
+    });
+    if (! std::ranges::all_of(in_idx, [](const auto& idx) { return idx.has_value(); }))
+      return "exchange region is full"s;
+
+    for (size_t i = 0; i < workers.size(); ++i) {
+      std::string req;
+      put<uint64_t>(req, *in_idx[i]);
+      req += fragment;
+      if (! send_msg(workers[i].fd, req))
+        return std::format("worker {} is gone", i);
+    }
+
+    // All replies have to be read, even after an error, to keep the workers in sync.
+    std::vector<std::vector<uint64_t>> out_idx(workers.size());
+    std::string error;
+    for (size_t i = 0; i < workers.size(); ++i) {
+      auto reply = recv_msg(workers[i].fd);
+      if (! reply || reply->empty()) {
+        error = std::format("worker {} is gone", i);
+        continue;
+      }
+      if (get<uint8_t>(*reply, 0) == 0) {
+        error = reply->substr(1);
+        continue;
+      }
+      for (size_t off = 1; off + sizeof(uint64_t) <= reply->size(); off += sizeof(uint64_t))
+        out_idx[i].push_back(get<uint64_t>(*reply, off));
+    }
+    if (! error.empty())
+      return error;
+    if (std::ranges::any_of(out_idx, [&](const auto& idx) { return idx.size() != out_idx[0].size(); }))
+      return "workers returned different numbers of results"s;
+
+    // The results are copied out of the region, it is reused for the next query.
+    std::vector<schema> res;
+    for (size_t j = 0; j < out_idx[0].size(); ++j) {
+      std::vector<schema> pieces;
+      for (const auto& idx : out_idx) {
+        auto e = region->get(idx[j]);
+        if (! e)
+          return std::format("result {} of a worker is missing from the exchange region", j);
+        pieces.emplace_back(std::move(e->second.s));
+      }
+      if (std::ranges::any_of(pieces, [&](const auto& p) { return p.layout != pieces[0].layout || per_record(p) != per_record(pieces[0]) || p.columns.size() != pieces[0].columns.size() || ! std::ranges::equal(p.columns, pieces[0].columns, {}, &schema::column::type, &schema::column::type); }))
+        return std::format("results {} of the workers differ in their shape", j);
+      res.emplace_back(counts ? sum_counts(pieces) : concat(pieces));
+    }
+
+    return res;
+  }
+
+} // namespace scql::data
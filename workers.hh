@@ -0,0 +1,79 @@
+#ifndef _WORKERS_HH
+#define _WORKERS_HH 1
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <variant>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "data.hh"
+
+
+namespace scql::data {
+
+  enum struct partitioning : uint8_t {
+    hash,
+    range,
+    block,
+  };
+
+
+  // The records of S in each of N partitions, determined by the first value of column KEY in each
+  // record.  Range partitions are ordered, all keys of one partition are not greater than the keys of
+  // the next.  The bounds are taken from a sample.  Block partitions are runs of consecutive records
+  // of about the same size, the key is not used.
+  std::vector<std::vector<uint32_t>> partition(const schema& s, partitioning how, size_t key, size_t n);
+
+  // The records RECS of the plain data in S, in the same layout.
+  schema gather(const schema& s, const std::vector<uint32_t>& recs);
+
+  // The records of all PARTS, which must have the same columns, in order.
+  schema concat(const std::vector<schema>& parts);
+
+
+  // Whether a plan fragment consisting of OPERATIONS, in order, can be run by a worker_pool.  These
+  // are the operations whose output for some records is the concatenation of the outputs for the
+  // partitions, optionally followed by a count.  Sorting, grouping and the like would need the
+  // outputs of the workers to be merged.
+  bool distributable(const std::vector<std::string>& operations);
+
+
+  // Local processes, each standing in for a node of a cluster.  The input is partitioned and each
+  // worker runs the same plan fragment, the text of a pipeline of operations, on its partition.  The
+  // partitions and the results are exchanged through a shared-memory region, the fragments and the
+  // location of the data are sent over sockets.  The workers are forked when the pool is created, this
+  // must happen before other threads are started.  One fragment is run at a time.
+  class worker_pool {
+  public:
+    // Smaller inputs are not worth distributing.
+    static constexpr size_t min_records = 1 << 16;
+
+    explicit worker_pool(size_t n);
+    worker_pool(const worker_pool&) = delete;
+    worker_pool& operator=(const worker_pool&) = delete;
+    ~worker_pool();
+
+    size_t size() const { return workers.size(); }
+
+    // Output J is the concatenation of output J of all workers in the order of the partitions, the sum
+    // for a count.  The fragment must be distributable().
+    std::variant<std::vector<schema>,std::string> run(const schema& s, partitioning how, size_t key, const std::string& fragment);
+
+  private:
+    struct worker {
+      pid_t pid;
+      int fd;
+    };
+
+    std::mutex lock {};
+    std::shared_ptr<shared_region> region {};
+    std::vector<worker> workers {};
+  };
+
+} // namespace scql::data
+
+#endif // workers.hh